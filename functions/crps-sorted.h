@@ -0,0 +1,62 @@
+#ifndef CRPS_SORTED_H
+#define CRPS_SORTED_H
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+// Sorted-sample CRPS kernel shared by makeCRPS and makeScores
+
+//
+// For draws x_1, ..., x_S with weights w_k summing to W the score is
+//
+//   CRPS = sum_k w_k |x_k - y| / W - 0.5 sum_k sum_l w_k w_l |x_k - x_l| / W^2
+//
+// Once the draws are sorted the double sum is a single pass,
+//
+//   sum_k sum_l w_k w_l |x_k - x_l| = 2 sum_i w_(i) x_(i) (C_(i-1) + C_(i) - W),
+//
+// with C_(i) the cumulative weight of the i smallest draws, and the accuracy
+// term for any truth y follows from the prefix sums of w and w * x below
+// the position of y in the sorted draws. Each observation costs
+// O(S log S) for the sort plus O(log S) per truth instead of O(S^2).
+// Observations are independent and are scored in parallel.
+//
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////// CRPS of one column of sorted draws //////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+inline void crps_sorted (const std::vector<std::pair<double, double> >& draws,
+                         std::vector<double>& cum_w, std::vector<double>& cum_wx,
+                         const double* truth, const int& n_truth,
+                         const int& stride, double* CRPS) {
+  // draws holds the (value, weight) pairs sorted by value, cum_w and cum_wx
+  // are work buffers of length S + 1, truth and CRPS are strided by stride
+  int S = draws.size();
+  cum_w[0] = 0.0;
+  cum_wx[0] = 0.0;
+  for (int i=0; i<S; i++) {
+    cum_w[i + 1] = cum_w[i] + draws[i].second;
+    cum_wx[i + 1] = cum_wx[i] + draws[i].second * draws[i].first;
+  }
+  double W = cum_w[S];
+  double precision = 0.0;
+  for (int i=0; i<S; i++) {
+    precision += draws[i].second * draws[i].first *
+      (cum_w[i] + cum_w[i + 1] - W);
+  }
+  precision *= 2.0 / (W * W);
+  for (int t=0; t<n_truth; t++) {
+    double y = truth[t * stride];
+    // number of draws strictly below the truth
+    int below = std::lower_bound(draws.begin(), draws.end(),
+                                 std::make_pair(y, - HUGE_VAL)) - draws.begin();
+    double accuracy = y * cum_w[below] - cum_wx[below] +
+      (cum_wx[S] - cum_wx[below]) - y * (cum_w[S] - cum_w[below]);
+    CRPS[t * stride] = accuracy / W - 0.5 * precision;
+  }
+}
+
+#endif
@@ -1,7 +1,14 @@
 #include <RcppArmadillo.h>
+#include "crps-sorted.h"
+#include <algorithm>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 // [[Rcpp::depends(RcppArmadillo)]]
 // [[Rcpp::interfaces(r, cpp)]]
+// [[Rcpp::plugins(openmp)]]
 
 using namespace Rcpp;
 using namespace arma;
@@ -10,23 +17,67 @@ using namespace arma;
 // Calculate the continuous ranked probability score in the negative orientation...
 //
 
-//[[Rcpp::export]]
-arma::vec makeCRPS(const arma::mat& estimate, const arma::vec& truth,
-                   const int& n_samps){
-  int N = truth.n_elem;
-  arma::vec CRPS(N, fill::zeros);
-  for(int j=0; j<N; j++){
-    double accuracy = 0.0;
-    double precision = 0.0;
-    for(int k=0; k<n_samps; k++){
-      Rcpp::checkUserInterrupt();
-      accuracy += std::abs(estimate(k, j) - truth(j));
-      for(int l=0; l<n_samps; l++){
-        precision += std::abs(estimate(k, j) - estimate(l, j));
+///////////////////////////////////////////////////////////////////////////////
+//////////////////////// CRPS across all observations /////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+arma::mat crps_engine (const arma::mat& estimate, const arma::mat& truth,
+                       const arma::vec& weights, const int& n_samps) {
+  // estimate is n_samps by N, truth is N by n_truth and weights has one
+  // entry per draw
+  int N = estimate.n_cols;
+  int n_truth = truth.n_cols;
+  if (n_samps < 1 || (arma::uword)n_samps > estimate.n_rows) {
+    Rcpp::stop("n_samps must be between 1 and the number of rows of estimate");
+  }
+  if (truth.n_rows != (arma::uword)N) {
+    Rcpp::stop("truth must have one row per column of estimate");
+  }
+  if (weights.n_elem != (arma::uword)n_samps) {
+    Rcpp::stop("weights must have one entry per posterior sample");
+  }
+  if (any(weights < 0.0) || accu(weights) <= 0.0) {
+    Rcpp::stop("weights must be non-negative with a positive sum");
+  }
+  arma::mat CRPS(N, n_truth);
+  const double* weights_mem = weights.memptr();
+  const double* truth_mem = truth.memptr();
+  double* CRPS_mem = CRPS.memptr();
+  #pragma omp parallel
+  {
+    std::vector<std::pair<double, double> > draws(n_samps);
+    std::vector<double> cum_w(n_samps + 1);
+    std::vector<double> cum_wx(n_samps + 1);
+    #pragma omp for schedule(static)
+    for (int j=0; j<N; j++) {
+      const double* estimate_col = estimate.colptr(j);
+      for (int k=0; k<n_samps; k++) {
+        draws[k] = std::make_pair(estimate_col[k], weights_mem[k]);
       }
+      std::sort(draws.begin(), draws.end());
+      crps_sorted(draws, cum_w, cum_wx, truth_mem + j, n_truth, N,
+                  CRPS_mem + j);
     }
-    CRPS(j) = 1.0 / n_samps * accuracy - 0.5 / pow(n_samps, 2) * precision;
   }
   return(CRPS);
 }
 
+//[[Rcpp::export]]
+arma::vec makeCRPS(const arma::mat& estimate, const arma::vec& truth,
+                   const int& n_samps){
+  arma::vec weights(n_samps, fill::ones);
+  return(crps_engine(estimate, truth, weights, n_samps).col(0));
+}
+
+//
+// Weighted CRPS for several truth vectors at once, e.g. the held out values
+// of more than one fold or variable scored against the same draws. Each
+// column of truth is one truth vector and the result has the matching
+// column of scores.
+//
+
+//[[Rcpp::export]]
+arma::mat makeCRPSWeighted(const arma::mat& estimate, const arma::mat& truth,
+                           const arma::vec& weights){
+  return(crps_engine(estimate, truth, weights, weights.n_elem));
+}
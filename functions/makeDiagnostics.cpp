@@ -0,0 +1,304 @@
+#include <RcppArmadillo.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// [[Rcpp::depends(RcppArmadillo)]]
+// [[Rcpp::plugins(openmp)]]
+
+using namespace Rcpp;
+using namespace arma;
+
+//
+// Convergence diagnostics for custom coded model MCMC output...
+//
+
+//
+// out is a list of chains, each an n_samples by n_variables matrix as
+// returned by convert_to_coda. Every variable is processed independently and
+// in parallel straight from the R owned chains: the classic and split R-hat
+// come from Welford running means and variances, and the rank-normalised
+// R-hat and the bulk and tail effective sample sizes follow Vehtari et al.
+// (2021) as implemented in the posterior package. Besides the outputs only
+// per-thread buffers for the draws of a single variable are allocated, so the
+// memory is O(n_variables + n_chains * n_samples) rather than the
+// n_variables by n_chains by n_samples array of make_gelman_rubin.
+//
+
+///////////////////////////////////////////////////////////////////////////////
+//////////////////////// Welford mean and variance ////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+struct welford {
+  double n;
+  double mean;
+  double M2;
+
+  welford () : n(0.0), mean(0.0), M2(0.0) {}
+
+  inline void push (const double& x) {
+    n += 1.0;
+    double delta = x - mean;
+    mean += delta / n;
+    M2 += delta * (x - mean);
+  }
+
+  // unbiased variance
+  inline double var () const {
+    return(M2 / (n - 1.0));
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/////////////////// R-hat from chain means and variances //////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+inline double rhat_chains (const double* draws, const int& n_chains,
+                           const int& n) {
+  // draws holds n_chains consecutive chains of length n
+  welford between;
+  double W = 0.0;
+  for (int c=0; c<n_chains; c++) {
+    welford within;
+    for (int k=0; k<n; k++) {
+      within.push(draws[c * n + k]);
+    }
+    between.push(within.mean);
+    W += within.var() / n_chains;
+  }
+  double B = n * between.var();
+  return(std::sqrt(((n - 1.0) / n * W + B / n) / W));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//////////////////////////// Rank normalisation ///////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+inline void rank_normalise (const std::vector<double>& x,
+                            std::vector<arma::uword>& order,
+                            std::vector<double>& z) {
+  // z = qnorm((r - 3/8) / (S + 1/4)) with r the average rank of x
+  int S = x.size();
+  for (int k=0; k<S; k++) {
+    order[k] = k;
+  }
+  std::sort(order.begin(), order.end(),
+            [&] (const arma::uword& a, const arma::uword& b) {
+              return(x[a] < x[b]);
+            });
+  int k = 0;
+  while (k < S) {
+    int l = k;
+    while (l + 1 < S && x[order[l + 1]] == x[order[k]]) {
+      l++;
+    }
+    double r = 0.5 * (k + l) + 1.0;
+    double zr = R::qnorm((r - 0.375) / (S + 0.25), 0.0, 1.0, 1, 0);
+    for (int m=k; m<=l; m++) {
+      z[order[m]] = zr;
+    }
+    k = l + 1;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+////////////////////////// Effective sample size //////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+inline double ess_chains (const double* draws, const int& n_chains,
+                          const int& n, arma::mat& acov) {
+  // Geyer's initial monotone sequence estimator on n_chains consecutive
+  // chains of length n, acov is an n by n_chains work matrix
+  arma::vec chain_mean(n_chains);
+  arma::uword n_fft = 1;
+  while (n_fft < 2 * (arma::uword)n) {
+    n_fft *= 2;
+  }
+  for (int c=0; c<n_chains; c++) {
+    arma::vec y(const_cast<double*>(draws + c * n), n, false, true);
+    chain_mean(c) = mean(y);
+    arma::vec y_pad(n_fft, arma::fill::zeros);
+    y_pad.subvec(0, n - 1) = y - chain_mean(c);
+    arma::cx_vec f = fft(y_pad);
+    arma::vec ac = real(ifft(arma::cx_vec(square(abs(f)), arma::zeros(n_fft))));
+    acov.col(c) = ac.subvec(0, n - 1) / n;
+  }
+  double mean_var = mean(acov.row(0)) * n / (n - 1.0);
+  double var_plus = mean_var * (n - 1.0) / n;
+  if (n_chains > 1) {
+    var_plus += var(chain_mean);
+  }
+  if (!std::isfinite(var_plus) || var_plus <= 0.0) {
+    return(NA_REAL);
+  }
+  std::vector<double> rho_hat(n, 0.0);
+  int t = 0;
+  double rho_hat_even = 1.0;
+  rho_hat[0] = rho_hat_even;
+  double rho_hat_odd = 1.0 - (mean_var - mean(acov.row(1))) / var_plus;
+  rho_hat[1] = rho_hat_odd;
+  while (t < n - 5 && !std::isnan(rho_hat_even + rho_hat_odd) &&
+         rho_hat_even + rho_hat_odd > 0.0) {
+    t += 2;
+    rho_hat_even = 1.0 - (mean_var - mean(acov.row(t))) / var_plus;
+    rho_hat_odd = 1.0 - (mean_var - mean(acov.row(t + 1))) / var_plus;
+    if (rho_hat_even + rho_hat_odd >= 0.0) {
+      rho_hat[t] = rho_hat_even;
+      rho_hat[t + 1] = rho_hat_odd;
+    }
+  }
+  int max_t = t;
+  if (rho_hat_even > 0.0) {
+    rho_hat[max_t] = rho_hat_even;
+  }
+  // enforce a monotone sequence of paired autocorrelations
+  t = 0;
+  while (t <= max_t - 4) {
+    t += 2;
+    if (rho_hat[t] + rho_hat[t + 1] > rho_hat[t - 2] + rho_hat[t - 1]) {
+      rho_hat[t] = 0.5 * (rho_hat[t - 2] + rho_hat[t - 1]);
+      rho_hat[t + 1] = rho_hat[t];
+    }
+  }
+  double ess = n_chains * n;
+  double tau_hat = - 1.0 + rho_hat[max_t];
+  for (int l=0; l<max_t; l++) {
+    tau_hat += 2.0 * rho_hat[l];
+  }
+  tau_hat = std::max(tau_hat, 1.0 / std::log10(ess));
+  return(ess / tau_hat);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/////////////////////// Diagnostics for all variables /////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+//[[Rcpp::export]]
+DataFrame makeDiagnostics(const List& out) {
+  int n_chains = out.size();
+  if (n_chains < 2) {
+    Rcpp::stop("diagnostics need at least two chains");
+  }
+  NumericMatrix first = out[0];
+  int n_samples = first.nrow();
+  int n_variables = first.ncol();
+  if (n_samples < 8) {
+    Rcpp::stop("diagnostics need at least eight samples per chain");
+  }
+  // pointers to the R owned chains, taken before the parallel region
+  std::vector<const double*> chains(n_chains);
+  for (int i=0; i<n_chains; i++) {
+    if (TYPEOF(out[i]) != REALSXP) {
+      Rcpp::stop("each chain must be a numeric matrix");
+    }
+    NumericMatrix chain = out[i];
+    if (chain.nrow() != n_samples || chain.ncol() != n_variables) {
+      Rcpp::stop("all chains must have the same dimensions");
+    }
+    chains[i] = chain.begin();
+  }
+
+  // the middle draw of an odd length chain is dropped when splitting
+  int n_half = n_samples / 2;
+  int n_split = 2 * n_chains;
+  int S = n_split * n_half;
+  int S_full = n_chains * n_samples;
+  NumericVector Rhat(n_variables);
+  NumericVector Rhat_split(n_variables);
+  NumericVector Rhat_rank(n_variables);
+  NumericVector ess_bulk(n_variables);
+  NumericVector ess_tail(n_variables);
+  double* Rhat_mem = Rhat.begin();
+  double* Rhat_split_mem = Rhat_split.begin();
+  double* Rhat_rank_mem = Rhat_rank.begin();
+  double* ess_bulk_mem = ess_bulk.begin();
+  double* ess_tail_mem = ess_tail.begin();
+
+  #pragma omp parallel
+  {
+    std::vector<double> full(S_full);
+    std::vector<double> sorted(S_full);
+    std::vector<double> x(S);
+    std::vector<double> z(S);
+    std::vector<double> work(S);
+    std::vector<arma::uword> order(S);
+    arma::mat acov(n_half, n_split);
+    #pragma omp for schedule(dynamic, 16)
+    for (int p=0; p<n_variables; p++) {
+      for (int c=0; c<n_chains; c++) {
+        const double* chain_col = chains[c] + (size_t)p * n_samples;
+        std::copy(chain_col, chain_col + n_samples, full.begin() + c * n_samples);
+        std::copy(chain_col, chain_col + n_half, x.begin() + 2 * c * n_half);
+        std::copy(chain_col + n_samples - n_half, chain_col + n_samples,
+                  x.begin() + (2 * c + 1) * n_half);
+      }
+      double x_min = *std::min_element(x.begin(), x.end());
+      double x_max = *std::max_element(x.begin(), x.end());
+      if (!std::isfinite(x_min) || !std::isfinite(x_max) || x_min == x_max) {
+        Rhat_mem[p] = NA_REAL;
+        Rhat_split_mem[p] = NA_REAL;
+        Rhat_rank_mem[p] = NA_REAL;
+        ess_bulk_mem[p] = NA_REAL;
+        ess_tail_mem[p] = NA_REAL;
+        continue;
+      }
+      Rhat_mem[p] = rhat_chains(full.data(), n_chains, n_samples);
+      Rhat_split_mem[p] = rhat_chains(x.data(), n_split, n_half);
+
+      // bulk, rank normalised split draws
+      rank_normalise(x, order, z);
+      double rhat_bulk = rhat_chains(z.data(), n_split, n_half);
+      ess_bulk_mem[p] = ess_chains(z.data(), n_split, n_half, acov);
+
+      // the median and tail quantiles come from all the draws, as in
+      // posterior, and only then are the split draws folded or thresholded
+      std::copy(full.begin(), full.end(), sorted.begin());
+      std::sort(sorted.begin(), sorted.end());
+
+      // tail, rank normalised split draws folded about the median
+      double median = 0.5 * (sorted[(S_full - 1) / 2] + sorted[S_full / 2]);
+      for (int k=0; k<S; k++) {
+        work[k] = std::abs(x[k] - median);
+      }
+      rank_normalise(work, order, z);
+      double rhat_tail = rhat_chains(z.data(), n_split, n_half);
+      Rhat_rank_mem[p] = std::max(rhat_bulk, rhat_tail);
+
+      // tail effective sample size from the 5% and 95% quantile indicators
+      double ess_min = HUGE_VAL;
+      const double probs[2] = {0.05, 0.95};
+      for (int q=0; q<2; q++) {
+        double h = (S_full - 1) * probs[q];
+        int lo = std::floor(h);
+        double x_q = sorted[lo] +
+          (h - lo) * (sorted[std::min(lo + 1, S_full - 1)] - sorted[lo]);
+        for (int k=0; k<S; k++) {
+          z[k] = x[k] <= x_q ? 1.0 : 0.0;
+        }
+        double ess_q = ess_chains(z.data(), n_split, n_half, acov);
+        if (std::isnan(ess_q)) {
+          ess_min = NA_REAL;
+          break;
+        }
+        ess_min = std::min(ess_min, ess_q);
+      }
+      ess_tail_mem[p] = ess_min;
+    }
+  }
+
+  DataFrame diagnostics = DataFrame::create(
+    _["Rhat"] = Rhat,
+    _["Rhat_split"] = Rhat_split,
+    _["Rhat_rank"] = Rhat_rank,
+    _["ess_bulk"] = ess_bulk,
+    _["ess_tail"] = ess_tail);
+  // variable names from the columns of the first chain
+  SEXP dimnames = first.attr("dimnames");
+  if (!Rf_isNull(dimnames) && !Rf_isNull(VECTOR_ELT(dimnames, 1))) {
+    diagnostics.attr("row.names") = VECTOR_ELT(dimnames, 1);
+  }
+  return(diagnostics);
+}
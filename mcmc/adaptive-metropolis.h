@@ -0,0 +1,151 @@
+#ifndef ADAPTIVE_METROPOLIS_H
+#define ADAPTIVE_METROPOLIS_H
+
+#include <RcppArmadillo.h>
+#include <cmath>
+
+// Adaptive Metropolis proposals with an online covariance estimate
+
+//
+// updateTuningMV kept the last 50 states of a block, re-estimated the proposal
+// covariance from them every 50 iterations and refactorised it, an O(p^3) job
+// that for the B = d (d - 1) / 2 correlation parameters dominated the
+// adaptation phase. Here the covariance is updated after every iteration in
+// the style of Haario et al. (2001), from the whole history with weights
+// 1 / (n + n_prior), starting from the identity. The factor is updated
+// with it, so there is never a refactorisation:
+//
+//   full      the lower Cholesky factor is rescaled and given a rank one
+//             update, O(p^2) per iteration
+//   low rank  the covariance is a diagonal plus a rank r term U U', with U
+//             kept as the leading directions of [sqrt(1 - g) U, v] (a streaming
+//             PCA), O(p r^2) per iteration, for blocks too large for a dense
+//             p by p factor
+//
+// The proposal scale lambda is still tuned every 50 iterations towards the
+// optimal acceptance rate, as updateTuningMV did. An empty block, e.g. tau2
+// with a reference category and d = 1, is never adapted.
+//
+
+///////////////////////////////////////////////////////////////////////////////
+////////////////////// Rank one Cholesky factor update ////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+// L L' + v v' for a lower triangular L, overwriting L, and using v as workspace
+inline void chol_rank1_update (arma::mat& L, arma::vec& v) {
+  arma::uword p = L.n_rows;
+  double* v_mem = v.memptr();
+  for (arma::uword k=0; k<p; k++) {
+    double* L_k = L.colptr(k);
+    double r = std::sqrt(L_k[k] * L_k[k] + v_mem[k] * v_mem[k]);
+    double c = r / L_k[k];
+    double s = v_mem[k] / L_k[k];
+    L_k[k] = r;
+    for (arma::uword i=k+1; i<p; i++) {
+      L_k[i] = (L_k[i] + s * v_mem[i]) / c;
+      v_mem[i] = c * v_mem[i] - s * L_k[i];
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////// Adaptive proposal for a block ///////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+struct adaptive_metropolis {
+  double lambda;        // proposal scale
+  double accept_batch;  // acceptance rate of the current batch of 50
+  double n;             // number of states pushed
+  double n_prior;       // weight of the identity starting covariance
+  arma::uword rank;     // 0 for a full covariance
+  arma::vec mean;
+  arma::mat L;          // lower Cholesky factor of the covariance (full)
+  arma::vec s2;         // running variances (low rank)
+  arma::mat U;          // low rank factor (low rank)
+  arma::vec D_sd;       // standard deviations of the diagonal part (low rank)
+
+  adaptive_metropolis () : lambda(1.0), accept_batch(0.0), n(0.0),
+    n_prior(50.0), rank(0) {}
+
+  adaptive_metropolis (const arma::uword& p, const double& lambda_,
+                       const arma::uword& rank_=0) :
+    lambda(lambda_), accept_batch(0.0), n(0.0), n_prior(50.0), rank(rank_),
+    mean(p, arma::fill::zeros) {
+    if (rank >= p) {
+      rank = 0;
+    }
+    if (rank == 0) {
+      L.eye(p, p);
+    } else {
+      s2.ones(p);
+      U.zeros(p, rank);
+      D_sd.ones(p);
+    }
+  }
+
+  // x + lambda * e with e ~ N(0, Sigma)
+  arma::vec propose (const arma::vec& x) const {
+    arma::uword p = x.n_elem;
+    arma::vec z(p);
+    for (arma::uword i=0; i<p; i++) {
+      z(i) = R::rnorm(0.0, 1.0);
+    }
+    if (rank == 0) {
+      return(x + lambda * (trimatl(L) * z));
+    }
+    arma::vec z_U(rank);
+    for (arma::uword l=0; l<rank; l++) {
+      z_U(l) = R::rnorm(0.0, 1.0);
+    }
+    return(x + lambda * (D_sd % z + U * z_U));
+  }
+
+  // add the current state of the block to the covariance estimate
+  void push (const arma::vec& x) {
+    if (mean.n_elem == 0) {
+      return;
+    }
+    n += 1.0;
+    if (n == 1.0) {
+      mean = x;
+      return;
+    }
+    double g = 1.0 / (n + n_prior);
+    arma::vec v = x - mean;
+    mean += g * v;
+    // Sigma <- (1 - g) Sigma + g (1 - g) v v'
+    v *= std::sqrt(g * (1.0 - g));
+    if (rank == 0) {
+      L *= std::sqrt(1.0 - g);
+      chol_rank1_update(L, v);
+    } else {
+      s2 = (1.0 - g) * s2 + square(v);
+      arma::mat M = join_rows(std::sqrt(1.0 - g) * U, v);
+      arma::vec values;
+      arma::mat vectors;
+      arma::eig_sym(values, vectors, M.t() * M);
+      // eigenvalues are ascending, keep the leading rank directions
+      U = M * vectors.tail_cols(rank);
+      // the diagonal carries the variance not explained by U, floored so the
+      // proposal stays full rank
+      D_sd = sqrt(arma::max(s2 - sum(square(U), 1), 1.0e-3 * s2));
+    }
+  }
+
+  // tune lambda towards the optimal acceptance rate, every 50 iterations
+  void update_scale (const int& k) {
+    double target[] = {0.44, 0.35, 0.32, 0.25, 0.234};
+    arma::uword p = mean.n_elem;
+    if (p == 0) {
+      accept_batch = 0.0;
+      return;
+    }
+    double optimal_accept = p >= 5 ? 0.234 : target[p - 1];
+    double times_adapted = std::floor(k / 50.0);
+    double gamma = 10.0 / std::pow(times_adapted + 3.0, 0.8);
+    lambda *= std::exp(gamma * (accept_batch - optimal_accept));
+    accept_batch = 0.0;
+  }
+};
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef BSPLINE_BASIS_H
+#define BSPLINE_BASIS_H
+
+#include <RcppArmadillo.h>
+
+// B-spline basis evaluator for the single-site X updates in the basis samplers
+
+//
+// Builds the same intercept basis as bs_cpp(X, df, knots, degree, true,
+// rangeX), i.e. splines::bs with boundary knots rangeX, but only the
+// degree + 1 basis functions that are non-zero at X are evaluated. The knot
+// span is found by binary search and the values by the Cox-de Boor
+// recursion, templated on the degree so the work arrays live on the stack.
+// Outside rangeX the span is clamped to the boundary interval, which extends
+// the boundary polynomial exactly as the Taylor expansion in splines::bs.
+//
+
+// largest degree with a compiled evaluator
+const int bspline_max_degree = 5;
+
+template <int degree>
+inline void bspline_values (const double& x, const double* t,
+                            const arma::uword& span, double* values) {
+  // t is the full knot vector and span satisfies t[span] <= x < t[span + 1]
+  double left[degree + 1];
+  double right[degree + 1];
+  values[0] = 1.0;
+  for (int j=1; j<=degree; j++) {
+    left[j] = x - t[span + 1 - j];
+    right[j] = t[span + j] - x;
+    double saved = 0.0;
+    for (int r=0; r<j; r++) {
+      double tmp = values[r] / (right[r + 1] + left[j - r]);
+      values[r] = saved + right[r + 1] * tmp;
+      saved = left[j - r] * tmp;
+    }
+    values[j] = saved;
+  }
+}
+
+struct bspline_basis {
+  int degree;   // polynomial degree
+  int df;       // number of basis functions
+  arma::vec t;  // full knot vector with repeated boundary knots
+
+  bspline_basis () {}
+
+  bspline_basis (const arma::vec& knots, const arma::vec& rangeX,
+                 const int& degree_, const int& df_) :
+    degree(degree_), df(df_) {
+    if (degree < 1 || degree > bspline_max_degree) {
+      Rcpp::stop("the B-spline degree must be between 1 and 5");
+    }
+    if (knots.n_elem != (arma::uword)(df - degree - 1)) {
+      Rcpp::stop("the number of interior knots must be df - degree - 1");
+    }
+    t.set_size(df + degree + 1);
+    for (int k=0; k<=degree; k++) {
+      t(k) = rangeX(0);
+      t(df + k) = rangeX(1);
+    }
+    for (arma::uword k=0; k<knots.n_elem; k++) {
+      t(degree + 1 + k) = knots(k);
+    }
+  }
+
+  // index of the knot interval holding x, clamped to the boundary intervals
+  arma::uword span (const double& x) const {
+    arma::uword low = degree;
+    arma::uword high = df - 1;
+    if (x <= t(low + 1)) {
+      return(low);
+    }
+    if (x >= t(high)) {
+      return(high);
+    }
+    while (high - low > 1) {
+      arma::uword mid = (low + high) / 2;
+      if (x < t(mid)) {
+        high = mid;
+      } else {
+        low = mid;
+      }
+    }
+    return(low);
+  }
+
+  // evaluates the degree + 1 non-zero basis functions at x into values and
+  // returns the index of the first one
+  arma::uword eval (const double& x, double* values) const {
+    arma::uword s = span(x);
+    switch (degree) {
+    case 1: bspline_values<1>(x, t.memptr(), s, values); break;
+    case 2: bspline_values<2>(x, t.memptr(), s, values); break;
+    case 3: bspline_values<3>(x, t.memptr(), s, values); break;
+    case 4: bspline_values<4>(x, t.memptr(), s, values); break;
+    case 5: bspline_values<5>(x, t.memptr(), s, values); break;
+    }
+    return(s - degree);
+  }
+
+  // dense N by df basis matrix, the equivalent of bs_cpp
+  arma::mat basis (const arma::vec& X) const {
+    arma::mat Xbs(X.n_elem, df, arma::fill::zeros);
+    double values[bspline_max_degree + 1];
+    for (arma::uword i=0; i<X.n_elem; i++) {
+      arma::uword start = eval(X(i), values);
+      for (int k=0; k<=degree; k++) {
+        Xbs(i, start + k) = values[k];
+      }
+    }
+    return(Xbs);
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+////////////////// Sparse basis row times coefficient matrix //////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+inline void bspline_row_product (const double* values, const arma::uword& start,
+                                 const int& degree, const arma::mat& beta,
+                                 arma::rowvec& out) {
+  // out = Xbs_row * beta using only the degree + 1 non-zero entries of the row
+  for (arma::uword j=0; j<beta.n_cols; j++) {
+    double tmp = 0.0;
+    for (int k=0; k<=degree; k++) {
+      tmp += values[k] * beta(start + k, j);
+    }
+    out(j) = tmp;
+  }
+}
+
+inline void bspline_row_dense (const double* values, const arma::uword& start,
+                               const int& degree, arma::rowvec& Xbs_row) {
+  Xbs_row.zeros();
+  for (int k=0; k<=degree; k++) {
+    Xbs_row(start + k) = values[k];
+  }
+}
+
+#endif
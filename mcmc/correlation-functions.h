@@ -0,0 +1,60 @@
+#ifndef CORRELATION_FUNCTIONS_H
+#define CORRELATION_FUNCTIONS_H
+
+#include <RcppArmadillo.h>
+#include <cmath>
+
+// Gaussian process correlation functions for the predictive process samplers
+
+//
+// Each correlation function is a policy type with a static value(dist, phi)
+// that takes the unsquared distance and the range parameter phi. mcmcRcpp
+// picks the policy once from the corr_function string and the sampler body
+// is instantiated for it, so the kernels are inlined with no string
+// comparisons inside the chain. The gaussian kernel keeps the existing
+// exp(- dist^2 / phi) parameterisation.
+//
+
+struct corr_exponential {
+  static inline double value (const double& dist, const double& phi) {
+    return(std::exp(- dist / phi));
+  }
+};
+
+struct corr_gaussian {
+  static inline double value (const double& dist, const double& phi) {
+    return(std::exp(- dist * dist / phi));
+  }
+};
+
+struct corr_matern32 {
+  static inline double value (const double& dist, const double& phi) {
+    double r = std::sqrt(3.0) * dist / phi;
+    return((1.0 + r) * std::exp(- r));
+  }
+};
+
+struct corr_matern52 {
+  static inline double value (const double& dist, const double& phi) {
+    double r = std::sqrt(5.0) * dist / phi;
+    return((1.0 + r + r * r / 3.0) * std::exp(- r));
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//////////////////// Elementwise correlation of a distance matrix /////////////
+///////////////////////////////////////////////////////////////////////////////
+
+template <typename corr>
+inline arma::mat corr_matrix (const arma::mat& D, const double& phi) {
+  // D is a matrix of unsquared distances
+  arma::mat C(D.n_rows, D.n_cols);
+  const double* D_mem = D.memptr();
+  double* C_mem = C.memptr();
+  for (arma::uword k=0; k<D.n_elem; k++) {
+    C_mem[k] = corr::value(D_mem[k], phi);
+  }
+  return(C);
+}
+
+#endif
@@ -0,0 +1,248 @@
+#ifndef COUNT_DATASET_H
+#define COUNT_DATASET_H
+
+#include <RcppArmadillo.h>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Binary dataset of calibration and fossil counts for the DM samplers
+
+//
+// The file holds the calibration counts Y, the fossil counts Y_pred, their
+// row totals, the covariate X, the predictive process knots X_knots and the
+// species names, in the native byte order:
+//
+//   header    magic "MVGPDS1", then N, N_pred, d, N_knots and the length of
+//             the names block as uint64
+//   Y         N by d uint32 counts, column major
+//   Y_total   N uint32 row totals
+//   Y_pred    N_pred by d uint32 counts, column major
+//   Y_pred_total  N_pred uint32 row totals
+//   X         N doubles, starting at the next multiple of 8 bytes
+//   X_knots   N_knots doubles
+//   names     d NUL terminated species names
+//
+// The file is mapped read-only, so every chain and worker on a node reads
+// the same physical pages, and the counts are used in place by dm_counts
+// without converting them to an R or Armadillo double matrix.
+//
+
+const char count_dataset_magic[8] = "MVGPDS1";
+
+// dm_counts views the mapped counts as unsigned int
+static_assert(sizeof(unsigned int) == sizeof(uint32_t),
+              "unsigned int must be 32 bits to map the counts in place");
+
+struct count_dataset_header {
+  char magic[8];
+  uint64_t N;
+  uint64_t N_pred;
+  uint64_t d;
+  uint64_t N_knots;
+  uint64_t names_bytes;
+};
+
+// byte offsets of the blocks after the header
+struct count_dataset_layout {
+  size_t Y;
+  size_t Y_total;
+  size_t Y_pred;
+  size_t Y_pred_total;
+  size_t X;
+  size_t X_knots;
+  size_t names;
+  size_t size;
+
+  count_dataset_layout (const count_dataset_header& h) {
+    Y = sizeof(count_dataset_header);
+    Y_total = Y + sizeof(uint32_t) * h.N * h.d;
+    Y_pred = Y_total + sizeof(uint32_t) * h.N;
+    Y_pred_total = Y_pred + sizeof(uint32_t) * h.N_pred * h.d;
+    X = Y_pred_total + sizeof(uint32_t) * h.N_pred;
+    X = (X + 7) / 8 * 8;
+    X_knots = X + sizeof(double) * h.N;
+    names = X_knots + sizeof(double) * h.N_knots;
+    size = names + h.names_bytes;
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+////////////////////////////// Write a dataset ////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+inline std::vector<uint32_t> count_dataset_counts (const arma::mat& Y,
+                                                   std::vector<uint32_t>& total) {
+  std::vector<uint32_t> y(Y.n_elem);
+  std::vector<uint64_t> total_64(Y.n_rows, 0);
+  for (arma::uword k=0; k<Y.n_elem; k++) {
+    if (Y(k) < 0.0 || Y(k) != std::floor(Y(k)) || Y(k) > 4294967295.0) {
+      Rcpp::stop("the count matrices must contain non-negative 32 bit integers");
+    }
+    y[k] = static_cast<uint32_t>(Y(k));
+    total_64[k % Y.n_rows] += y[k];
+  }
+  total.resize(Y.n_rows);
+  for (arma::uword i=0; i<Y.n_rows; i++) {
+    if (total_64[i] > 4294967295ULL) {
+      Rcpp::stop("the row totals must fit in 32 bit integers");
+    }
+    total[i] = static_cast<uint32_t>(total_64[i]);
+  }
+  return(y);
+}
+
+inline void write_count_dataset (const std::string& file, const arma::mat& Y,
+                                 const arma::vec& X, const arma::mat& Y_pred,
+                                 const arma::vec& X_knots,
+                                 const std::vector<std::string>& names) {
+  if (X.n_elem != Y.n_rows) {
+    Rcpp::stop("X must have one entry per row of Y");
+  }
+  if (Y_pred.n_cols != Y.n_cols) {
+    Rcpp::stop("Y and Y_pred must have the same number of species");
+  }
+  if (!names.empty() && names.size() != Y.n_cols) {
+    Rcpp::stop("there must be one species name per column of Y");
+  }
+  std::vector<uint32_t> Y_total, Y_pred_total;
+  std::vector<uint32_t> y = count_dataset_counts(Y, Y_total);
+  std::vector<uint32_t> y_pred = count_dataset_counts(Y_pred, Y_pred_total);
+  std::string names_block;
+  for (size_t j=0; j<names.size(); j++) {
+    names_block += names[j];
+    names_block.push_back('\0');
+  }
+
+  count_dataset_header h;
+  std::memcpy(h.magic, count_dataset_magic, 8);
+  h.N = Y.n_rows;
+  h.N_pred = Y_pred.n_rows;
+  h.d = Y.n_cols;
+  h.N_knots = X_knots.n_elem;
+  h.names_bytes = names_block.size();
+  count_dataset_layout layout(h);
+
+  std::ofstream out(file.c_str(), std::ios::binary | std::ios::trunc);
+  if (!out) {
+    Rcpp::stop("unable to open " + file + " for writing");
+  }
+  out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  out.write(reinterpret_cast<const char*>(y.data()), sizeof(uint32_t) * y.size());
+  out.write(reinterpret_cast<const char*>(Y_total.data()),
+            sizeof(uint32_t) * Y_total.size());
+  out.write(reinterpret_cast<const char*>(y_pred.data()),
+            sizeof(uint32_t) * y_pred.size());
+  out.write(reinterpret_cast<const char*>(Y_pred_total.data()),
+            sizeof(uint32_t) * Y_pred_total.size());
+  std::vector<char> pad(layout.X - static_cast<size_t>(out.tellp()), 0);
+  out.write(pad.data(), pad.size());
+  out.write(reinterpret_cast<const char*>(X.memptr()), sizeof(double) * X.n_elem);
+  out.write(reinterpret_cast<const char*>(X_knots.memptr()),
+            sizeof(double) * X_knots.n_elem);
+  out.write(names_block.data(), names_block.size());
+  if (!out) {
+    Rcpp::stop("error writing " + file);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/////////////////////////// Memory mapped dataset /////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+class count_dataset {
+public:
+  count_dataset_header header;
+
+  count_dataset (const std::string& file) : data(NULL), size(0) {
+#ifdef _WIN32
+    Rcpp::stop("memory mapped datasets are not supported on Windows");
+#else
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+      Rcpp::stop("unable to open dataset " + file);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(count_dataset_header)) {
+      close(fd);
+      Rcpp::stop(file + " is not a count dataset");
+    }
+    size = st.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      Rcpp::stop("unable to map dataset " + file);
+    }
+    data = static_cast<const char*>(map);
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, count_dataset_magic, 8) != 0 ||
+        count_dataset_layout(header).size != size) {
+      munmap(const_cast<char*>(data), size);
+      Rcpp::stop(file + " is not a count dataset or is truncated");
+    }
+#endif
+  }
+
+  ~count_dataset () {
+#ifndef _WIN32
+    if (data != NULL) {
+      munmap(const_cast<char*>(data), size);
+    }
+#endif
+  }
+
+  const uint32_t* Y () const {
+    return(block<uint32_t>(count_dataset_layout(header).Y));
+  }
+  const uint32_t* Y_total () const {
+    return(block<uint32_t>(count_dataset_layout(header).Y_total));
+  }
+  const uint32_t* Y_pred () const {
+    return(block<uint32_t>(count_dataset_layout(header).Y_pred));
+  }
+  const uint32_t* Y_pred_total () const {
+    return(block<uint32_t>(count_dataset_layout(header).Y_pred_total));
+  }
+
+  // the covariates are small and copied into Armadillo vectors
+  arma::vec X () const {
+    return(arma::vec(block<double>(count_dataset_layout(header).X), header.N));
+  }
+  arma::vec X_knots () const {
+    return(arma::vec(block<double>(count_dataset_layout(header).X_knots),
+                     header.N_knots));
+  }
+
+  std::vector<std::string> names () const {
+    std::vector<std::string> out;
+    const char* p = block<char>(count_dataset_layout(header).names);
+    const char* end = p + header.names_bytes;
+    while (p < end) {
+      out.push_back(std::string(p));
+      p += out.back().size() + 1;
+    }
+    return(out);
+  }
+
+private:
+  const char* data;
+  size_t size;
+
+  template <typename T>
+  const T* block (const size_t& offset) const {
+    return(reinterpret_cast<const T*>(data + offset));
+  }
+
+  count_dataset (const count_dataset&);
+  count_dataset& operator= (const count_dataset&);
+};
+
+#endif
@@ -0,0 +1,390 @@
+#ifndef DM_LIKELIHOOD_H
+#define DM_LIKELIHOOD_H
+
+#include <RcppArmadillo.h>
+#include <cmath>
+
+// Dirichlet-Multinomial log-likelihood kernels shared by the DM samplers
+
+//
+// Like LL_DM and LL_DM_row these drop the count-only multinomial coefficient,
+// so Metropolis-Hastings ratios and slice heights are unchanged. The counts
+// are converted to integers once at the start of the chain and every proposal
+// evaluation only touches the non-zero cells.
+//
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////// Pre-computed count structure ////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+// counts at or below this value use the rising factorial instead of lgamma
+const unsigned int dm_rising_max = 16;
+
+struct dm_counts {
+  arma::Mat<unsigned int> y;     // N by d matrix of integer counts
+  arma::Col<unsigned int> count; // count - sum of counts at each site
+  arma::uvec nonzero;            // column-major index of the non-zero cells
+
+  dm_counts () {}
+
+  dm_counts (const arma::mat& Y) {
+    y.set_size(Y.n_rows, Y.n_cols);
+    count.zeros(Y.n_rows);
+    for (arma::uword k=0; k<Y.n_elem; k++) {
+      if (Y(k) < 0.0 || Y(k) != std::floor(Y(k))) {
+        Rcpp::stop("the count matrix Y must contain non-negative integers");
+      }
+      y(k) = static_cast<unsigned int>(Y(k));
+    }
+    for (arma::uword j=0; j<Y.n_cols; j++) {
+      for (arma::uword i=0; i<Y.n_rows; i++) {
+        count(i) += y(i, j);
+      }
+    }
+    nonzero = arma::find(y > 0);
+  }
+
+  // view of counts and row totals held elsewhere, e.g. a memory mapped
+  // count_dataset, that were validated when they were written
+  dm_counts (const unsigned int* y_mem, const unsigned int* count_mem,
+             const arma::uword& N, const arma::uword& d) :
+    y(const_cast<unsigned int*>(y_mem), N, d, false, true),
+    count(const_cast<unsigned int*>(count_mem), N, false, true) {
+    nonzero = arma::find(y > 0);
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+////////////////////// log(Gamma(alpha + y) / Gamma(alpha)) ///////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+inline double lgamma_ratio (const double& alpha, const unsigned int& y) {
+  if (y == 0) {
+    return(0.0);
+  }
+  if (y > dm_rising_max) {
+    return(std::lgamma(alpha + y) - std::lgamma(alpha));
+  }
+  // rising factorial alpha * (alpha + 1) * ... * (alpha + y - 1), taking the
+  // log whenever the running product gets close to overflowing
+  double log_out = 0.0;
+  double prod = alpha;
+  double flush = 1e300 / (alpha + y);
+  for (unsigned int m=1; m<y; m++) {
+    if (prod > flush) {
+      log_out += std::log(prod);
+      prod = 1.0;
+    }
+    prod *= alpha + m;
+  }
+  return(log_out + std::log(prod));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//////////////// log(Gamma(alpha + y) / Gamma(alpha)) given log(alpha) ////////
+///////////////////////////////////////////////////////////////////////////////
+
+// log(alpha) above which the large-alpha expansion is used, alpha > 1e10
+const double dm_log_alpha_large = 23.0;
+
+inline double lgamma_ratio_log (const double& log_alpha, const unsigned int& y) {
+  if (y == 0) {
+    return(0.0);
+  }
+  if (log_alpha > dm_log_alpha_large) {
+    // sum_{m<y} log(alpha + m) = y * log(alpha) + sum_{m<y} log(1 + m / alpha)
+    // expanded to second order in 1 / alpha, which never forms alpha itself
+    double u = std::exp(- log_alpha);
+    double y_double = static_cast<double>(y);
+    double sum_m = 0.5 * y_double * (y_double - 1.0);
+    double sum_m2 = (y_double - 1.0) * y_double * (2.0 * y_double - 1.0) / 6.0;
+    return(y_double * log_alpha + u * sum_m - 0.5 * u * u * sum_m2);
+  }
+  return(lgamma_ratio(std::exp(log_alpha), y));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////// Dirichlet-Multinomial log-likelihood ////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+inline double LL_DM (const arma::mat& alpha, const dm_counts& counts) {
+  // alpha is an N by d matrix of Dirichlet-Multinomial parameters
+  double log_like = 0.0;
+  arma::vec alpha_rowsums = arma::sum(alpha, 1);
+  for (arma::uword i=0; i<alpha.n_rows; i++) {
+    log_like -= lgamma_ratio(alpha_rowsums(i), counts.count(i));
+  }
+  for (arma::uword k=0; k<counts.nonzero.n_elem; k++) {
+    arma::uword idx = counts.nonzero(k);
+    log_like += lgamma_ratio(alpha(idx), counts.y(idx));
+  }
+  return(log_like);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/////////////// Dirichlet-Multinomial log-likelihood for row i ////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+inline double LL_DM_row (const arma::rowvec& alpha, const dm_counts& counts,
+                         const arma::uword& i) {
+  // alpha is a d-vector of Dirichlet-Multinomial parameters for site i
+  double log_like = - lgamma_ratio(arma::accu(alpha), counts.count(i));
+  for (arma::uword j=0; j<alpha.n_elem; j++) {
+    log_like += lgamma_ratio(alpha(j), counts.y(i, j));
+  }
+  return(log_like);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/////////// Dirichlet-Multinomial log-likelihood on the log scale /////////////
+///////////////////////////////////////////////////////////////////////////////
+
+//
+// Row term for a site given the exponentiated row sum. When the sum is too
+// large to be trusted the log row sum is recomputed with log-sum-exp, so
+// proposals with very large alpha are scored rather than rejected outright.
+//
+
+inline double LL_DM_log_row_total (const double& alpha_rowsum,
+                                   const arma::rowvec& log_alpha_row,
+                                   const unsigned int& count) {
+  if (alpha_rowsum < 1e10) {
+    return(- lgamma_ratio(alpha_rowsum, count));
+  }
+  double log_max = log_alpha_row.max();
+  double log_rowsum = log_max + std::log(arma::accu(arma::exp(log_alpha_row - log_max)));
+  return(- lgamma_ratio_log(log_rowsum, count));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/////////// Fused alpha construction, row sums and log-likelihood /////////////
+///////////////////////////////////////////////////////////////////////////////
+
+//
+// Scores alpha = exp(mu + zeta) with mu broadcast over the rows, in a single
+// column-major pass that never forms mu + zeta or exp(mu + zeta) as separate
+// temporaries. If alpha and alpha_rowsums are given they are filled on the
+// way, so an accepted proposal can be swapped in without another pass.
+//
+
+inline double LL_DM_fused (const arma::vec& mu, const arma::mat& zeta,
+                           const dm_counts& counts, arma::mat* alpha = NULL,
+                           arma::vec* alpha_rowsums = NULL) {
+  // mu is a d-vector of intercepts and zeta an N by d matrix of random effects
+  arma::uword N = zeta.n_rows;
+  arma::uword d = zeta.n_cols;
+  double log_like = 0.0;
+  arma::vec rowsums_tmp;
+  if (alpha_rowsums == NULL) {
+    alpha_rowsums = &rowsums_tmp;
+  }
+  alpha_rowsums->zeros(N);
+  double* rowsums_mem = alpha_rowsums->memptr();
+  double* alpha_mem = NULL;
+  if (alpha != NULL) {
+    alpha->set_size(N, d);
+    alpha_mem = alpha->memptr();
+  }
+  const double* zeta_mem = zeta.memptr();
+  const unsigned int* y_mem = counts.y.memptr();
+  for (arma::uword j=0; j<d; j++) {
+    double mu_j = mu(j);
+    arma::uword offset = j * N;
+    for (arma::uword i=0; i<N; i++) {
+      double log_alpha_ij = mu_j + zeta_mem[offset + i];
+      double alpha_ij = std::exp(log_alpha_ij);
+      rowsums_mem[i] += alpha_ij;
+      if (alpha_mem != NULL) {
+        alpha_mem[offset + i] = alpha_ij;
+      }
+      unsigned int y_ij = y_mem[offset + i];
+      if (y_ij > 0) {
+        log_like += log_alpha_ij > dm_log_alpha_large ?
+          lgamma_ratio_log(log_alpha_ij, y_ij) : lgamma_ratio(alpha_ij, y_ij);
+      }
+    }
+  }
+  for (arma::uword i=0; i<N; i++) {
+    if (rowsums_mem[i] < 1e10) {
+      log_like -= lgamma_ratio(rowsums_mem[i], counts.count(i));
+    } else {
+      arma::rowvec log_alpha_row = mu.t() + zeta.row(i);
+      log_like += LL_DM_log_row_total(rowsums_mem[i], log_alpha_row,
+                                      counts.count(i));
+    }
+  }
+  return(log_like);
+}
+
+inline double LL_DM_log (const arma::mat& log_alpha, const dm_counts& counts,
+                         arma::mat* alpha = NULL) {
+  // log_alpha is an N by d matrix of log Dirichlet-Multinomial parameters
+  arma::vec mu_zero(log_alpha.n_cols, arma::fill::zeros);
+  return(LL_DM_fused(mu_zero, log_alpha, counts, alpha));
+}
+
+inline double LL_DM_row_log (const arma::rowvec& log_alpha,
+                             const dm_counts& counts, const arma::uword& i) {
+  // log_alpha is a d-vector of log Dirichlet-Multinomial parameters for site i
+  double log_like = 0.0;
+  double alpha_rowsum = 0.0;
+  for (arma::uword j=0; j<log_alpha.n_elem; j++) {
+    double alpha_j = std::exp(log_alpha(j));
+    alpha_rowsum += alpha_j;
+    unsigned int y_ij = counts.y(i, j);
+    if (y_ij > 0) {
+      log_like += log_alpha(j) > dm_log_alpha_large ?
+        lgamma_ratio_log(log_alpha(j), y_ij) : lgamma_ratio(alpha_j, y_ij);
+    }
+  }
+  return(log_like + LL_DM_log_row_total(alpha_rowsum, log_alpha, counts.count(i)));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+///////// Change in the log-likelihood when only column j of alpha moves ///////
+///////////////////////////////////////////////////////////////////////////////
+
+inline double dm_cell_term (const double& log_alpha, const double& alpha,
+                            const unsigned int& y) {
+  return(log_alpha > dm_log_alpha_large ?
+           lgamma_ratio_log(log_alpha, y) : lgamma_ratio(alpha, y));
+}
+
+//
+// log_alpha, alpha and alpha_rowsums are the cached current values and
+// log_alpha_col_star the proposed log(alpha) for column j. Only the cells of
+// column j and the row totals change, so the difference costs O(N) rather
+// than O(N d). The proposed column and row sums are returned through
+// alpha_col_star and alpha_rowsums_star so they can be copied in on
+// acceptance.
+//
+
+inline double LL_DM_col_delta (const arma::mat& log_alpha,
+                               const arma::mat& alpha,
+                               const arma::vec& alpha_rowsums,
+                               const arma::vec& log_alpha_col_star,
+                               const dm_counts& counts, const arma::uword& j,
+                               arma::vec& alpha_col_star,
+                               arma::vec& alpha_rowsums_star) {
+  arma::uword N = log_alpha.n_rows;
+  alpha_col_star = arma::exp(log_alpha_col_star);
+  alpha_rowsums_star.set_size(N);
+  double delta = 0.0;
+  for (arma::uword i=0; i<N; i++) {
+    double alpha_ij_star = alpha_col_star(i);
+    double rowsum = alpha_rowsums(i);
+    double rowsum_star = rowsum - alpha(i, j) + alpha_ij_star;
+    unsigned int y_ij = counts.y(i, j);
+    if (y_ij > 0) {
+      delta += dm_cell_term(log_alpha_col_star(i), alpha_ij_star, y_ij) -
+        dm_cell_term(log_alpha(i, j), alpha(i, j), y_ij);
+    }
+    if (rowsum < 1e10 && rowsum_star < 1e10) {
+      delta += lgamma_ratio(rowsum, counts.count(i)) -
+        lgamma_ratio(rowsum_star, counts.count(i));
+    } else {
+      // the running sum can not be trusted this large, rebuild both rows
+      arma::rowvec log_alpha_row_star = log_alpha.row(i);
+      log_alpha_row_star(j) = log_alpha_col_star(i);
+      rowsum_star = arma::accu(arma::exp(log_alpha_row_star));
+      delta += LL_DM_log_row_total(rowsum_star, log_alpha_row_star,
+                                   counts.count(i)) -
+        LL_DM_log_row_total(rowsum, log_alpha.row(i), counts.count(i));
+    }
+    alpha_rowsums_star(i) = rowsum_star;
+  }
+  return(delta);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//////////////////// Gradient of the log-likelihood in log(alpha) /////////////
+///////////////////////////////////////////////////////////////////////////////
+
+// digamma(alpha + y) - digamma(alpha), summing 1 / (alpha + m) for small y
+inline double digamma_ratio (const double& alpha, const unsigned int& y) {
+  if (y == 0) {
+    return(0.0);
+  }
+  if (y > dm_rising_max) {
+    return(R::digamma(alpha + y) - R::digamma(alpha));
+  }
+  double out = 0.0;
+  for (unsigned int m=0; m<y; m++) {
+    out += 1.0 / (alpha + m);
+  }
+  return(out);
+}
+
+// derivative of lgamma_ratio_log with respect to log(alpha), which is
+// alpha * digamma_ratio(alpha, y) and tends to y for large alpha
+inline double lgamma_ratio_log_deriv (const double& log_alpha,
+                                      const unsigned int& y) {
+  if (y == 0) {
+    return(0.0);
+  }
+  if (log_alpha > dm_log_alpha_large) {
+    // derivative of the large-alpha expansion in lgamma_ratio_log
+    double u = std::exp(- log_alpha);
+    double y_double = static_cast<double>(y);
+    double sum_m = 0.5 * y_double * (y_double - 1.0);
+    double sum_m2 = (y_double - 1.0) * y_double * (2.0 * y_double - 1.0) / 6.0;
+    return(y_double - u * sum_m + u * u * sum_m2);
+  }
+  double alpha = std::exp(log_alpha);
+  return(alpha * digamma_ratio(alpha, y));
+}
+
+//
+// Log-likelihood and its gradient with respect to log(alpha) = mu + zeta,
+//
+//   alpha_ij (digamma(alpha_ij + y_ij) - digamma(alpha_ij)) -
+//     alpha_ij (digamma(A_i + n_i) - digamma(A_i))
+//
+// with A_i the row sum of alpha. The likelihood, alpha and the row sums come
+// from the fused kernel, and the gradient is one more pass over alpha plus
+// the non-zero cells. Gradients for mu, eta_star and tau follow by the chain
+// rule through zeta.
+//
+
+inline double LL_DM_fused_grad (const arma::vec& mu, const arma::mat& zeta,
+                                const dm_counts& counts, arma::mat& grad,
+                                arma::mat* alpha = NULL) {
+  arma::mat alpha_tmp;
+  if (alpha == NULL) {
+    alpha = &alpha_tmp;
+  }
+  arma::vec alpha_rowsums;
+  double log_like = LL_DM_fused(mu, zeta, counts, alpha, &alpha_rowsums);
+  arma::uword N = zeta.n_rows;
+  arma::uword d = zeta.n_cols;
+  grad.set_size(N, d);
+  // row total terms
+  for (arma::uword i=0; i<N; i++) {
+    if (alpha_rowsums(i) < 1e10) {
+      double w_i = digamma_ratio(alpha_rowsums(i), counts.count(i));
+      for (arma::uword j=0; j<d; j++) {
+        grad(i, j) = - (*alpha)(i, j) * w_i;
+      }
+    } else {
+      // weights alpha_ij / A_i on the log scale
+      arma::rowvec log_alpha_row = mu.t() + zeta.row(i);
+      double log_max = log_alpha_row.max();
+      double log_rowsum = log_max +
+        std::log(arma::accu(arma::exp(log_alpha_row - log_max)));
+      double w_i = lgamma_ratio_log_deriv(log_rowsum, counts.count(i));
+      for (arma::uword j=0; j<d; j++) {
+        grad(i, j) = - std::exp(log_alpha_row(j) - log_rowsum) * w_i;
+      }
+    }
+  }
+  // cell terms
+  for (arma::uword k=0; k<counts.nonzero.n_elem; k++) {
+    arma::uword idx = counts.nonzero(k);
+    arma::uword j = idx / N;
+    grad(idx) += lgamma_ratio_log_deriv(mu(j) + zeta(idx), counts.y(idx));
+  }
+  return(log_like);
+}
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef DRAWS_MATRIX_H
+#define DRAWS_MATRIX_H
+
+#include <RcppArmadillo.h>
+#include <string>
+#include <vector>
+
+// Preallocated n_save by P draws matrix in the convert_to_coda layout
+
+//
+// Every saved parameter is registered once with the dimensions that follow
+// the iteration index and owns a contiguous block of columns. Columns are
+// named and ordered exactly as convert_to_coda names them, e.g. "phi[1]",
+// "mu[3]" and "alpha[2, 5]" with the last index varying fastest, so the
+// matrix can be handed to coda or posterior without a reshaping pass and
+// without keeping both the per-parameter arrays and their copy in memory.
+//
+
+struct draws_matrix {
+  std::vector<std::string> names;        // parameter names
+  std::vector<std::vector<int> > dims;   // dimensions of each parameter
+  std::vector<int> offsets;              // first column of each parameter
+  int n_cols;
+  int n_save;
+  Rcpp::NumericMatrix draws;
+  double* mem;
+
+  draws_matrix () : n_cols(0), n_save(0), mem(NULL) {}
+
+  // registers a parameter and returns its block index
+  int add (const std::string& name, const std::vector<int>& dim) {
+    int size = 1;
+    for (size_t k=0; k<dim.size(); k++) {
+      size *= dim[k];
+    }
+    names.push_back(name);
+    dims.push_back(dim);
+    offsets.push_back(n_cols);
+    n_cols += size;
+    return(names.size() - 1);
+  }
+
+  // allocates the matrix once all parameters are registered
+  void allocate (const int& n_save_) {
+    n_save = n_save_;
+    draws = Rcpp::NumericMatrix(n_save, n_cols);
+    mem = draws.begin();
+    Rcpp::CharacterVector col_names(n_cols);
+    for (size_t b=0; b<names.size(); b++) {
+      const std::vector<int>& dim = dims[b];
+      std::vector<int> index(dim.size(), 0);
+      int end = b + 1 < names.size() ? offsets[b + 1] : n_cols;
+      for (int col=offsets[b]; col<end; col++) {
+        std::string col_name = names[b] + "[";
+        for (size_t k=0; k<dim.size(); k++) {
+          col_name += (k > 0 ? ", " : "") + std::to_string(index[k] + 1);
+        }
+        col_names[col] = col_name + "]";
+        // advance the index with the last dimension fastest
+        for (int k=dim.size()-1; k>=0; k--) {
+          if (++index[k] < dim[k]) {
+            break;
+          }
+          index[k] = 0;
+        }
+      }
+    }
+    Rcpp::colnames(draws) = col_names;
+  }
+
+  inline void save (const int& block, const int& idx, const double& x) {
+    mem[(size_t)offsets[block] * n_save + idx] = x;
+  }
+
+  inline void save (const int& block, const int& idx, const arma::vec& x) {
+    double* out = mem + (size_t)offsets[block] * n_save + idx;
+    for (arma::uword k=0; k<x.n_elem; k++) {
+      out[k * n_save] = x(k);
+    }
+  }
+
+  inline void save (const int& block, const int& idx, const arma::mat& x) {
+    // row major over x to match the convert_to_coda ordering
+    double* out = mem + (size_t)offsets[block] * n_save + idx;
+    for (arma::uword i=0; i<x.n_rows; i++) {
+      for (arma::uword j=0; j<x.n_cols; j++) {
+        out[(i * x.n_cols + j) * n_save] = x(i, j);
+      }
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef HMC_H
+#define HMC_H
+
+#include <RcppArmadillo.h>
+#include <cmath>
+
+// Hamiltonian Monte Carlo for a block of continuous parameters
+
+//
+// A static HMC update with L leapfrog steps and a diagonal mass matrix. While
+// adapting, the step size is tuned to a target acceptance probability by the
+// dual averaging of Hoffman and Gelman (2014), and the inverse mass matrix is
+// set to the regularised variance of the draws over windows of doubling length,
+// restarting the step size adaptation after each window as Stan does. The
+// block is a plain vector, the caller packs and unpacks its parameters and
+// supplies the log posterior and gradient as
+//
+//   double log_post_grad (const arma::vec& theta, arma::vec& grad)
+//
+
+struct hmc_sampler {
+  double epsilon;          // leapfrog step size
+  int n_steps;             // leapfrog steps per trajectory
+  arma::vec inv_mass;      // diagonal inverse mass matrix
+  // dual averaging of log(epsilon)
+  double target_accept;
+  double mu_da;
+  double H_bar;
+  double log_epsilon_bar;
+  double m;
+  // running variance of the draws in the current mass matrix window
+  double n_window;
+  arma::vec mean_window;
+  arma::vec M2_window;
+  int window_end;
+  int window_size;
+  int window_last;         // no mass matrix updates after this iteration
+
+  hmc_sampler () : epsilon(0.01), n_steps(10), target_accept(0.8) {}
+
+  hmc_sampler (const arma::uword& p, const int& n_adapt,
+               const double& epsilon_, const int& n_steps_,
+               const double& target_accept_) :
+    epsilon(epsilon_), n_steps(n_steps_), inv_mass(p, arma::fill::ones),
+    target_accept(target_accept_), window_end(100), window_size(100),
+    window_last((int)(0.8 * n_adapt)) {
+    restart();
+  }
+
+  void restart () {
+    mu_da = std::log(10.0 * epsilon);
+    H_bar = 0.0;
+    log_epsilon_bar = 0.0;
+    m = 0.0;
+    n_window = 0.0;
+    mean_window.zeros(inv_mass.n_elem);
+    M2_window.zeros(inv_mass.n_elem);
+  }
+
+  // one trajectory from theta, returns the acceptance probability and
+  // updates theta, log_post and grad when the proposal is accepted
+  template <typename F>
+  double step (arma::vec& theta, double& log_post, arma::vec& grad,
+               F& log_post_grad, bool& accepted) {
+    arma::uword p = theta.n_elem;
+    arma::vec momentum(p);
+    for (arma::uword l=0; l<p; l++) {
+      momentum(l) = R::rnorm(0.0, 1.0) / std::sqrt(inv_mass(l));
+    }
+    double H_current = - log_post + 0.5 * arma::dot(momentum % inv_mass, momentum);
+    arma::vec theta_star = theta;
+    arma::vec grad_star = grad;
+    double log_post_star = log_post;
+    momentum += 0.5 * epsilon * grad_star;
+    for (int s=0; s<n_steps; s++) {
+      theta_star += epsilon * (inv_mass % momentum);
+      log_post_star = log_post_grad(theta_star, grad_star);
+      if (!std::isfinite(log_post_star)) {
+        break;
+      }
+      if (s < n_steps - 1) {
+        momentum += epsilon * grad_star;
+      }
+    }
+    momentum += 0.5 * epsilon * grad_star;
+    double accept_prob = 0.0;
+    accepted = false;
+    if (std::isfinite(log_post_star)) {
+      double H_star = - log_post_star + 0.5 * arma::dot(momentum % inv_mass, momentum);
+      accept_prob = std::min(1.0, std::exp(H_current - H_star));
+      if (R::runif(0.0, 1.0) < accept_prob) {
+        theta = theta_star;
+        grad = grad_star;
+        log_post = log_post_star;
+        accepted = true;
+      }
+    }
+    return(accept_prob);
+  }
+
+  // adaptation after iteration k of the adaptation phase
+  void adapt (const int& k, const double& accept_prob, const arma::vec& theta) {
+    // dual averaging with gamma = 0.05, t0 = 10 and kappa = 0.75
+    m += 1.0;
+    double eta = 1.0 / (m + 10.0);
+    H_bar = (1.0 - eta) * H_bar + eta * (target_accept - accept_prob);
+    double log_epsilon = mu_da - std::sqrt(m) / 0.05 * H_bar;
+    double weight = std::pow(m, -0.75);
+    log_epsilon_bar = weight * log_epsilon + (1.0 - weight) * log_epsilon_bar;
+    epsilon = std::exp(log_epsilon);
+    // mass matrix windows
+    if (k + 1 > window_last) {
+      return;
+    }
+    n_window += 1.0;
+    arma::vec delta = theta - mean_window;
+    mean_window += delta / n_window;
+    M2_window += delta % (theta - mean_window);
+    if (k + 1 == window_end) {
+      // shrink towards a small multiple of the identity as Stan does
+      inv_mass = (n_window / (n_window + 5.0)) * M2_window / (n_window - 1.0) +
+        1e-3 * (5.0 / (n_window + 5.0));
+      window_size *= 2;
+      window_end += window_size;
+      restart();
+    }
+  }
+
+  // fix the step size at the end of the adaptation phase
+  void end_adaptation () {
+    if (m > 0.0) {
+      epsilon = std::exp(log_epsilon_bar);
+    }
+  }
+};
+
+#endif
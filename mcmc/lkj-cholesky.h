@@ -0,0 +1,61 @@
+#ifndef LKJ_CHOLESKY_H
+#define LKJ_CHOLESKY_H
+
+#include <RcppArmadillo.h>
+#include <cmath>
+
+// Cholesky factor of an LKJ correlation matrix from canonical partial
+// correlations, one column at a time
+
+//
+// The B = d (d - 1) / 2 canonical partial correlations (CPCs) xi are stored
+// column by column over the upper triangle, xi(idx(i, j)) = z(i, j) for i < j,
+// the order makeUpperLKJ in functions/make-lkj.R and makeRLKJ fill z in, so
+// the CPCs of a column are contiguous. The Beta prior parameter of z(i, j) is
+// eta + (d - 2 - i) / 2. Column j of the upper triangular factor R, with R' R
+// the correlation matrix, depends only on column j of the CPCs,
+//
+//   R(i, j) = z(i, j) * sqrt(prod_{l<i} (1 - z(l, j)^2))    i < j
+//   R(j, j) = sqrt(prod_{l<j} (1 - z(l, j)^2))
+//
+// so a proposal for one column of CPCs changes one column of R and, through
+// zeta = Z eta_star R diag(tau), one column of zeta and alpha.
+//
+
+inline arma::uword lkj_index (const arma::uword& i, const arma::uword& j,
+                              const arma::uword& d) {
+  // position of z(i, j), i < j, in xi
+  return(j * (j - 1) / 2 + i);
+}
+
+// indices in xi of the CPCs in column j, z(0, j), ..., z(j-1, j)
+inline arma::uvec lkj_column_index (const arma::uword& j, const arma::uword& d) {
+  arma::uvec idx(j);
+  for (arma::uword i=0; i<j; i++) {
+    idx(i) = lkj_index(i, j, d);
+  }
+  return(idx);
+}
+
+// column j of R from the j CPCs of column j
+inline arma::vec lkj_cholesky_column (const arma::vec& z, const arma::uword& j,
+                                      const arma::uword& d) {
+  arma::vec R_col(d, arma::fill::zeros);
+  double remainder = 1.0;
+  for (arma::uword i=0; i<j; i++) {
+    R_col(i) = z(i) * std::sqrt(remainder);
+    remainder *= 1.0 - z(i) * z(i);
+  }
+  R_col(j) = std::sqrt(remainder);
+  return(R_col);
+}
+
+inline arma::mat lkj_cholesky (const arma::vec& xi, const arma::uword& d) {
+  arma::mat R(d, d, arma::fill::zeros);
+  for (arma::uword j=0; j<d; j++) {
+    R.col(j) = lkj_cholesky_column(xi.elem(lkj_column_index(j, d)), j, d);
+  }
+  return(R);
+}
+
+#endif
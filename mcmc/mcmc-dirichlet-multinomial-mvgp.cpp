@@ -2,11 +2,25 @@
 #include <RcppArmadillo.h>
 // // [[Rcpp::depends(RcppArmadillo)]]
 // [[Rcpp::depends(RcppArmadillo, myFunctions)]]
+// [[Rcpp::plugins(cpp14, openmp)]]
 #include "myFunctionsHeader.h"
+#include "dm-likelihood.h"
+#include "count-dataset.h"
+#include "adaptive-metropolis.h"
+#include "correlation-functions.h"
+#include "lkj-cholesky.h"
+#include "draws-matrix.h"
+#include "hmc.h"
+#include "online-summary.h"
+#include "sample-store.h"
 #include <iostream>  // I/O 
 #include <fstream>   // file I/O
 #include <iomanip>   // format manipulation
 #include <string>
+#include <type_traits>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace Rcpp;
 using namespace arma;
@@ -48,6 +62,32 @@ double dMVNChol (const arma::vec& y, const arma::vec& mu,
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+/////////////////////// Random effects zeta = Z eta_star R_tau ////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+//
+// With the LKJ correlation R_tau = R diag(tau) is d by d. With the factor
+// model of rank r = R_tau.n_rows - d the first r columns of eta_star are the
+// shared factor processes and R_tau = [Gamma; I] diag(tau), so the cross
+// species covariance is diag(tau) (Gamma' Gamma + I) diag(tau). The identity
+// block is applied as a column scaling, so the cost is O(N K (r + d) + N r d)
+// rather than quadratic in d.
+//
+
+inline arma::mat make_zeta (const arma::mat& Z, const arma::mat& eta_star,
+                            const arma::mat& R_tau) {
+  arma::uword d = R_tau.n_cols;
+  arma::uword n_factors = R_tau.n_rows - d;
+  if (n_factors == 0) {
+    return(Z * eta_star * R_tau);
+  }
+  arma::mat zeta = Z * eta_star.tail_cols(d);
+  zeta.each_row() %= R_tau.tail_rows(d).diag().t();
+  zeta += (Z * eta_star.head_cols(n_factors)) * R_tau.head_rows(n_factors);
+  return(zeta);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 ////////////////////////// Elliptical Slice Samplers //////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
@@ -56,24 +96,23 @@ double dMVNChol (const arma::vec& y, const arma::vec& mu,
 ///////////// Elliptical Slice Sampler for random effect eta_star /////////////
 ///////////////////////////////////////////////////////////////////////////////
 
-// [[Rcpp::export]]
 Rcpp::List ess (const arma::mat& eta_star_current,
                 const arma::vec& prior_sample,
                 const arma::mat& alpha_current, 
-                const arma::mat& mu_mat_current, 
+                const arma::vec& mu_current, 
                 const arma::mat& zeta_current, 
                 const arma::mat& R_tau_current,
-                const arma::mat& Z_current, const arma::mat& y,
-                const int& N, const int& d, const int& j,
-                const arma::vec& count, 
-                const std::string& file_name, const int& n_chain) {
+                const arma::mat& Z_current, const dm_counts& counts,
+                const double& current_log_like,
+                const int& j, const std::string& file_name,
+                const int& n_chain) {
   // eta_star_current is the current value of the joint multivariate predictive process
   // prior_sample is a sample from the prior joing multivariate predictive process
   // R_tau is the current value of the Cholskey decomposition for  predictive process linear interpolator
   // Z_current is the current predictive process linear 
+  // counts are the pre-computed integer counts for the observed sites
+  // current_log_like is the cached log likelihood of the current value
   
-  // calculate log likelihood of current value
-  double current_log_like = LL_DM(alpha_current, y, N, d, count);
   double hh = log(R::runif(0.0, 1.0)) + current_log_like;
   
   
@@ -87,6 +126,12 @@ Rcpp::List ess (const arma::mat& eta_star_current,
   arma::mat eta_star_proposal = eta_star_current;
   arma::mat zeta_ess = zeta_current;
   arma::mat alpha_ess = alpha_current;
+  arma::mat alpha_proposal(alpha_current.n_rows, alpha_current.n_cols);
+  double log_like_ess = current_log_like;
+  // only column j of eta_star moves, so zeta changes by the rank one term
+  // Z (eta_star_proposal.col(j) - eta_star_current.col(j)) R_tau.row(j)
+  arma::vec Z_eta_j = Z_current * eta_star_current.col(j);
+  arma::vec Z_prior = Z_current * prior_sample;
   bool test = true;
   
   // Slice sampling loop
@@ -94,62 +139,33 @@ Rcpp::List ess (const arma::mat& eta_star_current,
     // compute proposal for angle difference and check to see if it is on the slice
     eta_star_proposal.col(j) = eta_star_current.col(j) * cos(phi_angle) +
       prior_sample * sin(phi_angle);
-    arma::mat zeta_proposal = Z_current * eta_star_proposal * R_tau_current;
-    arma::mat alpha_proposal = exp(mu_mat_current + zeta_proposal);
-    // calculate log likelihood of proposed value
-    double proposal_log_like = LL_DM(alpha_proposal, y, N, d, count);
-    // control to limit alpha from getting unreasonably large
-    if (alpha_proposal.max() > pow(10.0, 10.0) ) {
-      // Rprintf("Bug - alpha (eta_star) is to large for LL to be stable \n");
-      // // set up output messages
-      // std::ofstream file_out;
-      // file_out.open(file_name, std::ios_base::app);
-      // file_out << "Bug - alpha (eta_star) is to large for LL to be stable on chain " << n_chain << "\n";
-      // // close output file
-      // file_out.close(); 
-      if (phi_angle > 0.0) {
-        phi_angle_max = phi_angle;
-      } else if (phi_angle < 0.0) {
-        phi_angle_min = phi_angle;
-      } else {
-        Rprintf("Bug - ESS for eta_star shrunk to current position with large alpha \n");
-        // set up output messages
-        std::ofstream file_out;
-        file_out.open(file_name, std::ios_base::app);
-        file_out << "Bug - ESS for eta_star shrunk to current position with large alpha on chain " << n_chain << "\n";
-        // close output file
-        file_out.close(); 
-        // proposal failed and don't update the chain
-        // eta_star_ess = eta_star_proposal;
-        // zeta_ess = zeta_proposal;
-        // alpha_ess = alpha_proposal;
-        test = false;
-      }
+    arma::vec Z_delta = Z_eta_j * (cos(phi_angle) - 1.0) + Z_prior * sin(phi_angle);
+    arma::mat zeta_proposal = zeta_current + Z_delta * R_tau_current.row(j);
+    // calculate log likelihood of proposed value, large alpha are handled on
+    // the log scale so no proposal needs to be rejected for being too large
+    double proposal_log_like = LL_DM_fused(mu_current, zeta_proposal, counts,
+                                           &alpha_proposal);
+    if (proposal_log_like > hh) {
+      // proposal is on the slice
+      eta_star_ess = eta_star_proposal;
+      zeta_ess = zeta_proposal;
+      alpha_ess.swap(alpha_proposal);
+      log_like_ess = proposal_log_like;
+      test = false;
+    } else if (phi_angle > 0.0) {
+      phi_angle_max = phi_angle;
+    } else if (phi_angle < 0.0) {
+      phi_angle_min = phi_angle;
     } else {
-      if (proposal_log_like > hh) {
-        // proposal is on the slice
-        eta_star_ess = eta_star_proposal;
-        zeta_ess = zeta_proposal;
-        alpha_ess = alpha_proposal;
-        test = false;
-      } else if (phi_angle > 0.0) {
-        phi_angle_max = phi_angle;
-      } else if (phi_angle < 0.0) {
-        phi_angle_min = phi_angle;
-      } else {
-        Rprintf("Bug - ESS for eta_star shrunk to current position \n");
-        // set up output messages
-        std::ofstream file_out;
-        file_out.open(file_name, std::ios_base::app);
-        file_out << "Bug - ESS for eta_star shrunk to current position on chain " << n_chain << "\n";
-        // close output file
-        file_out.close(); 
-        // proposal failed and don't update the chain
-        // eta_star_ess = eta_star_proposal;
-        // zeta_ess = zeta_proposal;
-        // alpha_ess = alpha_proposal;
-        test = false;
-      }
+      Rprintf("Bug - ESS for eta_star shrunk to current position \n");
+      // set up output messages
+      std::ofstream file_out;
+      file_out.open(file_name, std::ios_base::app);
+      file_out << "Bug - ESS for eta_star shrunk to current position on chain " << n_chain << "\n";
+      // close output file
+      file_out.close(); 
+      // proposal failed and don't update the chain
+      test = false;
     }
     // Propose new angle difference
     phi_angle = R::runif(0.0, 1.0) * (phi_angle_max - phi_angle_min) + phi_angle_min;
@@ -157,34 +173,35 @@ Rcpp::List ess (const arma::mat& eta_star_current,
   return(Rcpp::List::create(
       _["eta_star"] = eta_star_ess,
       _["zeta"] = zeta_ess,
-      _["alpha"] = alpha_ess));
+      _["alpha"] = alpha_ess,
+      _["log_like"] = log_like_ess));
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 ///////////// Elliptical Slice Sampler for unobserved covariate X /////////////
 ///////////////////////////////////////////////////////////////////////////////
 
-// [[Rcpp::export]]
+template <typename corr>
 Rcpp::List ess_X (const double& X_current, const double& X_prior,
                   const double& mu_X, const arma::vec& X_knots,
-                  const arma::rowvec& y_current,
+                  const dm_counts& counts, const int& i,
                   const arma::rowvec& mu_current,
                   const arma::mat& eta_star_current, 
+                  const arma::rowvec& zeta_current, 
                   const arma::rowvec& alpha_current, 
                   const arma::rowvec& D_current,
                   const arma::rowvec& c_current, const arma::mat& R_tau_current,
                   const arma::rowvec& Z_current, const double& phi_current, 
                   const arma::mat C_inv_current,                   
-                  const int& d, const double& count_double,
-                  const std::string& file_name, const int& n_chain, 
-                  const std::string& corr_function) {
+                  const std::string& file_name, const int& n_chain) {
   // eta_star_current is the current value of the joint multivariate predictive process
   // prior_sample is a sample from the prior joing multivariate predictive process
   // R_tau is the current value of the Cholskey decomposition for  predictive process linear interpolator
   // Z_current is the current predictive process linear 
+  // counts are the pre-computed integer counts and i is the site being updated
   
   // calculate log likelihood of current value
-  double current_log_like = LL_DM_row(alpha_current, y_current, d, count_double);
+  double current_log_like = LL_DM_row_log(mu_current + zeta_current, counts, i);
   double hh = log(R::runif(0.0, 1.0)) + current_log_like;
   
   // Setup a bracket and pick a first proposal
@@ -198,7 +215,7 @@ Rcpp::List ess_X (const double& X_current, const double& X_prior,
   arma::rowvec D_ess = D_current;
   arma::rowvec c_ess = c_current;
   arma::rowvec Z_ess = Z_current;
-  arma::rowvec zeta_ess = alpha_current;
+  arma::rowvec zeta_ess = zeta_current;
   arma::rowvec alpha_ess = alpha_current;
   bool test = true;
   
@@ -208,57 +225,36 @@ Rcpp::List ess_X (const double& X_current, const double& X_prior,
     double X_proposal = X_current * cos(phi_angle) + X_prior * sin(phi_angle);
     // adjust for non-zero mean
     double X_tilde = X_proposal + mu_X;
-    arma::rowvec D_proposal = sqrt(pow(X_tilde - X_knots, 2.0)).t();
-    if (corr_function == "gaussian") {
-      D_proposal = pow(D_proposal, 2.0);
-    }
-    arma::rowvec c_proposal = exp( - D_proposal / phi_current);
+    arma::rowvec D_proposal = abs(X_tilde - X_knots).t();
+    arma::rowvec c_proposal = corr_matrix<corr>(D_proposal, phi_current);
     arma::rowvec Z_proposal = c_proposal * C_inv_current;
-    arma::rowvec zeta_proposal = Z_proposal * eta_star_current * R_tau_current;
-    arma::rowvec alpha_proposal = exp(mu_current + zeta_proposal);
+    arma::rowvec zeta_proposal = make_zeta(Z_proposal, eta_star_current, R_tau_current);
+    arma::rowvec log_alpha_proposal = mu_current + zeta_proposal;
     
     // calculate log likelihood of proposed value
-    double proposal_log_like = LL_DM_row(alpha_proposal, y_current, d, count_double);
-    // control to limit alpha from getting unreasonably large
-    if (alpha_proposal.max() > pow(10.0, 10.0) ) {
-      if (phi_angle > 0.0) {
-        phi_angle_max = phi_angle;
-      } else if (phi_angle < 0.0) {
-        phi_angle_min = phi_angle;
-      } else {
-        Rprintf("Bug - ESS for X shrunk to current position with large alpha \n");
-        // set up output messages
-        std::ofstream file_out;
-        file_out.open(file_name, std::ios_base::app);
-        file_out << "Bug - ESS for X shrunk to current position with large alpha on chain " << n_chain << "\n";
-        // close output file
-        file_out.close(); 
-        test = false;
-      }
+    double proposal_log_like = LL_DM_row_log(log_alpha_proposal, counts, i);
+    if (proposal_log_like > hh) {
+      // proposal is on the slice
+      X_ess = X_proposal;
+      D_ess = D_proposal;
+      c_ess = c_proposal;
+      Z_ess = Z_proposal;
+      zeta_ess = zeta_proposal;
+      alpha_ess = exp(log_alpha_proposal);
+      test = false;
+    } else if (phi_angle > 0.0) {
+      phi_angle_max = phi_angle;
+    } else if (phi_angle < 0.0) {
+      phi_angle_min = phi_angle;
     } else {
-      if (proposal_log_like > hh) {
-        // proposal is on the slice
-        X_ess = X_proposal;
-        D_ess = D_proposal;
-        c_ess = c_proposal;
-        Z_ess = Z_proposal;
-        zeta_ess = zeta_proposal;
-        alpha_ess = alpha_proposal;
-        test = false;
-      } else if (phi_angle > 0.0) {
-        phi_angle_max = phi_angle;
-      } else if (phi_angle < 0.0) {
-        phi_angle_min = phi_angle;
-      } else {
-        Rprintf("Bug - ESS for X shrunk to current position \n");
-        // set up output messages
-        std::ofstream file_out;
-        file_out.open(file_name, std::ios_base::app);
-        file_out << "Bug - ESS for X shrunk to current position on chain " << n_chain << "\n";
-        // close output file
-        file_out.close(); 
-        test = false;
-      }
+      Rprintf("Bug - ESS for X shrunk to current position \n");
+      // set up output messages
+      std::ofstream file_out;
+      file_out.open(file_name, std::ios_base::app);
+      file_out << "Bug - ESS for X shrunk to current position on chain " << n_chain << "\n";
+      // close output file
+      file_out.close(); 
+      test = false;
     }
     // Propose new angle difference
     phi_angle = R::runif(0.0, 1.0) * (phi_angle_max - phi_angle_min) + phi_angle_min;
@@ -300,12 +296,14 @@ double dMVN (const arma::mat& y, const arma::vec& mu,
 ////////////////////////////////// MCMC Loop //////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 
-// [[Rcpp::export]]
-List mcmcRcpp (const arma::mat& Y, const arma::vec& X, 
-               const arma::mat& Y_pred, List params, 
-               int n_chain=1, bool pool_s2_tau2=true,
-               std::string file_name="DM-fit", 
-               std::string corr_function="exponential") {
+// phases of the chain, each gets its own instantiation of the sampler step
+enum mcmc_phase { phase_adapt, phase_fit };
+
+template <typename corr>
+List mcmc_corr (const dm_counts& Y_counts, const arma::vec& X, 
+                const dm_counts& Y_pred_counts, List params, 
+                int n_chain, bool pool_s2_tau2,
+                std::string file_name) {
   
   // Load parameters
   int n_adapt = as<int>(params["n_adapt"]);
@@ -313,20 +311,10 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
   int n_thin = as<int>(params["n_thin"]);
   
   // set up dimensions
-  double N = Y.n_rows;
-  double d = Y.n_cols;
-  double N_pred = Y_pred.n_rows;
+  double N = Y_counts.y.n_rows;
+  double d = Y_counts.y.n_cols;
+  double N_pred = Y_pred_counts.y.n_rows;
   double B = Rf_choose(d, 2);
-
-  // count - sum of counts at each site
-  arma::vec count(N);
-  for (int i=0; i<N; i++) {
-    count(i) = sum(Y.row(i));
-  }
-  arma::vec count_pred(N_pred);
-  for (int i=0; i<N_pred; i++) {
-    count_pred(i) = sum(Y_pred.row(i));
-  }  
   
   // add in option for reference category for Sigma
   bool Sigma_reference_category = false;
@@ -411,8 +399,6 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
   if (params.containsElementNamed("lambda_eta_star_tune")) {
     lambda_eta_star_tune_tmp = as<double>(params["lambda_eta_star_tune"]);
   }
-  arma::vec lambda_eta_star_tune(d, arma::fill::ones);
-  lambda_eta_star_tune *= lambda_eta_star_tune_tmp;
   
   // default tau2 tuning parameter 
   double lambda_tau2_tune = 0.25;
@@ -425,6 +411,12 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
   if (params.containsElementNamed("lambda_xi_tune")) {
     lambda_xi_tune = as<double>(params["lambda_xi_tune"]);
   }
+  // default full proposal covariance for xi, a positive rank uses a diagonal
+  // plus low rank covariance for very many species
+  int xi_tune_rank = 0;
+  if (params.containsElementNamed("xi_tune_rank")) {
+    xi_tune_rank = as<int>(params["xi_tune_rank"]);
+  }
   
   // default X tuning parameter standard deviation of 0.25
   double X_tune_tmp = 0.5;
@@ -452,15 +444,10 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
   }
 
   arma::mat D = makeDistARMA(X, X_knots);
-  arma::mat D_pred = makeDistARMA(X_pred, X_knots);
+  // X_pred is centered, the distances are on the scale of the knots as in
+  // ess_X
+  arma::mat D_pred = makeDistARMA(X_pred + mu_X, X_knots);
   arma::mat D_knots = makeDistARMA(X_knots, X_knots);  
-  if (corr_function == "gaussian") {
-    D = pow(D, 2.0);
-    D_pred = pow(D_pred, 2.0);
-    D_knots = pow(D_knots, 2.0);
-  } else if (corr_function != "exponential") {
-    stop ("the only valid correlation functions are exponential and gaussian");
-  }
   
   //
   // initialize values
@@ -482,10 +469,6 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
   if (params.containsElementNamed("sample_mu")) {
     sample_mu = as<bool>(params["sample_mu"]);
   }
-  arma::mat mu_mat(N, d);
-  for (int i=0; i<N; i++) {
-    mu_mat.row(i) = mu.t();
-  }
   arma::mat mu_mat_pred(N_pred, d);
   for (int i=0; i<N_pred; i++) {
     mu_mat_pred.row(i) = mu.t();
@@ -532,21 +515,34 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
   // Construct Gaussian Process Correlation matrices
   //
   
-  arma::mat C = exp(- D_knots / phi) + I_prevent_singular;
+  arma::mat C = corr_matrix<corr>(D_knots, phi) + I_prevent_singular;
   arma::mat C_chol = chol(C);
   arma::mat C_inv = inv_sympd(C);
-  arma::mat c = exp( - D / phi);
+  arma::mat c = corr_matrix<corr>(D, phi);
   arma::mat Z = c * C_inv;
-  arma::mat c_pred = exp( - D_pred / phi);
+  arma::mat c_pred = corr_matrix<corr>(D_pred, phi);
   arma::mat Z_pred = c_pred * C_inv;
   
   //
   // Default predictive process random effect eta_star
   //
   
-  arma::mat eta_star = mvrnormArmaChol(d, zero_knots, C_chol).t();
+  // default full LKJ correlation across species, a positive number of
+  // factors uses the low rank factor model, whose shared factor processes
+  // are the first n_factors columns of eta_star
+  int n_factors = 0;
+  if (params.containsElementNamed("n_factors")) {
+    n_factors = as<int>(params["n_factors"]);
+  }
+  if (n_factors < 0 || n_factors >= d) {
+    stop("n_factors must be between 0 and d - 1");
+  }
+  arma::mat eta_star = mvrnormArmaChol(d + n_factors, zero_knots, C_chol).t();
   if (params.containsElementNamed("eta_star")) {
     eta_star = as<mat>(params["eta_star"]);
+    if (eta_star.n_cols != d + n_factors) {
+      stop("eta_star must have d + n_factors columns");
+    }
   }
   bool sample_eta_star = true;
   if (params.containsElementNamed("sample_eta_star")) {
@@ -556,18 +552,48 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
   if (params.containsElementNamed("sample_eta_star_mh")) {
     sample_eta_star_mh = as<bool>(params["sample_eta_star_mh"]);
   }
+  // default centred eta_star, whitening samples w with eta_star = t(chol(C)) w
+  // and w standard normal, so phi moves eta_star with it and the phi update
+  // has no prior density terms for eta_star
+  bool whiten_eta_star = false;
+  if (params.containsElementNamed("whiten_eta_star")) {
+    whiten_eta_star = as<bool>(params["whiten_eta_star"]);
+  }
+  
+  //
+  // Hamiltonian Monte Carlo for the joint block (mu, eta_star, log tau2)
+  //
+  
+  // default to the separate MH and slice updates of mu, eta_star and tau2
+  bool sample_hmc = false;
+  if (params.containsElementNamed("sample_hmc")) {
+    sample_hmc = as<bool>(params["sample_hmc"]);
+  }
+  // default 10 leapfrog steps, initial step size and target acceptance
+  int hmc_steps = 10;
+  if (params.containsElementNamed("hmc_steps")) {
+    hmc_steps = as<int>(params["hmc_steps"]);
+  }
+  double hmc_epsilon = 0.01;
+  if (params.containsElementNamed("hmc_epsilon")) {
+    hmc_epsilon = as<double>(params["hmc_epsilon"]);
+  }
+  double hmc_target_accept = 0.8;
+  if (params.containsElementNamed("hmc_target_accept")) {
+    hmc_target_accept = as<double>(params["hmc_target_accept"]);
+  }
   
   //
   // Default LKJ hyperparameter xi
   //
   
+  // the CPC z(i, j) has a Beta(eta + (d - 2 - i) / 2) prior, with xi stored
+  // column by column as in makeRLKJ
   arma::vec eta_vec(B);
-  int idx_eta = 0;
-  for (int j=0; j<(d-1); j++) {
-    for (int k=0; k<(d-j-1); k++) {
-      eta_vec(idx_eta+k) = eta + (d - 2.0 - j) / 2.0;
+  for (int j=1; j<d; j++) {
+    for (int i=0; i<j; i++) {
+      eta_vec(lkj_index(i, j, d)) = eta + (d - 2.0 - i) / 2.0;
     }
-    idx_eta += d-j-1;
   }
   arma::vec xi(B);
   for (int b=0; b<B; b++) {
@@ -585,28 +611,139 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
     sample_xi = as<bool>(params["sample_xi"]);
   }
   Rcpp::List R_out = makeRLKJ(xi, d, true, true);
-  double log_jacobian = as<double>(R_out["log_jacobian"]);
   arma::mat R = as<mat>(R_out["R"]);
+  // default to updating xi one column of CPCs at a time, which only changes
+  // one column of R, zeta and alpha
+  bool sample_xi_block = true;
+  if (params.containsElementNamed("sample_xi_block")) {
+    sample_xi_block = as<bool>(params["sample_xi_block"]);
+  }
+  if (d <= 2) {
+    // a single correlation is one block anyway
+    sample_xi_block = false;
+  }
+  
+  //
+  // Factor loadings Gamma for the low rank factor model
+  //
+  
+  // default prior variance of the loadings
+  double s2_Gamma = 1.0;
+  if (params.containsElementNamed("s2_Gamma")) {
+    s2_Gamma = as<double>(params["s2_Gamma"]);
+  }
+  double lambda_Gamma_tune = 1.0 / pow(3.0, 0.8);
+  if (params.containsElementNamed("lambda_Gamma_tune")) {
+    lambda_Gamma_tune = as<double>(params["lambda_Gamma_tune"]);
+  }
+  bool sample_Gamma = n_factors > 0;
+  if (n_factors > 0) {
+    arma::mat Gamma(n_factors, d);
+    for (int l=0; l<n_factors; l++) {
+      for (int j=0; j<d; j++) {
+        Gamma(l, j) = R::rnorm(0.0, sqrt(s2_Gamma));
+      }
+    }
+    if (params.containsElementNamed("Gamma")) {
+      Gamma = as<mat>(params["Gamma"]);
+    }
+    if (params.containsElementNamed("sample_Gamma")) {
+      sample_Gamma = as<bool>(params["sample_Gamma"]);
+    }
+    // R = [Gamma; I] replaces the LKJ factor and xi is not used
+    R = join_cols(Gamma, I_d);
+    sample_xi = false;
+    sample_xi_block = false;
+  }
   arma::mat R_tau = R * diagmat(tau);
-  arma::mat zeta = Z * eta_star * R_tau;
-  arma::mat zeta_pred = Z_pred * eta_star * R_tau;
-  arma::mat alpha = exp(mu_mat + zeta);
+  arma::mat zeta = make_zeta(Z, eta_star, R_tau);
+  arma::mat zeta_pred = make_zeta(Z_pred, eta_star, R_tau);
+  // alpha and the log likelihood of the current state, which every update
+  // that moves alpha keeps up to date so both sides of each Metropolis
+  // ratio come from the same evaluator
+  arma::mat alpha(N, d);
+  double log_like = LL_DM_fused(mu, zeta, Y_counts, &alpha);
+  // proposal buffer for alpha, filled by the fused likelihood and swapped in
+  // on acceptance
+  arma::mat alpha_star(N, d);
   arma::mat alpha_pred = exp(mu_mat_pred + zeta_pred);
   
   // setup save variables
   int n_save = n_mcmc / n_thin;
-  arma::cube alpha_save(n_save, N, d, arma::fill::zeros);
-  arma::cube alpha_pred_save(n_save, N_pred, d, arma::fill::zeros);
-  arma::cube zeta_save(n_save, N, d, arma::fill::zeros);
-  arma::cube zeta_pred_save(n_save, N_pred, d, arma::fill::zeros);
-  arma::mat mu_save(n_save, d, arma::fill::zeros);
-  arma::mat X_save(n_save, N_pred, arma::fill::zeros);
-  arma::mat tau2_save(n_save, d, arma::fill::zeros);
-  arma::vec s2_tau2_save(n_save, arma::fill::zeros);
-  arma::vec phi_save(n_save, arma::fill::zeros);
-  arma::cube eta_star_save(n_save, N_knots, d, arma::fill::zeros);
-  arma::cube R_save(n_save, d, d, arma::fill::zeros);
-  arma::mat xi_save(n_save, B, arma::fill::zeros);
+  // optionally save straight into a single draws matrix in the
+  // convert_to_coda layout instead of the per-parameter arrays
+  bool save_draws_matrix = false;
+  if (params.containsElementNamed("save_draws_matrix")) {
+    save_draws_matrix = as<bool>(params["save_draws_matrix"]);
+  }
+  // storage of eta_star and the N by d arrays can be turned off when only
+  // the online summaries of the reconstruction are needed, the cheap
+  // primitives mu, phi, tau2, X and R or Gamma and xi are always kept
+  bool save_draws = true;
+  if (params.containsElementNamed("save_draws")) {
+    save_draws = as<bool>(params["save_draws"]);
+  }
+  bool save_summary = false;
+  if (params.containsElementNamed("save_summary")) {
+    save_summary = as<bool>(params["save_summary"]);
+  }
+  arma::vec summary_probs = {0.025, 0.5, 0.975};
+  if (params.containsElementNamed("summary_probs")) {
+    summary_probs = as<vec>(params["summary_probs"]);
+  }
+  // alpha, zeta and their predictive versions are deterministic functions
+  // of the other parameters, with save_derived = FALSE they are left out
+  // and can be rebuilt afterwards with regenerateRcpp
+  bool save_derived = true;
+  if (params.containsElementNamed("save_derived")) {
+    save_derived = as<bool>(params["save_derived"]);
+  }
+  bool use_draws_matrix = save_draws && save_draws_matrix;
+  int n_save_primitives = use_draws_matrix ? 0 : n_save;
+  int n_save_arrays = (use_draws_matrix || !save_draws) ? 0 : n_save;
+  int n_save_derived = save_derived ? n_save_arrays : 0;
+  sample_store alpha_save(n_save_derived, N, d);
+  sample_store alpha_pred_save(n_save_derived, N_pred, d);
+  sample_store zeta_save(n_save_derived, N, d);
+  sample_store zeta_pred_save(n_save_derived, N_pred, d);
+  arma::mat mu_save(n_save_primitives, d, arma::fill::zeros);
+  arma::mat X_save(n_save_primitives, N_pred, arma::fill::zeros);
+  arma::mat tau2_save(n_save_primitives, d, arma::fill::zeros);
+  arma::vec s2_tau2_save(n_save_primitives, arma::fill::zeros);
+  arma::vec phi_save(n_save_primitives, arma::fill::zeros);
+  sample_store eta_star_save(n_save_arrays, N_knots, eta_star.n_cols);
+  // the factor model saves the loadings Gamma in place of R and xi
+  std::string R_name = n_factors > 0 ? "Gamma" : "R";
+  int R_rows = n_factors > 0 ? n_factors : (int)d;
+  sample_store R_save(n_save_primitives, R_rows, d);
+  arma::mat xi_save(n_save_primitives, n_factors > 0 ? 0 : B, arma::fill::zeros);
+  // blocks registered in the order of the returned list
+  draws_matrix draws;
+  int mu_block = draws.add("mu", {(int)d});
+  int eta_star_block = draws.add("eta_star", {(int)N_knots, (int)eta_star.n_cols});
+  int zeta_block = save_derived ? draws.add("zeta", {(int)N, (int)d}) : -1;
+  int zeta_pred_block = save_derived ? draws.add("zeta_pred", {(int)N_pred, (int)d}) : -1;
+  int alpha_block = save_derived ? draws.add("alpha", {(int)N, (int)d}) : -1;
+  int alpha_pred_block = save_derived ? draws.add("alpha_pred", {(int)N_pred, (int)d}) : -1;
+  int phi_block = draws.add("phi", {1});
+  int tau2_block = draws.add("tau2", {(int)d});
+  int X_block = draws.add("X", {(int)N_pred});
+  int R_block = draws.add(R_name, {R_rows, (int)d});
+  int xi_block = n_factors > 0 ? -1 : draws.add("xi", {(int)B});
+  if (use_draws_matrix) {
+    draws.allocate(n_save);
+  }
+  // running summaries of the reconstruction
+  online_summary X_summary;
+  online_covariance X_covariance;
+  online_summary alpha_pred_summary;
+  online_summary zeta_pred_summary;
+  if (save_summary) {
+    X_summary = online_summary(N_pred, 1, summary_probs);
+    X_covariance = online_covariance(N_pred);
+    alpha_pred_summary = online_summary(N_pred, d, summary_probs);
+    zeta_pred_summary = online_summary(N_pred, d, summary_probs);
+  }
   
   // initialize tuning
   double phi_accept = 0.0;
@@ -614,92 +751,202 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
   double s2_tau2_accept = 0.0;
   double s2_tau2_accept_batch = 0.0;
   double s2_tau2_tune = 1.0;
+  // adaptive Metropolis proposals for the vector blocks, with the proposal
+  // covariance updated online every iteration of the adaptation phase
   double mu_accept = 0.0;
-  double mu_accept_batch = 0.0;
-  arma::mat mu_batch(50, d, arma::fill::zeros);
-  arma::mat Sigma_mu_tune(d, d, arma::fill::eye);
-  arma::mat Sigma_mu_tune_chol = chol(Sigma_mu_tune);
+  adaptive_metropolis mu_tune(d, lambda_mu_tune);
   double tau2_accept = 0.0;
-  double tau2_accept_batch = 0.0;
-  arma::mat tau2_batch(50, d, arma::fill::zeros);
-  arma::mat Sigma_tau2_tune(d, d, arma::fill::eye);
-  arma::mat Sigma_tau2_tune_chol = chol(Sigma_tau2_tune);
-  if (Sigma_reference_category) {
-    Sigma_tau2_tune.shed_col(d-1);
-    Sigma_tau2_tune.shed_row(d-1);
-    Sigma_tau2_tune_chol.shed_col(d-1);
-    Sigma_tau2_tune_chol.shed_row(d-1);
-    tau2_batch.shed_col(d-1);
-  }
-  double xi_accept = 0.0;
-  double xi_accept_batch = 0.0;
-  arma::mat xi_batch(50, B, arma::fill::zeros);
-  arma::mat Sigma_xi_tune(B, B, arma::fill::eye);
-  arma::mat Sigma_xi_tune_chol = chol(Sigma_xi_tune);
-  arma::vec eta_star_accept(d, arma::fill::zeros);
-  arma::vec eta_star_accept_batch(d, arma::fill::zeros);
-  arma::cube eta_star_batch(50, N_knots, d, arma::fill::zeros);
-  arma::cube Sigma_eta_star_tune(N_knots, N_knots, d, arma::fill::zeros);
-  arma::cube Sigma_eta_star_tune_chol(N_knots, N_knots, d, arma::fill::zeros);
-  for(int j=0; j<d; j++) {
-    Sigma_eta_star_tune.slice(j).eye();
-    Sigma_eta_star_tune_chol.slice(j) = chol(Sigma_eta_star_tune.slice(j));
+  adaptive_metropolis tau2_tune(Sigma_reference_category ? d-1 : d,
+                                lambda_tau2_tune);
+  arma::vec xi_accept(sample_xi_block ? (int)d-1 : 1, arma::fill::zeros);
+  adaptive_metropolis xi_tune;
+  std::vector<adaptive_metropolis> xi_block_tune;
+  if (sample_xi_block) {
+    // column j of the CPCs has j elements
+    for (int j=1; j<d; j++) {
+      xi_block_tune.push_back(adaptive_metropolis(j, lambda_xi_tune));
+    }
+  } else {
+    xi_tune = adaptive_metropolis(B, lambda_xi_tune, xi_tune_rank);
   }
+  // the HMC block holds mu, then eta_star (w when whitened) by column, then
+  // log tau2 for the parameters that are sampled
+  double hmc_accept = 0.0;
+  int p_mu = sample_mu ? d : 0;
+  int p_eta = sample_eta_star ? N_knots * eta_star.n_cols : 0;
+  int p_tau2 = sample_tau2 ? (Sigma_reference_category ? d-1 : d) : 0;
+  hmc_sampler hmc(p_mu + p_eta + p_tau2, n_adapt, hmc_epsilon, hmc_steps,
+                  hmc_target_accept);
+  auto hmc_unpack = [&] (const arma::vec& theta, arma::vec& mu_h,
+                         arma::mat& eta_h, arma::vec& log_tau2_h) {
+    mu_h = mu;
+    eta_h = eta_star;
+    log_tau2_h = log(tau2);
+    if (p_mu > 0) {
+      mu_h = theta.subvec(0, p_mu-1);
+    }
+    if (p_eta > 0) {
+      eta_h = reshape(theta.subvec(p_mu, p_mu+p_eta-1), N_knots, eta_star.n_cols);
+      if (whiten_eta_star) {
+        eta_h = C_chol.t() * eta_h;
+      }
+    }
+    if (p_tau2 > 0) {
+      log_tau2_h.head(p_tau2) = theta.tail(p_tau2);
+    }
+  };
+  // log posterior of the block and its gradient, through zeta by the chain
+  // rule from the gradient in log(alpha)
+  auto hmc_log_post = [&] (const arma::vec& theta, arma::vec& grad) {
+    arma::vec mu_h;
+    arma::mat eta_h;
+    arma::vec log_tau2_h;
+    hmc_unpack(theta, mu_h, eta_h, log_tau2_h);
+    arma::mat R_tau_h = R * diagmat(exp(0.5 * log_tau2_h));
+    arma::mat zeta_h = make_zeta(Z, eta_h, R_tau_h);
+    arma::mat G;
+    double log_post = LL_DM_fused_grad(mu_h, zeta_h, Y_counts, G);
+    arma::mat Zt_G = Z.t() * G;
+    grad.set_size(theta.n_elem);
+    if (p_mu > 0) {
+      arma::vec mu_centered = mu_h - mu_mu;
+      arma::vec Sigma_mu_inv_mu = Sigma_mu_inv * mu_centered;
+      log_post -= 0.5 * dot(mu_centered, Sigma_mu_inv_mu);
+      grad.subvec(0, p_mu-1) = sum(G, 0).t() - Sigma_mu_inv_mu;
+    }
+    if (p_eta > 0) {
+      arma::mat grad_eta = Zt_G * R_tau_h.t();
+      if (whiten_eta_star) {
+        arma::mat w = reshape(theta.subvec(p_mu, p_mu+p_eta-1), N_knots,
+                              eta_star.n_cols);
+        log_post -= 0.5 * accu(square(w));
+        grad_eta = C_chol * grad_eta - w;
+      } else {
+        arma::mat C_inv_eta = C_inv * eta_h;
+        log_post -= 0.5 * accu(eta_h % C_inv_eta);
+        grad_eta -= C_inv_eta;
+      }
+      grad.subvec(p_mu, p_mu+p_eta-1) = vectorise(grad_eta);
+    }
+    if (p_tau2 > 0) {
+      // gamma(0.5, lambda_tau2) prior on tau2 with the log scale Jacobian
+      arma::mat Zeta_G = eta_h.t() * Zt_G;
+      for (int j=0; j<p_tau2; j++) {
+        double tau2_j = exp(log_tau2_h(j));
+        log_post += 0.5 * log_tau2_h(j) - lambda_tau2(j) * tau2_j;
+        grad(p_mu + p_eta + j) = 0.5 * dot(Zeta_G.col(j), R_tau_h.col(j)) +
+          0.5 - lambda_tau2(j) * tau2_j;
+      }
+    }
+    return(log_post);
+  };
   
+  arma::vec Gamma_accept(d, arma::fill::zeros);
+  std::vector<adaptive_metropolis> Gamma_tune;
+  for (int j=0; j<d && n_factors>0; j++) {
+    Gamma_tune.push_back(adaptive_metropolis(n_factors, lambda_Gamma_tune));
+  }
+  arma::vec eta_star_accept(eta_star.n_cols, arma::fill::zeros);
+  std::vector<adaptive_metropolis> eta_star_tune;
+  for(arma::uword j=0; j<eta_star.n_cols; j++) {
+    eta_star_tune.push_back(adaptive_metropolis(N_knots, lambda_eta_star_tune_tmp));
+  }
   
-  Rprintf("Starting MCMC adaptation for chain %d, running for %d iterations \n", 
-          n_chain, n_adapt);
-  // set up output messages
-  std::ofstream file_out;
-  file_out.open(file_name, std::ios_base::app);
-  file_out << "Starting MCMC adaptation for chain " << n_chain <<
-    ", running for " << n_adapt << " iterations \n";
-  // close output file
-  file_out.close(); 
   
-  // Start MCMC chain
-  for (int k=0; k<n_adapt; k++) {
-    if ((k+1) % message == 0) {
-      Rprintf("MCMC Adaptive Iteration %d for chain %d\n", k+1, n_chain); 
-      // set up output messages
-      std::ofstream file_out;
-      file_out.open(file_name, std::ios_base::app);
-      file_out << "MCMC Adaptive Iteration " << k+1 << " for chain " <<
-        n_chain << "\n";
-      // close output file
-      file_out.close(); 
-    }
+  //
+  // One iteration of the sampler
+  //
+  
+  // The phase is passed as a compile-time constant so the adaptation and
+  // fitting loops each get their own instantiation, with the tuning
+  // bookkeeping compiled out of the fitting phase and the saves compiled out
+  // of the adaptation phase.
+  
+  auto step = [&] (const int& k, auto phase) {
+    const bool adapt = decltype(phase)::value == phase_adapt;
     
-    Rcpp::checkUserInterrupt();
+    // batch acceptance rates while tuning, overall rates while fitting
+    auto record_accept = [&] (double& accept_batch, double& accept) {
+      if (adapt) {
+        accept_batch += 1.0 / 50.0;
+      } else {
+        accept += 1.0 / n_mcmc;
+      }
+    };
+    
+    //
+    // sample mu, eta_star and tau2 jointly - HMC
+    //
+    
+    if (sample_hmc) {
+      arma::vec theta(p_mu + p_eta + p_tau2);
+      if (p_mu > 0) {
+        theta.subvec(0, p_mu-1) = mu;
+      }
+      if (p_eta > 0) {
+        if (whiten_eta_star) {
+          arma::mat C_chol_lower = C_chol.t();
+          theta.subvec(p_mu, p_mu+p_eta-1) =
+            vectorise(solve(trimatl(C_chol_lower), eta_star));
+        } else {
+          theta.subvec(p_mu, p_mu+p_eta-1) = vectorise(eta_star);
+        }
+      }
+      if (p_tau2 > 0) {
+        theta.tail(p_tau2) = log(tau2.head(p_tau2));
+      }
+      arma::vec grad;
+      double log_post = hmc_log_post(theta, grad);
+      bool accepted = false;
+      double accept_prob = hmc.step(theta, log_post, grad, hmc_log_post,
+                                    accepted);
+      if (accepted) {
+        arma::vec log_tau2_h;
+        hmc_unpack(theta, mu, eta_star, log_tau2_h);
+        tau2 = exp(log_tau2_h);
+        tau = sqrt(tau2);
+        R_tau = R * diagmat(tau);
+        zeta = make_zeta(Z, eta_star, R_tau);
+        log_like = LL_DM_fused(mu, zeta, Y_counts, &alpha);
+        // the step size is tuned from the acceptance probability, so there
+        // is no batch rate
+        if (!adapt) {
+          hmc_accept += 1.0 / n_mcmc;
+        }
+      }
+      // update tuning
+      if (adapt) {
+        hmc.adapt(k, accept_prob, theta);
+      }
+      if (adapt && k == n_adapt - 1) {
+        hmc.end_adaptation();
+      }
+      zeta_pred = make_zeta(Z_pred, eta_star, R_tau);
+    }
     
     //
     // sample mu 
     //
     
-    if (sample_mu) {
+    if (sample_mu && !sample_hmc) {
       // sample using MH
-      arma::vec mu_star = mvrnormArmaVecChol(mu, lambda_mu_tune * Sigma_mu_tune_chol);
-      arma::mat mu_mat_star(N, d);
-      for (int i=0; i<N; i++) {
-        mu_mat_star.row(i) = mu_star.t();
-      }
-      arma::mat alpha_star = exp(mu_mat_star + zeta);
-      double mh1 = LL_DM(alpha_star, Y, N, d, count) + 
-        dMVNChol(mu_star, mu_mu, Sigma_mu_chol);
-      double mh2 = LL_DM(alpha, Y, N, d, count) + 
-        dMVNChol(mu, mu_mu, Sigma_mu_chol);
+      arma::vec mu_star = mu_tune.propose(mu);
+      double log_like_star = LL_DM_fused(mu_star, zeta, Y_counts, &alpha_star);
+      double mh1 = log_like_star + dMVNChol(mu_star, mu_mu, Sigma_mu_chol);
+      double mh2 = log_like + dMVNChol(mu, mu_mu, Sigma_mu_chol);
       double mh = exp(mh1-mh2);
       if (mh > R::runif(0.0, 1.0)) {
         mu = mu_star;
-        mu_mat = mu_mat_star;
-        alpha = alpha_star;
-        mu_accept_batch += 1.0 / 50;
+        alpha.swap(alpha_star);
+        log_like = log_like_star;
+        record_accept(mu_tune.accept_batch, mu_accept);
       }
       // update tuning
-      mu_batch.row(k % 50) = mu.t();
-      if ((k+1) % 50 == 0){
-        updateTuningMV(k, mu_accept_batch, lambda_mu_tune, mu_batch,
-                       Sigma_mu_tune, Sigma_mu_tune_chol);    
+      if (adapt) {
+        mu_tune.push(mu);
+      }
+      if (adapt && (k+1) % 50 == 0) {
+        mu_tune.update_scale(k);
       }
     }
     // update predictive random effects
@@ -716,116 +963,145 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
     if (sample_phi) {
       double phi_star = phi + R::rnorm(0.0, phi_tune);
       if (phi_star > phi_L && phi_star < phi_U) {
-        arma::mat C_star = exp(- D_knots / phi_star) + I_prevent_singular;
+        arma::mat C_star = corr_matrix<corr>(D_knots, phi_star) + I_prevent_singular;
         arma::mat C_chol_star = chol(C_star);
         arma::mat C_inv_star = inv_sympd(C_star);
-        arma::mat c_star = exp(- D / phi_star);
+        arma::mat c_star = corr_matrix<corr>(D, phi_star);
         arma::mat Z_star = c_star * C_inv_star;
-        arma::mat zeta_star = Z_star * eta_star * R_tau;
-        arma::mat alpha_star = exp(mu_mat + zeta_star);
+        arma::mat eta_star_star = eta_star;
+        if (whiten_eta_star) {
+          // hold w fixed, eta_star = t(chol(C)) w follows phi
+          arma::mat C_chol_lower = C_chol.t();
+          arma::mat w = solve(trimatl(C_chol_lower), eta_star);
+          eta_star_star = C_chol_star.t() * w;
+        }
+        arma::mat zeta_star = make_zeta(Z_star, eta_star_star, R_tau);
+        double log_like_star = LL_DM_fused(mu, zeta_star, Y_counts, &alpha_star);
         double mh1 = 0.0 + // uniform prior
-          LL_DM(alpha_star, Y, N, d, count);
+          log_like_star;
         double mh2 = 0.0 + // uniform prior
-          LL_DM(alpha, Y, N, d, count);
-        for (int j=0; j<d; j++) {
-          mh1 += dMVN(eta_star.col(j), zero_knots, C_chol_star, true);
-          mh2 += dMVN(eta_star.col(j), zero_knots, C_chol, true);
+          log_like;
+        if (!whiten_eta_star) {
+          for (arma::uword j=0; j<eta_star.n_cols; j++) {
+            mh1 += dMVN(eta_star.col(j), zero_knots, C_chol_star, true);
+            mh2 += dMVN(eta_star.col(j), zero_knots, C_chol, true);
+          }
         }
         double mh = exp(mh1-mh2);
         if (mh > R::runif(0.0, 1.0)) {
           phi = phi_star;
+          eta_star = eta_star_star;
           C = C_star;
           C_chol = C_chol_star;
           C_inv = C_inv_star;
           c = c_star;
           Z = Z_star;
           zeta = zeta_star;
-          alpha = alpha_star;
-          phi_accept_batch += 1.0 / 50.0;
+          alpha.swap(alpha_star);
+          log_like = log_like_star;
+          record_accept(phi_accept_batch, phi_accept);
         }
       }
       // update tuning
-      if ((k+1) % 50 == 0){
+      if (adapt && (k+1) % 50 == 0) {
         updateTuning(k, phi_accept_batch, phi_tune);
       }
     }
     // update predictive random effects
-    c_pred = exp(- D_pred / phi);
+    c_pred = corr_matrix<corr>(D_pred, phi);
     Z_pred = c_pred * C_inv; 
-    zeta_pred = Z_pred * eta_star * R_tau;
+    zeta_pred = make_zeta(Z_pred, eta_star, R_tau);
     alpha_pred = exp(mu_mat_pred + zeta_pred);
     
     //
     // sample eta_star 
     //
     
-    if (sample_eta_star) {
+    if (sample_eta_star && !sample_hmc) {
       if (sample_eta_star_mh) {
-        // Metroplois-Hastings
-        for (int j=0; j<d; j++) {
+        // Metroplois-Hastings, on w when whitened
+        arma::mat C_chol_lower = C_chol.t();
+        for (arma::uword j=0; j<eta_star.n_cols; j++) {
           arma::mat eta_star_star = eta_star;
-          eta_star_star.col(j) += mvrnormArmaVecChol(zero_knots,
-                            lambda_eta_star_tune(j) * Sigma_eta_star_tune_chol.slice(j));
-          arma::mat zeta_star = Z * eta_star_star * R_tau;
-          arma::mat alpha_star = exp(mu_mat + zeta_star);
-          double mh1 = dMVNChol(eta_star_star.col(j), zero_knots, C_chol, true) -
-            LL_DM(alpha_star, Y, N, d, count);
-          double mh2 = dMVNChol(eta_star.col(j), zero_knots, C_chol, true) -
-            LL_DM(alpha, Y, N, d, count);
+          double prior_star, prior_current;
+          if (whiten_eta_star) {
+            arma::vec w_j = solve(trimatl(C_chol_lower), eta_star.col(j));
+            arma::vec w_j_star = eta_star_tune[j].propose(w_j);
+            eta_star_star.col(j) = C_chol_lower * w_j_star;
+            prior_star = - 0.5 * dot(w_j_star, w_j_star);
+            prior_current = - 0.5 * dot(w_j, w_j);
+          } else {
+            eta_star_star.col(j) = eta_star_tune[j].propose(eta_star.col(j));
+            prior_star = dMVNChol(eta_star_star.col(j), zero_knots, C_chol, true);
+            prior_current = dMVNChol(eta_star.col(j), zero_knots, C_chol, true);
+          }
+          // only column j moves, a rank one change in zeta
+          arma::mat zeta_star = zeta +
+            (Z * (eta_star_star.col(j) - eta_star.col(j))) * R_tau.row(j);
+          double log_like_star = LL_DM_fused(mu, zeta_star, Y_counts,
+                                             &alpha_star);
+          double mh1 = prior_star + log_like_star;
+          double mh2 = prior_current + log_like;
           double mh = exp(mh1-mh2);
           if (mh > R::runif(0.0, 1.0)) {
             eta_star = eta_star_star;
             zeta = zeta_star;
-            alpha = alpha_star;
-            eta_star_accept_batch(j) += 1.0 / 50.0;
+            alpha.swap(alpha_star);
+            log_like = log_like_star;
+            record_accept(eta_star_tune[j].accept_batch, eta_star_accept(j));
           }
         }
         // update tuning
-        eta_star_batch.subcube(k % 50, 0, 0, k % 50, N_knots-1, d-1) = eta_star;
-        if ((k+1) % 50 == 0){
-          updateTuningMVMat(k, eta_star_accept_batch, lambda_eta_star_tune,
-                            eta_star_batch, Sigma_eta_star_tune,
-                            Sigma_eta_star_tune_chol);
+        for (arma::uword j=0; j<eta_star.n_cols; j++) {
+          if (adapt && whiten_eta_star) {
+            eta_star_tune[j].push(solve(trimatl(C_chol_lower), eta_star.col(j)));
+          } else if (adapt) {
+            eta_star_tune[j].push(eta_star.col(j));
+          }
+          if (adapt && (k+1) % 50 == 0) {
+            eta_star_tune[j].update_scale(k);
+          }
         }
       } else {
-        // elliptical slice sampler
-        for (int j=0; j<d; j++) {
+        // elliptical slice sampler, the ellipse through eta_star and a draw
+        // from N(0, C) is the image of the ellipse through w and a standard
+        // normal draw, so the same update serves the whitened chain
+        for (arma::uword j=0; j<eta_star.n_cols; j++) {
           arma::vec eta_star_prior = mvrnormArmaVecChol(zero_knots, C_chol);
           Rcpp::List ess_eta_star_out = ess(eta_star, eta_star_prior, alpha, 
-                                            mu_mat, zeta, R_tau, Z, Y, N, d, 
-                                            j, count, file_name, n_chain);
+                                            mu, zeta, R_tau, Z, Y_counts,
+                                            log_like, j, file_name, n_chain);
           eta_star = as<mat>(ess_eta_star_out["eta_star"]);
           zeta = as<mat>(ess_eta_star_out["zeta"]);
           alpha = as<mat>(ess_eta_star_out["alpha"]);
+          log_like = as<double>(ess_eta_star_out["log_like"]);
         }
       } 
     }
     // update predictive random effects
-    zeta_pred = Z_pred * eta_star * R_tau;
+    zeta_pred = make_zeta(Z_pred, eta_star, R_tau);
     alpha_pred = exp(mu_mat_pred + zeta_pred);
     
     //
     // sample tau2
     //
     
-    if (sample_tau2) {
+    if (sample_tau2 && !sample_hmc) {
       arma::vec log_tau2_star = log(tau2);
       if (Sigma_reference_category) {
         // last element is fixed at one
-        log_tau2_star.subvec(0, d-2) = mvrnormArmaVecChol(log(tau2.subvec(0, d-2)),
-                             lambda_tau2_tune * Sigma_tau2_tune_chol);
+        log_tau2_star.subvec(0, d-2) = tau2_tune.propose(log(tau2.subvec(0, d-2)));
       } else {
-        log_tau2_star = mvrnormArmaVecChol(log(tau2),
-                                           lambda_tau2_tune * Sigma_tau2_tune_chol);
+        log_tau2_star = tau2_tune.propose(log(tau2));
       }
       arma::vec tau2_star = exp(log_tau2_star);
       if (all(tau2_star > 0.0)) {
         arma::vec tau_star = sqrt(tau2_star);
         arma::mat R_tau_star = R * diagmat(tau_star);
-        arma::mat zeta_star = Z * eta_star * R_tau_star;
-        arma::mat alpha_star = exp(mu_mat + zeta_star);
-        double mh1 = LL_DM(alpha_star, Y, N, d, count) + sum(log_tau2_star);  // jacobian of log-scale proposal
-        double mh2 = LL_DM(alpha, Y, N, d, count) + sum(log(tau2));      // jacobian of log-scale proposal
+        arma::mat zeta_star = make_zeta(Z, eta_star, R_tau_star);
+        double log_like_star = LL_DM_fused(mu, zeta_star, Y_counts, &alpha_star);
+        double mh1 = log_like_star + sum(log_tau2_star);  // jacobian of log-scale proposal
+        double mh2 = log_like + sum(log(tau2));           // jacobian of log-scale proposal
         for (int j=0; j<d; j++) {
           mh1 += R::dgamma(tau2_star(j), 0.5, 1.0 / lambda_tau2(j), true);
           mh2 += R::dgamma(tau2(j), 0.5, 1.0 / lambda_tau2(j), true);
@@ -836,24 +1112,25 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
           tau = tau_star;
           R_tau = R_tau_star;
           zeta = zeta_star;
-          alpha = alpha_star;
-          tau2_accept_batch += 1.0 / 50.0;
+          alpha.swap(alpha_star);
+          log_like = log_like_star;
+          record_accept(tau2_tune.accept_batch, tau2_accept);
         }
       }
       // update tuning
-      if (Sigma_reference_category) {  
-        tau2_batch.row(k % 50) = log(tau2.subvec(0, d-2)).t();   
-      } else {
-        tau2_batch.row(k % 50) = log(tau2).t();
+      if (adapt) {
+        if (Sigma_reference_category) {
+          tau2_tune.push(log(tau2.subvec(0, d-2)));
+        } else {
+          tau2_tune.push(log(tau2));
+        }
+      }
+      if (adapt && (k+1) % 50 == 0) {
+        tau2_tune.update_scale(k);
       }
-      // update tuning
-      if ((k+1) % 50 == 0){
-        updateTuningMV(k, tau2_accept_batch, lambda_tau2_tune, tau2_batch,
-                       Sigma_tau2_tune, Sigma_tau2_tune_chol);
-      }    
     }
     // update predictive random effects
-    zeta_pred = Z_pred * eta_star * R_tau;
+    zeta_pred = make_zeta(Z_pred, eta_star, R_tau);
     alpha_pred = exp(mu_mat_pred + zeta_pred);
     
     //
@@ -880,11 +1157,11 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
         double mh = exp(mh1-mh2);
         if (mh > R::runif(0.0, 1.0)) {
           s2_tau2 = s2_tau2_star;
-          s2_tau2_accept_batch += 1.0 / 50.0;
+          record_accept(s2_tau2_accept_batch, s2_tau2_accept);
         }
       }
       // update tuning
-      if ((k+1) % 50 == 0){
+      if (adapt && (k+1) % 50 == 0) {
         updateTuning(k, s2_tau2_accept_batch, s2_tau2_tune);
       }
     }
@@ -893,9 +1170,62 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
     // sample xi - MH
     //
     
-    if (sample_xi) {
-      arma::vec logit_xi_tilde_star = mvrnormArmaVecChol(logit(xi_tilde),
-                                                         lambda_xi_tune * Sigma_xi_tune_chol);
+    if (sample_xi && sample_xi_block) {
+      // the random effects before R, and the current log(alpha) and row
+      // sums, kept up to date as each column is accepted
+      arma::mat Z_eta_star = Z * eta_star;
+      arma::mat log_alpha = zeta;
+      log_alpha.each_row() += mu.t();
+      arma::vec alpha_rowsums = sum(alpha, 1);
+      arma::vec alpha_col_star;
+      arma::vec alpha_rowsums_star;
+      for (int j=1; j<d; j++) {
+        adaptive_metropolis& tune_j = xi_block_tune[j-1];
+        arma::uvec idx = lkj_column_index(j, d);
+        arma::vec xi_tilde_j = xi_tilde.elem(idx);
+        arma::vec xi_tilde_j_star = expit(tune_j.propose(logit(xi_tilde_j)));
+        arma::vec xi_j_star = 2.0 * xi_tilde_j_star - 1.0;
+        if (all(xi_j_star > -1.0) && all(xi_j_star < 1.0)) {
+          arma::vec R_col_star = lkj_cholesky_column(xi_j_star, j, d);
+          arma::vec zeta_col_star = tau(j) * (Z_eta_star * R_col_star);
+          arma::vec log_alpha_col_star = mu(j) + zeta_col_star;
+          double log_like_delta =
+            LL_DM_col_delta(log_alpha, alpha, alpha_rowsums,
+                            log_alpha_col_star, Y_counts, j,
+                            alpha_col_star, alpha_rowsums_star);
+          double mh1 = log_like_delta +
+            // Jacobian adjustment
+            sum(log(xi_tilde_j_star) + log(1.0 - xi_tilde_j_star));
+          double mh2 = sum(log(xi_tilde_j) + log(1.0 - xi_tilde_j));
+          for (int i=0; i<j; i++) {
+            double eta_i = eta_vec(idx(i));
+            mh1 += R::dbeta(xi_tilde_j_star(i), eta_i, eta_i, true);
+            mh2 += R::dbeta(xi_tilde_j(i), eta_i, eta_i, true);
+          }
+          double mh = exp(mh1-mh2);
+          if (mh > R::runif(0.0, 1.0)) {
+            xi_tilde.elem(idx) = xi_tilde_j_star;
+            xi.elem(idx) = xi_j_star;
+            R.col(j) = R_col_star;
+            R_tau.col(j) = tau(j) * R_col_star;
+            zeta.col(j) = zeta_col_star;
+            log_alpha.col(j) = log_alpha_col_star;
+            alpha.col(j) = alpha_col_star;
+            alpha_rowsums = alpha_rowsums_star;
+            log_like += log_like_delta;
+            record_accept(tune_j.accept_batch, xi_accept(j-1));
+          }
+        }
+        // update tuning
+        if (adapt) {
+          tune_j.push(logit(xi_tilde.elem(idx)));
+        }
+        if (adapt && (k+1) % 50 == 0) {
+          tune_j.update_scale(k);
+        }
+      }
+    } else if (sample_xi) {
+      arma::vec logit_xi_tilde_star = xi_tune.propose(logit(xi_tilde));
       arma::vec xi_tilde_star = expit(logit_xi_tilde_star);
       arma::vec xi_star = 2.0 * xi_tilde_star - 1.0;
       // arma::vec xi_star =  mvrnormArmaVecChol(xi, lambda_xi_tune * Sigma_xi_tune_chol);
@@ -904,12 +1234,11 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
         arma::mat R_star = as<mat>(R_out["R"]);
         arma::mat R_tau_star = R_star * diagmat(tau);
         arma::mat zeta_star = Z * eta_star * R_tau_star;
-        arma::mat alpha_star = exp(mu_mat + zeta_star);
-        double log_jacobian_star = as<double>(R_out["log_jacobian"]);
-        double mh1 = LL_DM(alpha_star, Y, N, d, count) + 
+        double log_like_star = LL_DM_fused(mu, zeta_star, Y_counts, &alpha_star);
+        double mh1 = log_like_star + 
           // Jacobian adjustment
           sum(log(xi_tilde_star) + log(ones_B - xi_tilde_star));
-        double mh2 = LL_DM(alpha, Y, N, d, count) + 
+        double mh2 = log_like + 
           // Jacobian adjustment
           sum(log(xi_tilde) + log(ones_B - xi_tilde));
         for (int b=0; b<B; b++) {
@@ -922,23 +1251,74 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
           xi = xi_star;
           R = R_star;
           R_tau = R_tau_star;
-          log_jacobian = log_jacobian_star;
           zeta = zeta_star;
-          alpha = alpha_star;
-          xi_accept_batch += 1.0 / 50.0;
+          alpha.swap(alpha_star);
+          log_like = log_like_star;
+          record_accept(xi_tune.accept_batch, xi_accept(0));
         }
       }
       // update tuning
-      xi_batch.row(k % 50) = logit(xi_tilde).t();
-      if ((k+1) % 50 == 0){
-        updateTuningMV(k, xi_accept_batch, lambda_xi_tune, xi_batch,
-                       Sigma_xi_tune, Sigma_xi_tune_chol);
+      if (adapt) {
+        xi_tune.push(logit(xi_tilde));
+      }
+      if (adapt && (k+1) % 50 == 0) {
+        xi_tune.update_scale(k);
       }
     }
     // update predictive random effects
-    zeta_pred = Z_pred * eta_star * R_tau;
+    zeta_pred = make_zeta(Z_pred, eta_star, R_tau);
     alpha_pred = exp(mu_mat_pred + zeta_pred);
     
+    //
+    // sample Gamma - MH
+    //
+    
+    if (sample_Gamma) {
+      // column j of Gamma only moves column j of zeta, so each species is
+      // scored with the O(N) column update of the likelihood
+      arma::mat Z_eta_factor = Z * eta_star.head_cols(n_factors);
+      arma::mat log_alpha = zeta;
+      log_alpha.each_row() += mu.t();
+      arma::vec alpha_rowsums = sum(alpha, 1);
+      arma::vec alpha_col_star;
+      arma::vec alpha_rowsums_star;
+      for (int j=0; j<d; j++) {
+        arma::vec Gamma_j = R(span(0, n_factors-1), j);
+        arma::vec Gamma_j_star = Gamma_tune[j].propose(Gamma_j);
+        arma::vec zeta_col_star = tau(j) * (Z_eta_factor * Gamma_j_star +
+          Z * eta_star.col(n_factors + j));
+        arma::vec log_alpha_col_star = mu(j) + zeta_col_star;
+        double log_like_delta =
+          LL_DM_col_delta(log_alpha, alpha, alpha_rowsums,
+                          log_alpha_col_star, Y_counts, j,
+                          alpha_col_star, alpha_rowsums_star);
+        double mh1 = log_like_delta -
+          0.5 * dot(Gamma_j_star, Gamma_j_star) / s2_Gamma;
+        double mh2 = - 0.5 * dot(Gamma_j, Gamma_j) / s2_Gamma;
+        double mh = exp(mh1-mh2);
+        if (mh > R::runif(0.0, 1.0)) {
+          R(span(0, n_factors-1), j) = Gamma_j_star;
+          R_tau.col(j) = tau(j) * R.col(j);
+          zeta.col(j) = zeta_col_star;
+          log_alpha.col(j) = log_alpha_col_star;
+          alpha.col(j) = alpha_col_star;
+          alpha_rowsums = alpha_rowsums_star;
+          log_like += log_like_delta;
+          record_accept(Gamma_tune[j].accept_batch, Gamma_accept(j));
+        }
+        // update tuning
+        if (adapt) {
+          Gamma_tune[j].push(R(span(0, n_factors-1), j));
+        }
+        if (adapt && (k+1) % 50 == 0) {
+          Gamma_tune[j].update_scale(k);
+        }
+      }
+      // update predictive random effects
+      zeta_pred = make_zeta(Z_pred, eta_star, R_tau);
+      alpha_pred = exp(mu_mat_pred + zeta_pred);
+    }
+    
     //
     // sample X - ESS
     //
@@ -947,12 +1327,12 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
       for (int i=0; i<N_pred; i++) {
         double X_prior = R::rnorm(0.0, s_X);
         // double X_prior = R::rnorm(mu_X, s_X);
-        Rcpp::List ess_out = ess_X(X_pred(i), X_prior, mu_X, X_knots, 
-                                   Y_pred.row(i), mu.t(), eta_star, 
-                                   alpha_pred.row(i), D_pred.row(i),
+        Rcpp::List ess_out = ess_X<corr>(X_pred(i), X_prior, mu_X, X_knots, 
+                                   Y_pred_counts, i, mu.t(), eta_star, 
+                                   zeta_pred.row(i), alpha_pred.row(i),
+                                   D_pred.row(i),
                                    c_pred.row(i), R_tau, Z_pred.row(i), phi,
-                                   C_inv, d, count_pred(i),
-                                   file_name, n_chain, corr_function);
+                                   C_inv, file_name, n_chain);
         X_pred(i) = as<double>(ess_out["X"]);
         D_pred.row(i) = as<rowvec>(ess_out["D"]);
         c_pred.row(i) = as<rowvec>(ess_out["c"]);
@@ -962,6 +1342,86 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
       }
     }
     
+    //
+    // save variables
+    //
+
+    if (!adapt && save_summary && (k + 1) % n_thin == 0) {
+      arma::vec X_tmp = X_pred + mu_X;
+      X_summary.push(X_tmp);
+      X_covariance.push(X_tmp);
+      alpha_pred_summary.push(alpha_pred);
+      zeta_pred_summary.push(zeta_pred);
+    }
+    if (!adapt && use_draws_matrix && (k + 1) % n_thin == 0) {
+      int save_idx = (k+1)/n_thin-1;
+      draws.save(mu_block, save_idx, mu);
+      draws.save(eta_star_block, save_idx, eta_star);
+      if (save_derived) {
+        draws.save(zeta_block, save_idx, zeta);
+        draws.save(zeta_pred_block, save_idx, zeta_pred);
+        draws.save(alpha_block, save_idx, alpha);
+        draws.save(alpha_pred_block, save_idx, alpha_pred);
+      }
+      draws.save(phi_block, save_idx, phi);
+      draws.save(tau2_block, save_idx, tau2);
+      draws.save(X_block, save_idx, arma::vec(X_pred + mu_X));
+      if (n_factors > 0) {
+        draws.save(R_block, save_idx, arma::mat(R.head_rows(n_factors)));
+      } else {
+        draws.save(R_block, save_idx, R);
+        draws.save(xi_block, save_idx, xi);
+      }
+    } else if (!adapt && (k + 1) % n_thin == 0) {
+      int save_idx = (k+1)/n_thin-1;
+      if (save_draws) {
+        eta_star_save.save(save_idx, eta_star);
+      }
+      if (save_draws && save_derived) {
+        alpha_save.save(save_idx, alpha);
+        alpha_pred_save.save(save_idx, alpha_pred);
+        zeta_save.save(save_idx, zeta);
+        zeta_pred_save.save(save_idx, zeta_pred);
+      }
+      X_save.row(save_idx) = X_pred.t() + mu_X;
+      phi_save(save_idx) = phi;
+      mu_save.row(save_idx) = mu.t();
+      tau2_save.row(save_idx) = tau2.t();
+      if (n_factors > 0) {
+        R_save.save(save_idx, R.head_rows(n_factors));
+      } else {
+        R_save.save(save_idx, R);
+        xi_save.row(save_idx) = xi.t();
+      }
+    }
+  };
+  
+  Rprintf("Starting MCMC adaptation for chain %d, running for %d iterations \n", 
+          n_chain, n_adapt);
+  // set up output messages
+  std::ofstream file_out;
+  file_out.open(file_name, std::ios_base::app);
+  file_out << "Starting MCMC adaptation for chain " << n_chain <<
+    ", running for " << n_adapt << " iterations \n";
+  // close output file
+  file_out.close(); 
+  
+  // Start MCMC chain
+  for (int k=0; k<n_adapt; k++) {
+    if ((k+1) % message == 0) {
+      Rprintf("MCMC Adaptive Iteration %d for chain %d\n", k+1, n_chain); 
+      // set up output messages
+      std::ofstream file_out;
+      file_out.open(file_name, std::ios_base::app);
+      file_out << "MCMC Adaptive Iteration " << k+1 << " for chain " <<
+        n_chain << "\n";
+      // close output file
+      file_out.close(); 
+    }
+    
+    Rcpp::checkUserInterrupt();
+    
+    step(k, std::integral_constant<int, phase_adapt>());
   }
   
   Rprintf("Starting MCMC fit for chain %d, running for %d iterations \n", 
@@ -988,286 +1448,17 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
     
     Rcpp::checkUserInterrupt();
     
-    //
-    // sample mu 
-    //
-    
-    if (sample_mu) {
-      // sample using MH
-      arma::vec mu_star = mvrnormArmaVecChol(mu, lambda_mu_tune * Sigma_mu_tune_chol);
-      arma::mat mu_mat_star(N, d);
-      for (int i=0; i<N; i++) {
-        mu_mat_star.row(i) = mu_star.t();
-      }
-      arma::mat alpha_star = exp(mu_mat_star + zeta);
-      double mh1 = LL_DM(alpha_star, Y, N, d, count) + 
-        dMVNChol(mu_star, mu_mu, Sigma_mu_chol);
-      double mh2 = LL_DM(alpha, Y, N, d, count) + 
-        dMVNChol(mu, mu_mu, Sigma_mu_chol);
-      double mh = exp(mh1-mh2);
-      if (mh > R::runif(0.0, 1.0)) {
-        mu = mu_star;
-        mu_mat = mu_mat_star;
-        alpha = alpha_star;
-        mu_accept += 1.0 / n_mcmc;
-      }
-    }
-    // update predictive random effects
-    arma::mat mu_mat_pred(N_pred, d);
-    for (int i=0; i<N_pred; i++) {
-      mu_mat_pred.row(i) = mu.t();
-    }
-    alpha_pred = exp(mu_mat_pred + zeta_pred);
-    
-    //
-    // sample phi
-    //
-    
-    if (sample_phi) {
-      double phi_star = phi + R::rnorm(0.0, phi_tune);
-      if (phi_star > phi_L && phi_star < phi_U) {
-        arma::mat C_star = exp(- D_knots / phi_star) + I_prevent_singular;
-        arma::mat C_chol_star = chol(C_star);
-        arma::mat C_inv_star = inv_sympd(C_star);
-        arma::mat c_star = exp(- D / phi_star);
-        arma::mat Z_star = c_star * C_inv_star; 
-        arma::mat zeta_star = Z_star * eta_star * R_tau;
-        arma::mat alpha_star = exp(mu_mat + zeta_star);
-        double mh1 = 0.0 + // uniform prior
-          LL_DM(alpha_star, Y, N, d, count);
-        double mh2 = 0.0 + // uniform prior
-          LL_DM(alpha, Y, N, d, count);
-        for (int j=0; j<d; j++) {
-          mh1 += dMVN(eta_star.col(j), zero_knots, C_chol_star, true);
-          mh2 += dMVN(eta_star.col(j), zero_knots, C_chol, true);
-        }
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          phi = phi_star;
-          C = C_star;
-          C_chol = C_chol_star;
-          C_inv = C_inv_star;
-          c = c_star;
-          Z = Z_star;
-          zeta = zeta_star;
-          alpha = alpha_star;
-          phi_accept += 1.0 / n_mcmc;
-        }
-      }
-    }
-    // update predictive random effects
-    c_pred = exp(- D_pred / phi);
-    Z_pred = c_pred * C_inv; 
-    zeta_pred = Z_pred * eta_star * R_tau;
-    alpha_pred = exp(mu_mat_pred + zeta_pred);
-    
-    //
-    // sample eta_star 
-    //
-    
-    if (sample_eta_star) {
-      if (sample_eta_star_mh) {
-        // Metroplois-Hastings
-        for (int j=0; j<d; j++) {
-          arma::mat eta_star_star = eta_star;
-          eta_star_star.col(j) += mvrnormArmaVecChol(zero_knots,
-                            lambda_eta_star_tune(j) * Sigma_eta_star_tune_chol.slice(j));
-          arma::mat zeta_star = Z * eta_star_star * R_tau;
-          arma::mat alpha_star = exp(mu_mat + zeta_star);
-          double mh1 = dMVNChol(eta_star_star.col(j), zero_knots, C_chol, true) -
-            LL_DM(alpha_star, Y, N, d, count);
-          double mh2 = dMVNChol(eta_star.col(j), zero_knots, C_chol, true) -
-            LL_DM(alpha, Y, N, d, count);
-          double mh = exp(mh1-mh2);
-          if (mh > R::runif(0.0, 1.0)) {
-            eta_star = eta_star_star;
-            zeta = zeta_star;
-            alpha = alpha_star;
-            eta_star_accept(j) += 1.0 / n_mcmc;
-          }
-        }
-      } else {
-        // elliptical slice sampler
-        for (int j=0; j<d; j++) {
-          arma::vec eta_star_prior = mvrnormArmaVecChol(zero_knots, C_chol);
-          Rcpp::List ess_eta_star_out = ess(eta_star, eta_star_prior, alpha, 
-                                            mu_mat, zeta, R_tau, Z, Y, N, d, 
-                                            j, count, file_name, n_chain);
-          eta_star = as<mat>(ess_eta_star_out["eta_star"]);
-          zeta = as<mat>(ess_eta_star_out["zeta"]);
-          alpha = as<mat>(ess_eta_star_out["alpha"]);
-        }
-      } 
-    }
-    // update predictive random effects
-    zeta_pred = Z_pred * eta_star * R_tau;
-    alpha_pred = exp(mu_mat_pred + zeta_pred);
-    
-    //
-    // sample tau2
-    //
-    
-    if (sample_tau2) {
-      arma::vec log_tau2_star = log(tau2);
-      if (Sigma_reference_category) {
-        // last element is fixed at one
-        log_tau2_star.subvec(0, d-2) = mvrnormArmaVecChol(log(tau2.subvec(0, d-2)),
-                             lambda_tau2_tune * Sigma_tau2_tune_chol);
-      } else {
-        log_tau2_star = mvrnormArmaVecChol(log(tau2),
-                                           lambda_tau2_tune * Sigma_tau2_tune_chol);
-      }
-      arma::vec tau2_star = exp(log_tau2_star);
-      if (all(tau2_star > 0.0)) {
-        arma::vec tau_star = sqrt(tau2_star);
-        arma::mat R_tau_star = R * diagmat(tau_star);
-        arma::mat zeta_star = Z * eta_star * R_tau_star;
-        arma::mat alpha_star = exp(mu_mat + zeta_star);
-        double mh1 = LL_DM(alpha_star, Y, N, d, count) + sum(log_tau2_star);  // jacobian of log-scale proposal
-        double mh2 = LL_DM(alpha, Y, N, d, count) + sum(log(tau2));      // jacobian of log-scale proposal
-        for (int j=0; j<d; j++) {
-          mh1 += R::dgamma(tau2_star(j), 0.5, 1.0 / lambda_tau2(j), true);
-          mh2 += R::dgamma(tau2(j), 0.5, 1.0 / lambda_tau2(j), true);
-        }
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          tau2 = tau2_star;
-          tau = tau_star;
-          R_tau = R_tau_star;
-          zeta = zeta_star;
-          alpha = alpha_star;
-          tau2_accept += 1.0 / n_mcmc;
-        }
-      }
-    }
-    // update predictive random effects
-    zeta_pred = Z_pred * eta_star * R_tau;
-    alpha_pred = exp(mu_mat_pred + zeta_pred);
-    
-    //
-    // sample lambda_tau2
-    //
-    
-    for (int j=0; j<d; j++) {
-      lambda_tau2(j) = R::rgamma(1.0, 1.0 / (s2_tau2 + tau2(j)));
-    }
-    
-    //
-    // sample s2_tau2
-    //
-    
-    if (pool_s2_tau2) {
-      double s2_tau2_star = s2_tau2 + R::rnorm(0, s2_tau2_tune);
-      if (s2_tau2_star > 0 && s2_tau2_star < A_s2) {
-        double mh1 = 0.0;
-        double mh2 = 0.0;
-        for (int j=0; j<d; j++){
-          mh1 += R::dgamma(lambda_tau2(j), 0.5, 1.0 / s2_tau2_star, true);
-          mh2 += R::dgamma(lambda_tau2(j), 0.5, 1.0 / s2_tau2, true);
-        }
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          s2_tau2 = s2_tau2_star;
-          s2_tau2_accept += 1.0 / n_mcmc;
-        }
-      }
-    }
-    
-    //
-    // sample xi - MH
-    //
-    
-    if (sample_xi) {
-      arma::vec logit_xi_tilde_star = mvrnormArmaVecChol(logit(xi_tilde),
-                                                         lambda_xi_tune * Sigma_xi_tune_chol);
-      arma::vec xi_tilde_star = expit(logit_xi_tilde_star);
-      arma::vec xi_star = 2.0 * xi_tilde_star - 1.0;
-      // arma::vec xi_star =  mvrnormArmaVecChol(xi, lambda_xi_tune * Sigma_xi_tune_chol);
-      if (all(xi_star > -1.0) && all(xi_star < 1.0)) {
-        Rcpp::List R_out = makeRLKJ(xi_star, d, true, true);
-        arma::mat R_star = as<mat>(R_out["R"]);
-        arma::mat R_tau_star = R_star * diagmat(tau);
-        arma::mat zeta_star = Z * eta_star * R_tau_star;
-        arma::mat alpha_star = exp(mu_mat + zeta_star);
-        double log_jacobian_star = as<double>(R_out["log_jacobian"]);
-        double mh1 = LL_DM(alpha_star, Y, N, d, count) + 
-          // Jacobian adjustment
-          sum(log(xi_tilde_star) + log(ones_B - xi_tilde_star));
-        double mh2 = LL_DM(alpha, Y, N, d, count) + 
-          // Jacobian adjustment
-          sum(log(xi_tilde) + log(ones_B - xi_tilde));
-        for (int b=0; b<B; b++) {
-          mh1 += R::dbeta(0.5 * (xi_star(b) + 1.0), eta_vec(b), eta_vec(b), true);
-          mh2 += R::dbeta(0.5 * (xi(b) + 1.0), eta_vec(b), eta_vec(b), true);
-        }
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          xi_tilde = xi_tilde_star;
-          xi = xi_star;
-          R = R_star;
-          R_tau = R_tau_star;
-          log_jacobian = log_jacobian_star;
-          zeta = zeta_star;
-          alpha = alpha_star;
-          xi_accept += 1.0 / n_mcmc;
-        }
-      }
-    }
-    // update predictive random effects
-    zeta_pred = Z_pred * eta_star * R_tau;
-    alpha_pred = exp(mu_mat_pred + zeta_pred);
-    
-    //
-    // sample X - ESS
-    //
-
-    if (sample_X) {    
-      for (int i=0; i<N_pred; i++) {
-        double X_prior = R::rnorm(0.0, s_X);
-        // double X_prior = R::rnorm(mu_X, s_X);
-        Rcpp::List ess_out = ess_X(X_pred(i), X_prior, mu_X, X_knots, 
-                                   Y_pred.row(i), mu.t(), eta_star, 
-                                   alpha_pred.row(i), D_pred.row(i),
-                                   c_pred.row(i), R_tau, Z_pred.row(i), phi,
-                                   C_inv, d, count_pred(i),
-                                   file_name, n_chain, corr_function);
-        X_pred(i) = as<double>(ess_out["X"]);
-        D_pred.row(i) = as<rowvec>(ess_out["D"]);
-        c_pred.row(i) = as<rowvec>(ess_out["c"]);
-        Z_pred.row(i) = as<rowvec>(ess_out["Z"]);
-        zeta_pred.row(i) = as<rowvec>(ess_out["zeta"]);
-        alpha_pred.row(i) = as<rowvec>(ess_out["alpha"]);
-      }
-    }
-    
-    //
-    // save variables
-    //
-
-    if ((k + 1) % n_thin == 0) {
-      int save_idx = (k+1)/n_thin-1;
-      alpha_save.subcube(span(save_idx), span(), span()) = alpha;
-      alpha_pred_save.subcube(span(save_idx), span(), span()) = alpha_pred;
-      zeta_save.subcube(span(save_idx), span(), span()) = zeta;
-      zeta_pred_save.subcube(span(save_idx), span(), span()) = zeta_pred;
-      X_save.row(save_idx) = X_pred.t() + mu_X;
-      phi_save(save_idx) = phi;
-      mu_save.row(save_idx) = mu.t();
-      tau2_save.row(save_idx) = tau2.t();
-      eta_star_save.subcube(span(save_idx), span(), span()) = eta_star;
-      R_save.subcube(span(save_idx), span(), span()) = R;
-      xi_save.row(save_idx) = xi.t();
-    }
+    step(k, std::integral_constant<int, phase_fit>());
   }
   
   // print accpetance rates
   // set up output messages
   file_out.open(file_name, std::ios_base::app);
-  if (sample_mu) {
+  if (sample_mu && !sample_hmc) {
     file_out << "Average acceptance rate for mu  = " << mean(mu_accept) <<
       " for chain " << n_chain << "\n";
   }
-  if (sample_eta_star) {
+  if (sample_eta_star && !sample_hmc) {
     file_out << "Average acceptance rate for eta_star  = " << mean(eta_star_accept) <<
       " for chain " << n_chain << "\n";
   }
@@ -1281,25 +1472,414 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
     file_out << "Average acceptance rate for xi  = " << mean(xi_accept) << 
       " for chain " << n_chain << "\n";
   }
-  if (sample_tau2) {
+  if (sample_tau2 && !sample_hmc) {
     file_out << "Average acceptance rate for tau2  = " << mean(tau2_accept) <<
       " for chain " << n_chain << "\n";
   }
+  if (sample_Gamma) {
+    file_out << "Average acceptance rate for Gamma  = " << mean(Gamma_accept) <<
+      " for chain " << n_chain << "\n";
+  }
+  if (sample_hmc) {
+    file_out << "Average acceptance rate for HMC  = " << hmc_accept <<
+      " with step size " << hmc.epsilon << " for chain " << n_chain << "\n";
+  }
   // close output file
   file_out.close(); 
   
   // output results
   
-  return Rcpp::List::create(
-    _["mu"] = mu_save,
-    _["eta_star"] = eta_star_save,
-    _["zeta"] = zeta_save,
-    _["zeta_pred"] = zeta_pred_save,
-    _["alpha"] = alpha_save,
-    _["alpha_pred"] = alpha_pred_save,
-    _["phi"] = phi_save,
-    _["tau2"] = tau2_save,
-    _["X"] = X_save,
-    _["R"] = R_save,
-    _["xi"] = xi_save);
+  Rcpp::List out;
+  if (use_draws_matrix) {
+    out = Rcpp::List::create(_["draws"] = draws.draws);
+  } else if (!save_draws) {
+    out = Rcpp::List::create(
+      _["mu"] = mu_save,
+      _["phi"] = phi_save,
+      _["tau2"] = tau2_save,
+      _["X"] = X_save,
+      _[R_name] = R_save.output(),
+      _["xi"] = xi_save);
+  } else if (!save_derived) {
+    out = Rcpp::List::create(
+      _["mu"] = mu_save,
+      _["eta_star"] = eta_star_save.output(),
+      _["phi"] = phi_save,
+      _["tau2"] = tau2_save,
+      _["X"] = X_save,
+      _[R_name] = R_save.output(),
+      _["xi"] = xi_save);
+  } else {
+    out = Rcpp::List::create(
+      _["mu"] = mu_save,
+      _["eta_star"] = eta_star_save.output(),
+      _["zeta"] = zeta_save.output(),
+      _["zeta_pred"] = zeta_pred_save.output(),
+      _["alpha"] = alpha_save.output(),
+      _["alpha_pred"] = alpha_pred_save.output(),
+      _["phi"] = phi_save,
+      _["tau2"] = tau2_save,
+      _["X"] = X_save,
+      _[R_name] = R_save.output(),
+      _["xi"] = xi_save);
+  }
+  if (save_summary) {
+    Rcpp::List X_out = X_summary.output();
+    X_out.push_back(X_covariance.covariance(), "cov");
+    out.push_back(Rcpp::List::create(
+      _["X"] = X_out,
+      _["alpha_pred"] = alpha_pred_summary.output(),
+      _["zeta_pred"] = zeta_pred_summary.output()), "summary");
+  }
+  return(out);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////// Dispatch once on the correlation function ///////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+template <typename ... Args>
+List mcmc_dispatch (const std::string& corr_function, Args&& ... args) {
+  if (corr_function == "exponential") {
+    return(mcmc_corr<corr_exponential>(args ...));
+  } else if (corr_function == "gaussian") {
+    return(mcmc_corr<corr_gaussian>(args ...));
+  } else if (corr_function == "matern32") {
+    return(mcmc_corr<corr_matern32>(args ...));
+  } else if (corr_function == "matern52") {
+    return(mcmc_corr<corr_matern52>(args ...));
+  }
+  stop ("the only valid correlation functions are exponential, gaussian, matern32 and matern52");
+}
+
+// [[Rcpp::export]]
+List mcmcRcpp (const arma::mat& Y, const arma::vec& X, 
+               const arma::mat& Y_pred, List params, 
+               int n_chain=1, bool pool_s2_tau2=true,
+               std::string file_name="DM-fit", 
+               std::string corr_function="exponential") {
+  // integer counts, row totals and non-zero cells for the likelihood
+  dm_counts Y_counts(Y);
+  dm_counts Y_pred_counts(Y_pred);
+  return(mcmc_dispatch(corr_function, Y_counts, X, Y_pred_counts, params,
+                       n_chain, pool_s2_tau2, file_name));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//////////////////// Fit from a memory mapped count dataset ///////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+// [[Rcpp::export]]
+void writeCountDataset (std::string file, const arma::mat& Y,
+                        const arma::vec& X, const arma::mat& Y_pred,
+                        const arma::vec& X_knots,
+                        std::vector<std::string> names=std::vector<std::string>()) {
+  write_count_dataset(file, Y, X, Y_pred, X_knots, names);
+}
+
+// label dimension margin (0-based) of the array x[name] with the species
+inline void name_species (List& x, const char* name, const int& margin,
+                          const CharacterVector& species) {
+  if (!x.containsElementNamed(name)) {
+    return;
+  }
+  NumericVector values = x[name];
+  IntegerVector dim = values.attr("dim");
+  List dimnames(dim.size());
+  dimnames[margin] = species;
+  values.attr("dimnames") = dimnames;
+}
+
+// [[Rcpp::export]]
+List mcmcDatasetRcpp (std::string dataset, List params,
+                      int n_chain=1, bool pool_s2_tau2=true,
+                      std::string file_name="DM-fit",
+                      std::string corr_function="exponential") {
+  // the counts are used in place from the mapping, which stays open for the
+  // whole chain, the knots in the dataset are used unless params has its own
+  count_dataset data(dataset);
+  dm_counts Y_counts(data.Y(), data.Y_total(), data.header.N, data.header.d);
+  dm_counts Y_pred_counts(data.Y_pred(), data.Y_pred_total(),
+                          data.header.N_pred, data.header.d);
+  if (!params.containsElementNamed("X_knots")) {
+    params.push_back(data.X_knots(), "X_knots");
+  }
+  List out = mcmc_dispatch(corr_function, Y_counts, data.X(), Y_pred_counts,
+                           params, n_chain, pool_s2_tau2, file_name);
+  // label the species dimension of the draws and summaries with the names
+  // stored in the dataset, the draws matrix keeps its parameter[index] names
+  std::vector<std::string> names = data.names();
+  if (!names.empty()) {
+    CharacterVector species = wrap(names);
+    name_species(out, "mu", 1, species);
+    name_species(out, "tau2", 1, species);
+    name_species(out, "zeta", 2, species);
+    name_species(out, "zeta_pred", 2, species);
+    name_species(out, "alpha", 2, species);
+    name_species(out, "alpha_pred", 2, species);
+    name_species(out, "R", 2, species);
+    name_species(out, "Gamma", 2, species);
+    if (out.containsElementNamed("summary")) {
+      List summary = out["summary"];
+      const char* pred_names[] = {"alpha_pred", "zeta_pred"};
+      for (int l=0; l<2; l++) {
+        List pred_summary = summary[pred_names[l]];
+        name_species(pred_summary, "mean", 1, species);
+        name_species(pred_summary, "var", 1, species);
+        name_species(pred_summary, "quantiles", 1, species);
+      }
+    }
+  }
+  return(out);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+////////////// Regenerate derived quantities from saved primitives ////////////
+///////////////////////////////////////////////////////////////////////////////
+
+// saved primitives in the per-parameter layout, n_save draws first
+struct saved_primitives {
+  bool factor_model;
+  arma::mat mu;
+  arma::cube eta_star;
+  arma::cube R;
+  arma::mat tau2;
+  arma::vec phi;
+  arma::mat X;
+};
+
+// columns of the draws matrix named name[...], in the draws_matrix order
+inline arma::mat draws_columns (const NumericMatrix& draws,
+                                const std::string& name,
+                                const bool& required=true) {
+  CharacterVector col_names = colnames(draws);
+  std::string prefix = name + "[";
+  std::vector<arma::uword> cols;
+  for (int col=0; col<col_names.size(); col++) {
+    std::string col_name = as<std::string>(col_names[col]);
+    if (col_name.compare(0, prefix.size(), prefix) == 0) {
+      cols.push_back(col);
+    }
+  }
+  if (cols.empty() && required) {
+    stop("the draws matrix has no " + name + " columns");
+  }
+  arma::mat draws_mat(const_cast<double*>(draws.begin()), draws.nrow(),
+                      draws.ncol(), false, true);
+  return(draws_mat.cols(arma::uvec(cols)));
+}
+
+// n_save by n_rows * n_cols block saved row major, as draws_matrix does
+inline arma::cube draws_block (const arma::mat& block, const arma::uword& n_rows,
+                               const arma::uword& n_cols) {
+  arma::cube x(block.n_rows, n_rows, n_cols);
+  for (arma::uword i=0; i<n_rows; i++) {
+    for (arma::uword j=0; j<n_cols; j++) {
+      x.slice(j).col(i) = block.col(i * n_cols + j);
+    }
+  }
+  return(x);
+}
+
+inline saved_primitives read_primitives (const List& out,
+                                         const arma::uword& N_knots) {
+  saved_primitives saved;
+  if (out.containsElementNamed("draws")) {
+    // output saved with save_draws_matrix = TRUE
+    NumericMatrix draws = out["draws"];
+    CharacterVector col_names = colnames(draws);
+    saved.factor_model = false;
+    for (int col=0; col<col_names.size(); col++) {
+      if (as<std::string>(col_names[col]).compare(0, 6, "Gamma[") == 0) {
+        saved.factor_model = true;
+        break;
+      }
+    }
+    saved.mu = draws_columns(draws, "mu");
+    saved.tau2 = draws_columns(draws, "tau2");
+    saved.phi = draws_columns(draws, "phi").col(0);
+    // no X columns when nothing is predicted
+    saved.X = draws_columns(draws, "X", false);
+    arma::uword d = saved.mu.n_cols;
+    arma::mat eta_star = draws_columns(draws, "eta_star");
+    arma::mat R = draws_columns(draws, saved.factor_model ? "Gamma" : "R");
+    if (eta_star.n_cols % N_knots != 0 || R.n_cols % d != 0) {
+      stop("the eta_star and R columns of the draws matrix do not match X_knots and mu");
+    }
+    saved.eta_star = draws_block(eta_star, N_knots, eta_star.n_cols / N_knots);
+    saved.R = draws_block(R, R.n_cols / d, d);
+  } else {
+    const char* names[] = {"mu", "eta_star", "tau2", "phi", "X"};
+    for (int b=0; b<5; b++) {
+      if (!out.containsElementNamed(names[b])) {
+        stop(std::string("out has no ") + names[b] +
+          ", the draws can only be regenerated from output saved with save_draws = TRUE");
+      }
+    }
+    saved.factor_model = out.containsElementNamed("Gamma");
+    if (!saved.factor_model && !out.containsElementNamed("R")) {
+      stop("out has neither R nor Gamma");
+    }
+    saved.mu = as<mat>(out["mu"]);
+    saved.eta_star = as<cube>(out["eta_star"]);
+    // the factor model saves the loadings Gamma, with R = [Gamma; I]
+    saved.R = as<cube>(out[saved.factor_model ? "Gamma" : "R"]);
+    saved.tau2 = as<mat>(out["tau2"]);
+    saved.phi = as<vec>(out["phi"]);
+    saved.X = as<mat>(out["X"]);
+  }
+
+  arma::uword n_save = saved.phi.n_elem;
+  arma::uword d = saved.mu.n_cols;
+  if (saved.mu.n_rows != n_save || saved.eta_star.n_rows != n_save ||
+      saved.R.n_rows != n_save || saved.tau2.n_rows != n_save ||
+      saved.X.n_rows != n_save) {
+    stop("mu, eta_star, R, tau2 and X must have one draw per draw of phi");
+  }
+  if (saved.eta_star.n_cols != N_knots) {
+    stop("eta_star must have one row per knot in X_knots");
+  }
+  arma::uword n_factors = saved.factor_model ? saved.R.n_cols : 0;
+  if (saved.tau2.n_cols != d || saved.R.n_slices != d ||
+      (!saved.factor_model && saved.R.n_cols != d) ||
+      saved.eta_star.n_slices != n_factors + d) {
+    stop("the dimensions of eta_star, R and tau2 do not match mu");
+  }
+  return(saved);
+}
+
+//
+// Rebuilds alpha, zeta, alpha_pred or zeta_pred for the requested draws and
+// rows from the saved mu, eta_star, R (or Gamma), tau2, phi and X exactly as the
+// sampler computes them, so output saved with save_derived = FALSE loses
+// nothing. The primitives are read from either the per-parameter arrays or
+// the draws matrix. Draws are independent and are regenerated in parallel.
+//
+
+template <typename corr>
+NumericVector regenerate_corr (const saved_primitives& saved, const arma::vec& X,
+                               const arma::vec& X_knots, const bool& pred,
+                               const bool& exponentiate,
+                               const arma::uvec& draw_idx,
+                               const arma::uvec& row_idx) {
+  const arma::mat& mu_save = saved.mu;
+  const arma::cube& eta_star_save = saved.eta_star;
+  const arma::cube& R_save = saved.R;
+  const arma::mat& tau2_save = saved.tau2;
+  const arma::vec& phi_save = saved.phi;
+  const arma::mat& X_save = saved.X;
+  bool factor_model = saved.factor_model;
+  double N_knots = X_knots.n_elem;
+  double d = mu_save.n_cols;
+  int n_factors = factor_model ? R_save.n_cols : 0;
+  int n_draws = draw_idx.n_elem;
+  int n_rows = row_idx.n_elem;
+  arma::mat D_knots = makeDistARMA(X_knots, X_knots);
+  arma::mat I_prevent_singular = arma::eye(N_knots, N_knots) * 1e-8;
+
+  // R owned result filled through a non-owning view
+  NumericVector derived_out(n_draws * n_rows * d);
+  arma::cube derived(derived_out.begin(), n_draws, n_rows, d, false, true);
+  // nothing may throw inside the parallel region, failed inversions are
+  // recorded and reported afterwards
+  std::vector<char> failed(n_draws, 0);
+  #pragma omp parallel for schedule(dynamic)
+  for (int s=0; s<n_draws; s++) {
+    arma::uword k = draw_idx(s);
+    double phi = phi_save(k);
+    arma::mat eta_star(N_knots, n_factors + d);
+    for (int j=0; j<n_factors + d; j++) {
+      for (int l=0; l<N_knots; l++) {
+        eta_star(l, j) = eta_star_save(k, l, j);
+      }
+    }
+    arma::mat R(R_save.n_cols, d);
+    for (int j=0; j<d; j++) {
+      for (arma::uword l=0; l<R_save.n_cols; l++) {
+        R(l, j) = R_save(k, l, j);
+      }
+    }
+    if (factor_model) {
+      R = join_cols(R, arma::mat(arma::eye(d, d)));
+    }
+    arma::mat R_tau = R * diagmat(sqrt(tau2_save.row(k).t()));
+    arma::mat C_inv;
+    if (!inv_sympd(C_inv, corr_matrix<corr>(D_knots, phi) + I_prevent_singular)) {
+      failed[s] = 1;
+      continue;
+    }
+    // distances to the knots for the requested rows, the predictive X are
+    // saved as X_pred + mu_X, the value ess_X measures the distances from
+    arma::mat D(n_rows, N_knots);
+    for (int i=0; i<n_rows; i++) {
+      double x = pred ? X_save(k, row_idx(i)) : X(row_idx(i));
+      for (int l=0; l<N_knots; l++) {
+        D(i, l) = std::abs(x - X_knots(l));
+      }
+    }
+    arma::mat zeta = make_zeta(corr_matrix<corr>(D, phi) * C_inv, eta_star, R_tau);
+    if (exponentiate) {
+      zeta.each_row() += mu_save.row(k);
+      zeta = exp(zeta);
+    }
+    for (int j=0; j<d; j++) {
+      for (int i=0; i<n_rows; i++) {
+        derived(s, i, j) = zeta(i, j);
+      }
+    }
+  }
+  for (int s=0; s<n_draws; s++) {
+    if (failed[s]) {
+      stop("the knot correlation matrix is not invertible for draw " +
+        std::to_string(draw_idx(s) + 1));
+    }
+  }
+  derived_out.attr("dim") = IntegerVector::create(n_draws, n_rows, d);
+  return(derived_out);
+}
+
+// [[Rcpp::export]]
+NumericVector regenerateRcpp (const List& out, const arma::vec& X,
+                              const arma::vec& X_knots,
+                              std::string quantity="alpha",
+                              Nullable<IntegerVector> draws=R_NilValue,
+                              Nullable<IntegerVector> rows=R_NilValue,
+                              std::string corr_function="exponential") {
+  // draws and rows are 1-based indices, all of them by default
+  bool pred = quantity == "alpha_pred" || quantity == "zeta_pred";
+  bool exponentiate = quantity == "alpha" || quantity == "alpha_pred";
+  if (!pred && !exponentiate && quantity != "zeta") {
+    stop("quantity must be one of alpha, zeta, alpha_pred and zeta_pred");
+  }
+  saved_primitives saved = read_primitives(out, X_knots.n_elem);
+  arma::uword n_save = saved.phi.n_elem;
+  arma::uword n_rows = pred ? saved.X.n_cols : X.n_elem;
+  if (n_save == 0) {
+    stop("out has no saved draws");
+  }
+  arma::uvec draw_idx = arma::regspace<arma::uvec>(0, n_save - 1);
+  if (draws.isNotNull()) {
+    draw_idx = as<arma::uvec>(draws.get()) - 1;
+  }
+  arma::uvec row_idx = arma::regspace<arma::uvec>(0, n_rows - 1);
+  if (rows.isNotNull()) {
+    row_idx = as<arma::uvec>(rows.get()) - 1;
+  }
+  if (any(draw_idx >= n_save) || any(row_idx >= n_rows)) {
+    stop("draws and rows must be valid 1-based indices");
+  }
+  if (corr_function == "exponential") {
+    return(regenerate_corr<corr_exponential>(saved, X, X_knots, pred,
+                                             exponentiate, draw_idx, row_idx));
+  } else if (corr_function == "gaussian") {
+    return(regenerate_corr<corr_gaussian>(saved, X, X_knots, pred,
+                                          exponentiate, draw_idx, row_idx));
+  } else if (corr_function == "matern32") {
+    return(regenerate_corr<corr_matern32>(saved, X, X_knots, pred,
+                                          exponentiate, draw_idx, row_idx));
+  } else if (corr_function == "matern52") {
+    return(regenerate_corr<corr_matern52>(saved, X, X_knots, pred,
+                                          exponentiate, draw_idx, row_idx));
+  }
+  stop ("the only valid correlation functions are exponential, gaussian, matern32 and matern52");
 }
@@ -1,11 +1,16 @@
 // #define ARMA_64BIT_WORD
 #include <RcppArmadillo.h>
 // [[Rcpp::depends(RcppArmadillo, myFunctions)]]
+// [[Rcpp::plugins(cpp14)]]
 #include "myFunctionsHeader.h"
+#include "dm-likelihood.h"
+#include "bspline-basis.h"
+#include "sample-store.h"
 #include <iostream>  // I/O 
 #include <fstream>   // file I/O
 #include <iomanip>   // format manipulation
 #include <string>
+#include <type_traits>
 
 using namespace Rcpp;
 using namespace arma;
@@ -143,25 +148,22 @@ using namespace arma;
 ///////////// Elliptical Slice Sampler for unobserved covariate X /////////////
 ///////////////////////////////////////////////////////////////////////////////
 
-// [[Rcpp::export]]
 Rcpp::List ess_X (const double& X_current, const double& X_prior,
                   const double& mu_X,
                   const arma::mat& beta_current,
                   const arma::rowvec& alpha_current,
-                  const arma::rowvec& y_current,
+                  const dm_counts& counts, const int& i,
                   const arma::rowvec& Xbs_current,
-                  const arma::vec& knots,
-                  const double& d, const int& degree, const int& df,
-                  const arma::vec& rangeX, const double& count_double,
+                  const bspline_basis& basis,
                   const std::string& file_name, const int& n_chain) {
   // const arma::mat& R_tau_current,
   //
-  //
-  //
+  // counts are the pre-computed integer counts and i is the site being updated
+  // basis evaluates only the degree + 1 non-zero B-splines at each proposal
   //
 
   // calculate log likelihood of current value
-  double current_log_like = LL_DM_row(alpha_current, y_current, d, count_double);
+  double current_log_like = LL_DM_row_log(Xbs_current * beta_current, counts, i);
   double hh = log(R::runif(0.0, 1.0)) + current_log_like;
 
   // Setup a bracket and pick a first proposal
@@ -176,59 +178,42 @@ Rcpp::List ess_X (const double& X_current, const double& X_prior,
   arma::rowvec alpha_ess = alpha_current;
   bool test = true;
 
+  // sparse basis row and proposal buffer, reused for every proposal
+  double Xbs_values[bspline_max_degree + 1];
+  arma::rowvec log_alpha_proposal(beta_current.n_cols);
 
   // Slice sampling loop
   while (test) {
     // compute proposal for angle difference and check to see if it is on the slice
     double X_proposal = X_current * cos(phi_angle) + X_prior * sin(phi_angle);
     // adjust for non-zero mean
-    arma::vec X_tilde(1);
-    X_tilde(0) = X_proposal + mu_X;
-    arma::rowvec Xbs_proposal = bs_cpp(X_tilde, df, knots, degree, true,
-                                       rangeX);
-    arma::rowvec alpha_proposal = exp(Xbs_proposal * beta_current);
+    arma::uword Xbs_start = basis.eval(X_proposal + mu_X, Xbs_values);
+    bspline_row_product(Xbs_values, Xbs_start, basis.degree, beta_current,
+                        log_alpha_proposal);
 
-    // calculate log likelihood of proposed value
-    double proposal_log_like = LL_DM_row(alpha_proposal, y_current, d, 
-                                         count_double);
-    // control to limit alpha from getting unreasonably large
-    if (alpha_proposal.max() > pow(10, 10) ) {
-      if (phi_angle > 0.0) {
-        phi_angle_max = phi_angle;
-      } else if (phi_angle < 0.0) {
-        phi_angle_min = phi_angle;
-      } else {
-        Rprintf("Bug - ESS for X shrunk to current position with large alpha \n");
-        // set up output messages
-        std::ofstream file_out;
-        file_out.open(file_name, std::ios_base::app);
-        file_out << "Bug - ESS for X shrunk to current position with large alpha on chain " << n_chain << "\n";
-        // close output file
-        file_out.close();
-        test = false;
-      }
-    } else {
-      if (proposal_log_like > hh) {
-        // proposal is on the slice
-        X_ess = X_proposal;
-        Xbs_ess = Xbs_proposal;
-        alpha_ess = alpha_proposal;
-        test = false;
+    // calculate log likelihood of proposed value, large alpha are handled on
+    // the log scale so no proposal needs to be rejected for being too large
+    double proposal_log_like = LL_DM_row_log(log_alpha_proposal, counts, i);
+    if (proposal_log_like > hh) {
+      // proposal is on the slice
+      X_ess = X_proposal;
+      bspline_row_dense(Xbs_values, Xbs_start, basis.degree, Xbs_ess);
+      alpha_ess = exp(log_alpha_proposal);
+      test = false;
 
-      } else if (phi_angle > 0.0) {
-        phi_angle_max = phi_angle;
-      } else if (phi_angle < 0.0) {
-        phi_angle_min = phi_angle;
-      } else {
-        Rprintf("Bug - ESS for X shrunk to current position \n");
-        // set up output messages
-        std::ofstream file_out;
-        file_out.open(file_name, std::ios_base::app);
-        file_out << "Bug - ESS for X shrunk to current position on chain " << n_chain << "\n";
-        // close output file
-        file_out.close();
-        test = false;
-      }
+    } else if (phi_angle > 0.0) {
+      phi_angle_max = phi_angle;
+    } else if (phi_angle < 0.0) {
+      phi_angle_min = phi_angle;
+    } else {
+      Rprintf("Bug - ESS for X shrunk to current position \n");
+      // set up output messages
+      std::ofstream file_out;
+      file_out.open(file_name, std::ios_base::app);
+      file_out << "Bug - ESS for X shrunk to current position on chain " << n_chain << "\n";
+      // close output file
+      file_out.close();
+      test = false;
     }
     // Propose new angle difference
     phi_angle = R::runif(0.0, 1.0) * (phi_angle_max - phi_angle_min) + 
@@ -268,6 +253,9 @@ double dMVN (const arma::mat& y, const arma::vec& mu,
 ////////////////////////////////// MCMC Loop //////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 
+// phases of the chain, each gets its own instantiation of the sampler step
+enum mcmc_phase { phase_adapt, phase_fit };
+
 // [[Rcpp::export]]
 List mcmcRcpp (const arma::mat& Y, const arma::vec& X, 
                const arma::mat& Y_pred, List params, 
@@ -322,17 +310,11 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
   // double B = Rf_choose(d, 2);
   double B = Rf_choose(d, 2);
 
-  // count - sum of counts at each site
-  arma::vec count(N);
-  for (int i=0; i<N; i++) {
-    count(i) = sum(Y.row(i));
-  }
+  // integer counts, row totals and non-zero cells for the likelihood
+  dm_counts Y_counts(Y);
   
-  // count - sum of counts at each site
-  arma::vec count_pred(N_pred);
-  for (int i=0; i<N_pred; i++) {
-    count_pred(i) = sum(Y_pred.row(i));
-  }
+  // integer counts, row totals and non-zero cells for the likelihood
+  dm_counts Y_pred_counts(Y_pred);
   
   // constant vectors
   arma::mat I_d(d, d, arma::fill::eye);
@@ -431,8 +413,10 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
   // observational data
   arma::vec knots = linspace(rangeX(0), rangeX(1), df-degree-1+2);
   knots = knots.subvec(1, df-degree-1);
-  arma::mat Xbs = bs_cpp(X, df, knots, degree, true, rangeX);
-  arma::mat Xbs_pred = bs_cpp(X_pred, df, knots, degree, true, rangeX);
+  bspline_basis basis(knots, rangeX, degree, df);
+  arma::mat Xbs = basis.basis(X);
+  // the unobserved covariates are centered, the basis is on the original scale
+  arma::mat Xbs_pred = basis.basis(X_pred + mu_X);
 
   //
   // initialize values
@@ -516,14 +500,16 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
   // arma::mat R = as<mat>(R_out["R"]);
   // arma::mat R_tau = R * diagmat(tau);
   // arma::mat zeta = Z * eta_star * R_tau;
-  arma::mat alpha = exp(Xbs * beta);
+  arma::mat log_alpha = Xbs * beta;
+  arma::mat alpha = exp(log_alpha);
+  arma::vec alpha_rowsums = sum(alpha, 1);
   arma::mat alpha_pred = exp(Xbs_pred * beta);
 
   // setup save variables
   int n_save = n_mcmc / n_thin;
-  arma::cube alpha_save(n_save, N, d, arma::fill::zeros);
-  arma::cube alpha_pred_save(n_save, N_pred, d, arma::fill::zeros);
-  arma::cube beta_save(n_save, df, d, arma::fill::zeros);
+  sample_store alpha_save(n_save, N, d);
+  sample_store alpha_pred_save(n_save, N_pred, d);
+  sample_store beta_save(n_save, df, d);
   arma::mat X_save(n_save, N_pred, arma::fill::zeros);
   // arma::mat tau2_save(n_save, d, arma::fill::zeros);
   // arma::mat lambda_tau2_save(n_save, d, arma::fill::zeros);
@@ -568,60 +554,63 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
     Sigma_beta_tune_chol.slice(j) = chol(Sigma_beta_tune.slice(j));
   }
   
-  Rprintf("Starting MCMC adaptation for chain %d, running for %d iterations \n", 
-          n_chain, n_adapt);
-  // set up output messages
-  std::ofstream file_out;
-  file_out.open(file_name, std::ios_base::app);
-  file_out << "Starting MCMC adaptation for chain " << n_chain <<
-    ", running for " << n_adapt << " iterations \n";
-  // close output file
-  file_out.close(); 
-  // }
+  //
+  // One iteration of the sampler
+  //
   
-  // Start MCMC chain
-  for (int k=0; k<n_adapt; k++) {
-    if ((k+1) % message == 0) {
-      Rprintf("MCMC Adaptive Iteration %d for chain %d\n", k+1, n_chain); 
-      // set up output messages
-      std::ofstream file_out;
-      file_out.open(file_name, std::ios_base::app);
-      file_out << "MCMC Adaptive Iteration " << k+1 << " for chain " <<
-        n_chain << "\n";
-      // close output file
-      file_out.close(); 
-    }
+  // The phase is passed as a compile-time constant so the adaptation and
+  // fitting loops each get their own instantiation, with the tuning
+  // bookkeeping compiled out of the fitting phase and the saves compiled out
+  // of the adaptation phase.
+  
+  auto step = [&] (const int& k, auto phase) {
+    const bool adapt = decltype(phase)::value == phase_adapt;
     
-    Rcpp::checkUserInterrupt();
+    // batch acceptance rates while tuning, overall rates while fitting
+    auto record_accept = [&] (double& accept_batch, double& accept) {
+      if (adapt) {
+        accept_batch += 1.0 / 50.0;
+      } else {
+        accept += 1.0 / n_mcmc;
+      }
+    };
     
     //
     // Sample beta - block MH
     //
 
     if (sample_beta) {
+      // refresh the cached row sums so the column updates do not drift
+      alpha_rowsums = sum(alpha, 1);
       for (int j=0; j<d; j++) {
-        arma::mat beta_star = beta;
-        beta_star.col(j) +=
+        // only column j of alpha moves, so the likelihood is updated locally
+        arma::vec beta_star_j = beta.col(j) +
           mvrnormArmaVecChol(zero_df,
                              lambda_beta_tune(j) * Sigma_beta_tune_chol.slice(j));
-        arma::mat alpha_star = exp(Xbs * beta_star);
-        // construct updated alpha for unobserved data
-        arma::mat alpha_pred_star = exp(Xbs_pred * beta_star);
-        double mh1 = LL_DM(alpha_star, Y, N, d, count) + 
-          dMVN(beta_star.col(j), mu_beta, Sigma_beta_chol);
-        double mh2 = LL_DM(alpha, Y, N, d, count) + 
-          dMVN(beta.col(j), mu_beta, Sigma_beta_chol);
+        arma::vec log_alpha_col_star = Xbs * beta_star_j;
+        arma::vec alpha_col_star(N);
+        arma::vec alpha_rowsums_star(N);
+        double mh1 = LL_DM_col_delta(log_alpha, alpha, alpha_rowsums,
+                                     log_alpha_col_star, Y_counts, j,
+                                     alpha_col_star, alpha_rowsums_star) +
+          dMVN(beta_star_j, mu_beta, Sigma_beta_chol);
+        double mh2 = dMVN(beta.col(j), mu_beta, Sigma_beta_chol);
         double mh = exp(mh1 - mh2);
         if (mh > R::runif(0, 1.0)) {
-          beta = beta_star;
-          alpha = alpha_star;
-          alpha_pred = alpha_pred_star;
-          beta_accept_batch(j) += 1.0 / 50.0;
+          beta.col(j) = beta_star_j;
+          log_alpha.col(j) = log_alpha_col_star;
+          alpha.col(j) = alpha_col_star;
+          alpha_rowsums = alpha_rowsums_star;
+          // construct updated alpha for unobserved data
+          alpha_pred.col(j) = exp(Xbs_pred * beta_star_j);
+          record_accept(beta_accept_batch(j), beta_accept(j));
         }
       }
       // update tuning
-      beta_batch.subcube(k % 50, 0, 0, k % 50, df-1, d-1) = beta;
-      if ((k+1) % 50 == 0){
+      if (adapt) {
+        beta_batch.subcube(k % 50, 0, 0, k % 50, df-1, d-1) = beta;
+      }
+      if (adapt && (k+1) % 50 == 0) {
         updateTuningMVMat(k, beta_accept_batch, lambda_beta_tune,
                           beta_batch, Sigma_beta_tune,
                           Sigma_beta_tune_chol);
@@ -789,14 +778,59 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
       for (int i=0; i<N_pred; i++) {
         double X_prior = R::rnorm(0.0, s_X);
         Rcpp::List ess_out = ess_X(X_pred(i), X_prior, mu_X, beta, alpha_pred.row(i),
-                                   Y_pred.row(i), Xbs_pred.row(i), knots, d, 
-                                   degree, df, rangeX, count_pred(i), file_name, 
-                                   n_chain);
+                                   Y_pred_counts, i, Xbs_pred.row(i), basis,
+                                   file_name, n_chain);
         X_pred(i) = as<double>(ess_out["X"]);
         Xbs_pred.row(i) = as<rowvec>(ess_out["Xbs"]);
         alpha_pred.row(i) = as<rowvec>(ess_out["alpha"]);
       }
     }
+    
+    //
+    // save variables
+    //
+    
+    if (!adapt && (k + 1) % n_thin == 0) {
+      int save_idx = (k+1)/n_thin-1;
+      alpha_save.save(save_idx, alpha);
+      alpha_pred_save.save(save_idx, alpha_pred);
+      beta_save.save(save_idx, beta);
+      X_save.row(save_idx) = X_pred.t() + mu_X;
+      // tau2_save.row(save_idx) = tau2.t();
+      // lambda_tau2_save.row(save_idx) = lambda_tau2.t();
+      // s2_tau2_save(save_idx) = s2_tau2;
+      // R_save.subcube(span(save_idx), span(), span()) = R;
+      // xi_save.row(save_idx) = xi.t();
+    }
+  };
+  
+  Rprintf("Starting MCMC adaptation for chain %d, running for %d iterations \n", 
+          n_chain, n_adapt);
+  // set up output messages
+  std::ofstream file_out;
+  file_out.open(file_name, std::ios_base::app);
+  file_out << "Starting MCMC adaptation for chain " << n_chain <<
+    ", running for " << n_adapt << " iterations \n";
+  // close output file
+  file_out.close(); 
+  // }
+  
+  // Start MCMC chain
+  for (int k=0; k<n_adapt; k++) {
+    if ((k+1) % message == 0) {
+      Rprintf("MCMC Adaptive Iteration %d for chain %d\n", k+1, n_chain); 
+      // set up output messages
+      std::ofstream file_out;
+      file_out.open(file_name, std::ios_base::app);
+      file_out << "MCMC Adaptive Iteration " << k+1 << " for chain " <<
+        n_chain << "\n";
+      // close output file
+      file_out.close(); 
+    }
+    
+    Rcpp::checkUserInterrupt();
+    
+    step(k, std::integral_constant<int, phase_adapt>());
   }
   
   Rprintf("Starting MCMC fit for chain %d, running for %d iterations \n", 
@@ -823,202 +857,7 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
     
     Rcpp::checkUserInterrupt();
     
-    //
-    // Sample beta - block MH
-    //
-    
-    if (sample_beta) {
-      for (int j=0; j<d; j++) {
-        arma::mat beta_star = beta;
-        beta_star.col(j) +=
-          mvrnormArmaVecChol(zero_df,
-                             lambda_beta_tune(j) * Sigma_beta_tune_chol.slice(j));
-        
-        arma::mat alpha_star = exp(Xbs * beta_star);
-        // construct updated alpha for unobserved data
-        arma::mat alpha_pred_star = exp(Xbs_pred * beta_star);
-        
-        double mh1 = LL_DM(alpha_star, Y, N, d, count) + 
-          dMVN(beta_star.col(j), mu_beta, Sigma_beta_chol);
-        double mh2 = LL_DM(alpha, Y, N, d, count) + 
-          dMVN(beta.col(j), mu_beta, Sigma_beta_chol);
-        double mh = exp(mh1 - mh2);
-        if (mh > R::runif(0, 1.0)) {
-          beta = beta_star;
-          alpha = alpha_star;
-          alpha_pred = alpha_pred_star;
-          beta_accept(j) += 1.0 / n_mcmc;
-        }
-      }
-    }
-    
-    
-    // //
-    // // sample tau2
-    // //
-    // 
-    // if (sample_tau2) {
-    //   arma::vec log_tau2_star = log(tau2);
-    //   if (Sigma_reference_category) {
-    //     // first element is fixed at one
-    //     log_tau2_star.subvec(1, d-2) = 
-    //       mvrnormArmaVecChol(log(tau2.subvec(1, d-2)),
-    //                          lambda_tau2_tune * Sigma_tau2_tune_chol);
-    //   } else {
-    //     log_tau2_star = 
-    //       mvrnormArmaVecChol(log(tau2),
-    //                          lambda_tau2_tune * Sigma_tau2_tune_chol);
-    //   }
-    //   arma::vec tau2_star = exp(log_tau2_star);
-    //   if (all(tau2_star > 0.0)) {
-    //     arma::vec tau_star = sqrt(tau2_star);
-    //     arma::mat R_tau_star = R * diagmat(tau_star);
-    //     arma::mat zeta_star = Z * eta_star * R_tau_star;
-    //     arma::mat alpha_star(N, d, arma::fill::ones);
-    //     for (int i=0; i<N; i++) {
-    //       arma::rowvec tmp_row(d, arma::fill::ones);
-    //       tmp_row.subvec(1, d-1) = exp(mu.t() + zeta_star.row(i));
-    //       alpha_star.row(i) = tmp_row / sum(tmp_row);
-    //     }
-    //     double mh1 = LL(alpha_star, Y, N, d, count) + 
-    //       // jacobian of log-scale proposal
-    //       sum(log_tau2_star);
-    //     double mh2 = LL(alpha, Y, N, d, count) + 
-    //       // jacobian of log-scale proposal
-    //       sum(log(tau2));
-    //     // prior
-    //     if (Sigma_reference_category) {
-    //       for (int j=1; j<(d-1); j++) {
-    //         mh1 += R::dgamma(tau2_star(j), 0.5, 1.0 / lambda_tau2(j), true);
-    //         mh2 += R::dgamma(tau2(j), 0.5, 1.0 / lambda_tau2(j), true);
-    //       }
-    //     } else {
-    //       for (int j=0; j<(d-1); j++) {
-    //         mh1 += R::dgamma(tau2_star(j), 0.5, 1.0 / lambda_tau2(j), true);
-    //         mh2 += R::dgamma(tau2(j), 0.5, 1.0 / lambda_tau2(j), true);
-    //       }
-    //     }
-    //     double mh = exp(mh1-mh2);
-    //     if (mh > R::runif(0.0, 1.0)) {
-    //       tau2 = tau2_star;
-    //       tau = tau_star;
-    //       R_tau = R_tau_star;
-    //       zeta = zeta_star;
-    //       alpha = alpha_star;
-    //       tau2_accept += 1.0 / n_mcmc;
-    //     }
-    //   }
-    // }
-    // 
-    // //
-    // // sample lambda_tau2
-    // //
-    // 
-    // for (int j=0; j<(d-1); j++) {
-    //   lambda_tau2(j) = R::rgamma(1.0, 1.0 / (s2_tau2 + tau2(j)));
-    // }
-    // 
-    // //
-    // // sample s2_tau2
-    // //
-    // 
-    // if (pool_s2_tau2) {
-    //   
-    //   double s2_tau2_star = s2_tau2 + R::rnorm(0, s2_tau2_tune);
-    //   if (s2_tau2_star > 0 && s2_tau2_star < A_s2) {
-    //     double mh1 = 0.0;
-    //     double mh2 = 0.0;
-    //     for (int j=0; j<(d-1); j++) {
-    //       mh1 += R::dgamma(lambda_tau2(j), 0.5, 1.0 / s2_tau2_star, true);
-    //       mh2 += R::dgamma(lambda_tau2(j), 0.5, 1.0 / s2_tau2, true);
-    //     }
-    //     double mh = exp(mh1-mh2);
-    //     if (mh > R::runif(0.0, 1.0)) {
-    //       s2_tau2 = s2_tau2_star;
-    //       s2_tau2_accept += 1.0 / n_mcmc;
-    //     }
-    //   }
-    // }
-    // 
-    // //
-    // // sample xi - MH
-    // //
-    // 
-    // if (sample_xi) {
-    //   arma::vec logit_xi_tilde_star = mvrnormArmaVecChol(logit(xi_tilde),
-    //                                                      lambda_xi_tune * Sigma_xi_tune_chol);
-    //   arma::vec xi_tilde_star = expit(logit_xi_tilde_star);
-    //   arma::vec xi_star = 2.0 * xi_tilde_star - 1.0;
-    //   if (all(xi_star > -1.0) && all(xi_star < 1.0)) {
-    //     Rcpp::List R_out = makeRLKJ(xi_star, d-1, true, true);
-    //     arma::mat R_star = as<mat>(R_out["R"]);
-    //     arma::mat R_tau_star = R_star * diagmat(tau);
-    //     arma::mat zeta_star = Z * eta_star * R_tau_star;
-    //     arma::mat alpha_star(N, d, arma::fill::ones);
-    //     for (int i=0; i<N; i++) {
-    //       arma::rowvec tmp_row(d, arma::fill::ones);
-    //       tmp_row.subvec(1, d-1) = exp(mu.t() + zeta_star.row(i));
-    //       alpha_star.row(i) = tmp_row / sum(tmp_row);
-    //     }
-    //     
-    //     double log_jacobian_star = as<double>(R_out["log_jacobian"]);
-    //     double mh1 = LL(alpha_star, Y, N, d, count) + 
-    //       // Jacobian adjustment
-    //       sum(log(xi_tilde_star) + log(ones_B - xi_tilde_star));
-    //     double mh2 = LL(alpha, Y, N, d, count) + 
-    //       // Jacobian adjustment
-    //       sum(log(xi_tilde) + log(ones_B - xi_tilde));
-    //     for (int b=0; b<B; b++) {
-    //       mh1 += R::dbeta(0.5 * (xi_star(b) + 1.0), eta_vec(b), eta_vec(b), true);
-    //       mh2 += R::dbeta(0.5 * (xi(b) + 1.0), eta_vec(b), eta_vec(b), true);
-    //     }
-    //     double mh = exp(mh1-mh2);
-    //     if (mh > R::runif(0.0, 1.0)) {
-    //       xi_tilde = xi_tilde_star;
-    //       xi = xi_star;
-    //       R = R_star;
-    //       R_tau = R_tau_star;
-    //       log_jacobian = log_jacobian_star;
-    //       zeta = zeta_star;
-    //       alpha = alpha_star;
-    //       xi_accept += 1.0 / n_mcmc;
-    //     }
-    //   }
-    // }
-    
-    //
-    // sample X - ESS
-    //
-
-    if (sample_X) {
-      for (int i=0; i<N_pred; i++) {
-        double X_prior = R::rnorm(0.0, s_X);
-        Rcpp::List ess_out = ess_X(X_pred(i), X_prior, mu_X, beta, alpha_pred.row(i),
-                                   Y_pred.row(i), Xbs_pred.row(i), knots, d,
-                                   degree, df, rangeX, count_pred(i), file_name, 
-                                   n_chain);
-        X_pred(i) = as<double>(ess_out["X"]);
-        Xbs_pred.row(i) = as<rowvec>(ess_out["Xbs"]);
-        alpha_pred.row(i) = as<rowvec>(ess_out["alpha"]);
-      }
-    }
-    
-    //
-    // save variables
-    //
-    
-    if ((k + 1) % n_thin == 0) {
-      int save_idx = (k+1)/n_thin-1;
-      alpha_save.subcube(span(save_idx), span(), span()) = alpha;
-      alpha_pred_save.subcube(span(save_idx), span(), span()) = alpha_pred;
-      beta_save.subcube(span(save_idx), span(), span()) = beta;
-      X_save.row(save_idx) = X_pred.t() + mu_X;
-      // tau2_save.row(save_idx) = tau2.t();
-      // lambda_tau2_save.row(save_idx) = lambda_tau2.t();
-      // s2_tau2_save(save_idx) = s2_tau2;
-      // R_save.subcube(span(save_idx), span(), span()) = R;
-      // xi_save.row(save_idx) = xi.t();
-    }
+    step(k, std::integral_constant<int, phase_fit>());
   }
   
   // print accpetance rates
@@ -1046,9 +885,9 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X,
   // output results
   
   return Rcpp::List::create(
-    _["alpha"] = alpha_save,
-    _["alpha_pred"] = alpha_pred_save,
-    _["beta"] = beta_save,
+    _["alpha"] = alpha_save.output(),
+    _["alpha_pred"] = alpha_pred_save.output(),
+    _["beta"] = beta_save.output(),
     _["X"] = X_save);
   // _["tau2"] = tau2_save,
   // _["lambda_tau2"] = lambda_tau2_save,
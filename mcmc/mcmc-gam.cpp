@@ -11,11 +11,19 @@
 // #define ARMA_64BIT_WORD
 #include <RcppArmadillo.h>
 // [[Rcpp::depends(RcppArmadillo, myFunctions)]]
+// [[Rcpp::plugins(cpp14, openmp)]]
 #include "myFunctionsHeader.h"
+#include "bspline-basis.h"
+#include "philox-rng.h"
+#include "sample-store.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include <iostream>  // I/O 
 #include <fstream>   // file I/O
 #include <iomanip>   // format manipulation
 #include <string>
+#include <type_traits>
 
 using namespace Rcpp;
 using namespace arma;
@@ -45,27 +53,48 @@ double LL (const arma::mat& alpha, const arma::mat& Y, const double& N,
   return(log_like);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+////////////// Gaussian Log-Likelihood from residual sum of squares ////////////
+///////////////////////////////////////////////////////////////////////////////
+
+double LL_rss (const double& rss, const double& n, const double& sigma) {
+  // rss is the residual sum of squares over n cells
+  return(- n * log(sigma) - 0.5 * n * log(2.0 * arma::datum::pi) -
+         0.5 * rss / pow(sigma, 2.0));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////// Residual sum of squares by row and column //////////////
+///////////////////////////////////////////////////////////////////////////////
+
+void rss_update (const arma::mat& Y, const arma::mat& alpha, const int& N_obs,
+                 arma::vec& rss_row, arma::vec& rss_col) {
+  // rss_row is over all N rows, rss_col only over the N_obs observed rows
+  arma::mat resid2 = square(Y - alpha);
+  rss_row = sum(resid2, 1);
+  rss_col = sum(resid2.rows(0, N_obs-1), 0).t();
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 ///////////// Elliptical Slice Sampler for unobserved covariate X /////////////
 ///////////////////////////////////////////////////////////////////////////////
 
-// [[Rcpp::export]]
 Rcpp::List ess_X (const double& X_current, const double& X_prior, 
                   const double& mu_X, 
                   const arma::mat& beta_current, 
                   const arma::rowvec& alpha_row, const arma::rowvec& Y_row, 
                   const double& sigma_current, const arma::rowvec& Xbs_current, 
-                  const double& d, const arma::vec& knots, 
-                  const int& df, const int& degree, const arma::vec& rangeX, 
+                  const double& d, const bspline_basis& basis, 
                   const std::string& file_name, const int& n_chain) {
   // X_current is the current value of the parameter
   // X_prior is a sample from the prior
+  // basis evaluates only the degree + 1 non-zero B-splines at each proposal
   
-  // calculate log likelihood of current value
-  double current_log_like = 0.0;
-  for (int j=0; j<d; j++) {
-    current_log_like += R::dnorm(Y_row(j), alpha_row(j), sigma_current, true);
-  }
+  // calculate log likelihood of current value, up to the constant shared
+  // with every proposal
+  double sigma2_current = pow(sigma_current, 2.0);
+  double current_log_like = - 0.5 * accu(square(Y_row - alpha_row)) /
+    sigma2_current;
   
   double hh = log(R::runif(0.0, 1.0)) + current_log_like;
   
@@ -79,6 +108,10 @@ Rcpp::List ess_X (const double& X_current, const double& X_prior,
   arma::rowvec Xbs_ess = Xbs_current;
   arma::rowvec alpha_ess = alpha_row;
   
+  // sparse basis row and proposal buffer, reused for every proposal
+  double Xbs_values[bspline_max_degree + 1];
+  arma::rowvec alpha_proposal(beta_current.n_cols);
+  
   bool test = true;
   
   // Slice sampling loop
@@ -87,24 +120,19 @@ Rcpp::List ess_X (const double& X_current, const double& X_prior,
     // compute proposal for angle difference and check to see if it is on the slice
     double X_proposal = X_current * cos(phi_angle) + X_prior * sin(phi_angle);
     // adjust for non-zero mean
-    arma::vec X_tilde(1);
-    X_tilde(0) = X_proposal + mu_X;
-    arma::rowvec Xbs_proposal = bs_cpp(X_tilde, df, knots, degree, true, 
-                                       rangeX);
-    arma::rowvec alpha_proposal = (Xbs_proposal * beta_current);
+    arma::uword Xbs_start = basis.eval(X_proposal + mu_X, Xbs_values);
+    bspline_row_product(Xbs_values, Xbs_start, basis.degree, beta_current,
+                        alpha_proposal);
     
     // calculate log likelihood of proposed value
-    double proposal_log_like = 0.0;
-    for (int j=0; j<d; j++) {
-      proposal_log_like += R::dnorm(Y_row(j), alpha_proposal(j), sigma_current,
-                                    true);
-    }
+    double proposal_log_like = - 0.5 * accu(square(Y_row - alpha_proposal)) /
+      sigma2_current;
     
     
     if (proposal_log_like > hh) {
       // proposal is on the slice
       X_ess = X_proposal;
-      Xbs_ess = Xbs_proposal;
+      bspline_row_dense(Xbs_values, Xbs_start, basis.degree, Xbs_ess);
       alpha_ess = alpha_proposal;
       test = false;
     } else if (phi_angle > 0.0) {
@@ -134,22 +162,64 @@ Rcpp::List ess_X (const double& X_current, const double& X_prior,
 ///////////////////////////////////////////////////////////////////////////////
 
 double mhX (const double& X_mh, const double& mu_X, const double& s2_X,
-            const arma::rowvec& alpha, const arma::rowvec& Y_row,
-            const double& sigma, const double& d) {
-  // mu is a d-vector of regression intercepts
-  // beta is a d-vector of regression parameters
+            const double& rss_row, const double& sigma) {
   // X_mh are unobserved covariate values
-  double logDensity = - 0.5 * pow(X_mh - mu_X, 2.0) / s2_X;
-  for (int j=0; j<d; j++) {
-    logDensity += R::dnorm(Y_row(j), alpha(j), sigma, true);
-  }
+  // rss_row is the residual sum of squares of the row at X_mh, the Gaussian
+  // normalising constant is dropped as it cancels in the MH ratio
+  double logDensity = - 0.5 * pow(X_mh - mu_X, 2.0) / s2_X -
+    0.5 * rss_row / pow(sigma, 2.0);
   return(logDensity);
 }
 
+// one Metropolis-Hastings step for every unobserved X, in parallel over the
+// rows as each row only touches its own state, with the draws for row i at
+// iteration k taken from the Philox stream (k, block_X_mh, i) so the chain
+// does not depend on the number of threads
+const uint32_t block_X_mh = 1;
+
+void update_X_mh (const arma::mat& Y, arma::vec& X, arma::mat& Xbs,
+                  arma::mat& alpha, arma::vec& rss_row, arma::vec& X_accept,
+                  const arma::vec& X_tune, const arma::mat& beta,
+                  const bspline_basis& basis, const int& degree, const int& df,
+                  const double& mu_X, const double& s2_X, const double& sigma,
+                  const int& N_obs, const int& N, const double& accept_step,
+                  const philox_rng& rng, const uint32_t& iteration) {
+  #pragma omp parallel
+  {
+    // sparse basis row and proposal buffer, reused for every row
+    double Xbs_values[bspline_max_degree + 1];
+    arma::rowvec alpha_star(Y.n_cols);
+    arma::rowvec Xbs_row(df);
+    #pragma omp for schedule(static)
+    for (int i=N_obs; i<N; i++) {
+      philox_stream r = rng.stream(iteration, block_X_mh, i);
+      // only row i changes, so propose, evaluate and commit row i alone
+      double X_star = r.normal(X(i), X_tune(i-N_obs));
+      arma::uword Xbs_start = basis.eval(X_star, Xbs_values);
+      bspline_row_product(Xbs_values, Xbs_start, degree, beta, alpha_star);
+      double rss_row_star = accu(square(Y.row(i) - alpha_star));
+      double mh1 = mhX(X_star, mu_X, s2_X, rss_row_star, sigma);
+      double mh2 = mhX(X(i), mu_X, s2_X, rss_row(i), sigma);
+      double mh = exp(mh1 - mh2);
+      if (mh > r.uniform()) {
+        X(i) = X_star;
+        bspline_row_dense(Xbs_values, Xbs_start, degree, Xbs_row);
+        Xbs.row(i) = Xbs_row;
+        alpha.row(i) = alpha_star;
+        rss_row(i) = rss_row_star;
+        X_accept(i-N_obs) += accept_step;
+      }
+    }
+  }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////// MCMC Loop //////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 
+// phases of the chain, each gets its own instantiation of the sampler step
+enum mcmc_phase { phase_adapt, phase_fit };
+
 // [[Rcpp::export]]
 List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params, 
                int n_chain=1, std::string file_name="gam") {
@@ -237,6 +307,10 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
     sample_X_mh = as<bool>(params["sample_X_mh"]);
   }
   
+  // counter-based generator for the parallel X updates, seeded from R's RNG
+  // so set.seed still reproduces the chain
+  philox_rng rng(philox_seed_from_R(), n_chain);
+
   arma::vec X = X_input;
   for (int i=N_obs; i<N; i++) {
     X(i) = R::rnorm(0.0, s_X);
@@ -257,7 +331,8 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
   // observational data
   arma::vec knots = linspace(rangeX(0), rangeX(1), df-degree-1+2);
   knots = knots.subvec(1, df-degree-1);
-  arma::mat Xbs = bs_cpp(X, df, knots, degree, true, rangeX);
+  bspline_basis basis(knots, rangeX, degree, df);
+  arma::mat Xbs = basis.basis(X);
   
   arma::vec count(N);
   for (int i=0; i<N; i++) {
@@ -311,10 +386,15 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
   }
   double sigma = sqrt(sigma2);
   
+  // residual sum of squares cache shared by the beta, sigma2 and X updates
+  arma::vec rss_row(N);
+  arma::vec rss_col(d);
+  rss_update(Y, alpha, N_obs, rss_row, rss_col);
+  
   // setup save variables
   int n_save = n_mcmc / n_thin;
-  arma::cube alpha_save(n_save, N, d, arma::fill::zeros);
-  arma::cube beta_save(n_save, df, d, arma::fill::zeros);
+  sample_store alpha_save(n_save, N, d);
+  sample_store beta_save(n_save, df, d);
   arma::vec sigma2_save(n_save, arma::fill::zeros);
   arma::mat X_save(n_save, N-N_obs, arma::fill::zeros);
   // arma::cube Xbs_save(n_save, N, df, arma::fill::zeros);
@@ -338,69 +418,69 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
   arma::vec X_tune(N-N_obs, arma::fill::ones);
   X_tune *= X_tune_tmp;
   arma::vec X_accept(N-N_obs, arma::fill::zeros);
-  
-  Rprintf("Starting MCMC Adaptive Tuning, running for %d iterations \n", n_adapt);
-  // set up output messages
-  std::ofstream file_out;
-  file_out.open(file_name, std::ios_base::app);
-  file_out << "Starting MCMC adaptation for chain " << n_chain <<
-    ", running for " << n_adapt << " iterations \n";
-  // close output file
-  file_out.close(); 
+  arma::vec X_accept_batch(N-N_obs, arma::fill::zeros);
   
   //
-  // Start MCMC chain
+  // One iteration of the sampler
   //
   
-  //
-  // Adaptive Phase
-  //
+  // The phase is passed as a compile-time constant so the adaptation and
+  // fitting loops each get their own instantiation, with the tuning
+  // bookkeeping compiled out of the fitting phase and the saves compiled out
+  // of the adaptation phase.
   
-  for (int k = 0; k < n_adapt; k++) {
-    if ((k + 1) % message == 0) {
-      Rprintf("Adaptation Iteration %d\n", k+1);
-      // set up output messages
-      std::ofstream file_out;
-      file_out.open(file_name, std::ios_base::app);
-      file_out << "MCMC Adaptive Iteration " << k+1 << " for chain " <<
-        n_chain << "\n";
-      // close output file
-      file_out.close(); 
-    }
+  auto step = [&] (const int& k, auto phase) {
+    const bool adapt = decltype(phase)::value == phase_adapt;
     
-    Rcpp::checkUserInterrupt();
+    // batch acceptance rates while tuning, overall rates while fitting
+    auto record_accept = [&] (double& accept_batch, double& accept) {
+      if (adapt) {
+        accept_batch += 1.0 / 50.0;
+      } else {
+        accept += 1.0 / n_mcmc;
+      }
+    };
     
     //
     // Sample beta - block MH
     //
 
+    // periodically refresh the residual cache so the incremental updates do
+    // not drift
+    if ((k+1) % 50 == 0) {
+      rss_update(Y, alpha, N_obs, rss_row, rss_col);
+    }
+    
     if (sample_beta) {
       for (int j=0; j<d; j++) {
-        arma::mat beta_star = beta;
-        beta_star.col(j) +=
+        // only column j of alpha moves, the likelihood only needs its
+        // residual sum of squares over the observed rows
+        arma::vec beta_star_j = beta.col(j) +
           mvrnormArmaVecChol(zeros_df,
                              lambda_beta_tune(j) * Sigma_beta_tune_chol.slice(j));
-        
-        arma::mat alpha_star = alpha;
-        for (int i=0; i<N; i++) {
-          alpha_star.row(i) = (Xbs.row(i) * beta_star);
-        }
-        arma::vec devs_star = beta_star.col(j) - mu_beta;
+        arma::vec alpha_col_star = Xbs * beta_star_j;
+        arma::vec resid_col_star = Y.col(j) - alpha_col_star;
+        double rss_col_star = accu(square(resid_col_star.subvec(0, N_obs-1)));
+        arma::vec devs_star = beta_star_j - mu_beta;
         arma::vec devs = beta.col(j) - mu_beta;
-        double mh1 = LL(alpha_star, Y, N_obs, sigma, d) -
+        double mh1 = - 0.5 * rss_col_star / sigma2 -
           as_scalar(0.5 * devs_star.t() * Sigma_beta_inv * devs_star);
-        double mh2 = LL(alpha, Y, N_obs, sigma, d) -
+        double mh2 = - 0.5 * rss_col(j) / sigma2 -
           as_scalar(0.5 * devs.t() * Sigma_beta_inv * devs);
         double mh = exp(mh1 - mh2);
         if (mh > R::runif(0, 1.0)) {
-          beta = beta_star;
-          alpha = alpha_star;
-          beta_accept_batch(j) += 1.0 / 50.0;
+          beta.col(j) = beta_star_j;
+          rss_row += square(resid_col_star) - square(Y.col(j) - alpha.col(j));
+          rss_col(j) = rss_col_star;
+          alpha.col(j) = alpha_col_star;
+          record_accept(beta_accept_batch(j), beta_accept(j));
         }
       }
-      beta_batch.subcube(k % 50, 0, 0, k % 50, df-1, d-1) = beta;
       // update tuning
-      if ((k+1) % 50 == 0){
+      if (adapt) {
+        beta_batch.subcube(k % 50, 0, 0, k % 50, df-1, d-1) = beta;
+      }
+      if (adapt && (k+1) % 50 == 0) {
         updateTuningMVMat(k, beta_accept_batch, lambda_beta_tune,
                           beta_batch, Sigma_beta_tune,
                           Sigma_beta_tune_chol);
@@ -415,23 +495,20 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
       double sigma2_star = sigma2 + R::rnorm(0.0, sigma2_tune);
       if (sigma2_star > 0.0) {
         double sigma_star = sqrt(sigma2_star);
-        double mh1 = R::dgamma(sigma2_star, 0.5, 1.0 / lambda_sigma2, 1);
-        double mh2 = R::dgamma(sigma2, 0.5, 1.0 / lambda_sigma2, 1);
-        for (int i=0; i<N; i++) {
-          for (int j=0; j<d; j++) {
-            mh1 += R::dnorm(Y(i, j), alpha(i, j), sigma_star, true);
-            mh2 += R::dnorm(Y(i, j), alpha(i, j), sigma, true);
-          }
-        }
+        double rss = accu(rss_row);
+        double mh1 = R::dgamma(sigma2_star, 0.5, 1.0 / lambda_sigma2, 1) +
+          LL_rss(rss, N * d, sigma_star);
+        double mh2 = R::dgamma(sigma2, 0.5, 1.0 / lambda_sigma2, 1) +
+          LL_rss(rss, N * d, sigma);
         double mh = exp(mh1-mh2);
         if (mh > R::runif(0.0, 1.0)) {
           sigma2 = sigma2_star;
           sigma = sigma_star;
-          sigma2_accept_batch += 1.0 / 50.0;
+          record_accept(sigma2_accept_batch, sigma2_accept);
         }
       }
       // update tuning
-      if ((k+1) % 50 == 0){
+      if (adapt && (k+1) % 50 == 0) {
         updateTuning(k, sigma2_accept_batch, sigma2_tune);
       }
     }
@@ -442,35 +519,24 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
     
     lambda_sigma2 = R::rgamma(1.0, 1.0 / (s2_sigma2 + sigma2));
     
-
-    
     //
     // sample X-MH
     //
     
     if (sample_X) {
       if (sample_X_mh) {
-        for (int i=N_obs; i<N; i++) {
-          arma::vec X_star = X;
-          arma::mat alpha_star = alpha;
-          X_star(i) = R::rnorm(X(i), X_tune(i-N_obs));
-          arma::mat Xbs_star = Xbs;
-          Xbs_star.row(i) = bs_cpp(X_star.row(i), df, knots, degree, true, rangeX);
-          // arma::mat Xbs_star = bs_cpp(X_star, df, knots, degree, true, rangeX);
-          alpha_star.row(i) = (Xbs_star.row(i) * beta);
-          arma::rowvec Y_row = Y.row(i);
-          double mh1 = mhX(X_star(i), mu_X, s2_X, alpha_star.row(i), Y_row, sigma, d);
-          double mh2 = mhX(X(i), mu_X, s2_X, alpha.row(i), Y_row, sigma, d);
-          double mh = exp(mh1 - mh2);
-          if (mh > R::runif(0, 1)) {
-            X = X_star;
-            Xbs = Xbs_star;
-            alpha = alpha_star;
-            X_accept(i-N_obs) += 1.0 / 50.0;
-          }
+        // the counter-based streams are indexed by the overall iteration
+        if (adapt) {
+          update_X_mh(Y, X, Xbs, alpha, rss_row, X_accept_batch, X_tune, beta,
+                      basis, degree, df, mu_X, s2_X, sigma, N_obs, N,
+                      1.0 / 50.0, rng, k);
+        } else {
+          update_X_mh(Y, X, Xbs, alpha, rss_row, X_accept, X_tune, beta,
+                      basis, degree, df, mu_X, s2_X, sigma, N_obs, N,
+                      1.0 / n_mcmc, rng, n_adapt + k);
         }
-        if((k+1) % 50 == 0){
-          updateTuningVec(k, X_accept, X_tune);
+        if (adapt && (k+1) % 50 == 0) {
+          updateTuningVec(k, X_accept_batch, X_tune);
         }
       } else {
         // elliptical slice sampler
@@ -479,15 +545,61 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
           X_prior = R::rnorm(0.0, s_X);
           Rcpp::List X_ess = ess_X(X(i), X_prior, mu_X, beta,
                                    alpha.row(i), Y.row(i), sigma, Xbs.row(i),
-                                   d, knots, df, degree, rangeX, file_name,
-                                   n_chain);
+                                   d, basis, file_name, n_chain);
           X(i) = as<double>(X_ess["X"]);
           Xbs.row(i) = as<rowvec>(X_ess["Xbs"]);
           alpha.row(i) = as<rowvec>(X_ess["alpha"]);
+          rss_row(i) = accu(square(Y.row(i) - alpha.row(i)));
         }
       }
     }
+      
+    //
+    // save variables
+    //
+    
+    if (!adapt && (k + 1) % n_thin == 0) {
+      int save_idx = (k+1)/n_thin-1;
+      alpha_save.save(save_idx, alpha);
+      beta_save.save(save_idx, beta);
+      sigma2_save(save_idx) = sigma2;
+      X_save.submat(save_idx, 0, size(1, N-N_obs))= X(span(N_obs, N-1)).t() + mu_X;
+      // Xbs_save.subcube(save_idx, 0, 0, size(1, N, df)) = Xbs;
+    }
+  };
+  
+  Rprintf("Starting MCMC Adaptive Tuning, running for %d iterations \n", n_adapt);
+  // set up output messages
+  std::ofstream file_out;
+  file_out.open(file_name, std::ios_base::app);
+  file_out << "Starting MCMC adaptation for chain " << n_chain <<
+    ", running for " << n_adapt << " iterations \n";
+  // close output file
+  file_out.close(); 
+  
+  //
+  // Start MCMC chain
+  //
+  
+  //
+  // Adaptive Phase
+  //
+  
+  for (int k = 0; k < n_adapt; k++) {
+    if ((k + 1) % message == 0) {
+      Rprintf("Adaptation Iteration %d\n", k+1);
+      // set up output messages
+      std::ofstream file_out;
+      file_out.open(file_name, std::ios_base::app);
+      file_out << "MCMC Adaptive Iteration " << k+1 << " for chain " <<
+        n_chain << "\n";
+      // close output file
+      file_out.close(); 
+    }
     
+    Rcpp::checkUserInterrupt();
+    
+    step(k, std::integral_constant<int, phase_adapt>());
   }
   
   //
@@ -516,124 +628,7 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
     
     Rcpp::checkUserInterrupt();
     
-    //
-    // Sample beta - block MH
-    //
-    
-    if (sample_beta) {
-      for (int j=0; j<d; j++) {
-        arma::mat beta_star = beta;
-        beta_star.col(j) +=
-          mvrnormArmaVecChol(zeros_df,
-                             lambda_beta_tune(j) * Sigma_beta_tune_chol.slice(j));
-        
-        arma::mat alpha_star = alpha;
-        for (int i=0; i<N; i++) {
-          alpha_star.row(i) = (Xbs.row(i) * beta_star);
-        }
-        arma::vec devs_star = beta_star.col(j) - mu_beta;
-        arma::vec devs = beta.col(j) - mu_beta;
-        double mh1 = LL(alpha_star, Y, N_obs, sigma, d) -
-          as_scalar(0.5 * devs_star.t() * Sigma_beta_inv * devs_star);
-        double mh2 = LL(alpha, Y, N_obs, sigma, d) -
-          as_scalar(0.5 * devs.t() * Sigma_beta_inv * devs);
-        double mh = exp(mh1 - mh2);
-        if (mh > R::runif(0, 1.0)) {
-          beta = beta_star;
-          alpha = alpha_star;
-          beta_accept(j) += 1.0 / n_mcmc;
-        }
-      }
-    }
-    
-    //
-    // sample sigma2
-    //
-    
-    if (sample_sigma2) {
-      double sigma2_star = sigma2 + R::rnorm(0.0, sigma2_tune);
-      if (sigma2_star > 0.0) {
-        double sigma_star = sqrt(sigma2_star);
-        double mh1 = R::dgamma(sigma2_star, 0.5, 1.0 / lambda_sigma2, 1);
-        double mh2 = R::dgamma(sigma2, 0.5, 1.0 / lambda_sigma2, 1);
-        for (int i=0; i<N; i++) {
-          for (int j=0; j<d; j++) {
-            mh1 += R::dnorm(Y(i, j), alpha(i, j), sigma_star, true);
-            mh2 += R::dnorm(Y(i, j), alpha(i, j), sigma, true);
-          }
-        }
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          sigma2 = sigma2_star;
-          sigma = sigma_star;
-          sigma2_accept += 1.0 / n_mcmc;
-        }
-      }
-    }
-    
-    //
-    // sample lambda_sigma2
-    //
-    
-    lambda_sigma2 = R::rgamma(1.0, 1.0 / (s2_sigma2 + sigma2));
-    
-    // //
-    // // sample X - ESS
-    // //
-    // 
-  
-    
-    if (sample_X) {
-      if (sample_X_mh) {
-        for (int i=N_obs; i<N; i++) {
-          arma::vec X_star = X;
-          arma::mat alpha_star = alpha;
-          X_star(i) = R::rnorm(X(i), X_tune(i-N_obs));
-          arma::mat Xbs_star = Xbs;
-          Xbs_star.row(i) = bs_cpp(X_star.row(i), df, knots, degree, true, rangeX);
-          // arma::mat Xbs_star = bs_cpp(X_star, df, knots, degree, true, rangeX);
-          alpha_star.row(i) = (Xbs_star.row(i) * beta);
-          arma::rowvec Y_row = Y.row(i);
-          double mh1 = mhX(X_star(i), mu_X, s2_X, alpha_star.row(i), Y_row, sigma, d);
-          double mh2 = mhX(X(i), mu_X, s2_X, alpha.row(i), Y_row, sigma, d);
-          double mh = exp(mh1 - mh2);
-          if (mh > R::runif(0, 1)) {
-            X = X_star;
-            Xbs = Xbs_star;
-            alpha = alpha_star;
-            X_accept(i-N_obs) += 1.0 / n_mcmc;
-          }
-        }
-        if((k+1) % 50 == 0){
-          updateTuningVec(k, X_accept, X_tune);
-        }
-      } else {
-        for (int i=N_obs; i<N; i++) {
-          double X_prior = X(i);
-          X_prior = R::rnorm(0.0, s_X);
-          Rcpp::List X_ess = ess_X(X(i), X_prior, mu_X, beta,
-                                   alpha.row(i), Y.row(i), sigma, Xbs.row(i),
-                                   d, knots, df, degree, rangeX, file_name,
-                                   n_chain);
-          X(i) = as<double>(X_ess["X"]);
-          Xbs.row(i) = as<rowvec>(X_ess["Xbs"]);
-          alpha.row(i) = as<rowvec>(X_ess["alpha"]);
-        }
-      }
-    }
-      
-    //
-    // save variables
-    //
-    
-    if ((k + 1) % n_thin == 0) {
-      int save_idx = (k+1)/n_thin-1;
-      alpha_save(save_idx, 0, 0, size(1, N, d)) = alpha;
-      beta_save(save_idx, 0, 0, size(1, df, d)) = beta;
-      sigma2_save(save_idx) = sigma2;
-      X_save.submat(save_idx, 0, size(1, N-N_obs))= X(span(N_obs, N-1)).t() + mu_X;
-      // Xbs_save.subcube(save_idx, 0, 0, size(1, N, df)) = Xbs;
-    }
+    step(k, std::integral_constant<int, phase_fit>());
   }
   
   // print accpetance rates
@@ -651,8 +646,8 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
   file_out.close(); 
   
   return Rcpp::List::create(
-    _["alpha"] = alpha_save,
-    _["beta"] = beta_save,
+    _["alpha"] = alpha_save.output(),
+    _["beta"] = beta_save.output(),
     // _["Xbs"] = Xbs_save,
     _["sigma2"] = sigma2_save,
     _["knots"] = knots,
@@ -2,7 +2,11 @@
 #include <RcppArmadillo.h>
 // // [[Rcpp::depends(RcppArmadillo)]]
 // [[Rcpp::depends(RcppArmadillo, myFunctions)]]
+// [[Rcpp::plugins(cpp14)]]
 #include "myFunctionsHeader.h"
+#include "correlation-functions.h"
+#include "sample-store.h"
+#include <type_traits>
 
 using namespace Rcpp;
 using namespace arma;
@@ -124,7 +128,7 @@ Rcpp::List ess_eta_star (const arma::mat& eta_star_current,
 ///////////// Elliptical Slice Sampler for unobserved covariate X /////////////
 ///////////////////////////////////////////////////////////////////////////////
 
-// [[Rcpp::export]]
+template <typename corr>
 Rcpp::List ess_X (const double& X_current, const double& X_prior,
                   const double& mu_X, const arma::vec& X_knots,
                   const arma::rowvec& y_current,
@@ -137,8 +141,7 @@ Rcpp::List ess_X (const double& X_current, const double& X_prior,
                   const arma::rowvec& Z_current, const double& phi_current,
                   const double& sigma_current, const arma::mat C_inv_current,
                   const int& N_obs, const int& N, const int& d,
-                  const std::string& file_name, const int& n_chain, 
-                  const std::string& corr_function) {
+                  const std::string& file_name, const int& n_chain) {
   // eta_star_current is the current value of the joint multivariate predictive process
   // prior_sample is a sample from the prior joing multivariate predictive process
   // R_tau is the current value of the Cholskey decomposition for  predictive process linear interpolator
@@ -172,11 +175,8 @@ Rcpp::List ess_X (const double& X_current, const double& X_prior,
     // compute proposal for angle difference and check to see if it is on the slice
     double X_proposal = X_current * cos(phi_angle) + X_prior * sin(phi_angle);
     double X_tilde = X_proposal + mu_X;
-    arma::rowvec D_proposal = sqrt(pow(X_tilde - X_knots, 2)).t();
-    if (corr_function == "gaussian") {
-      D_proposal = pow(D_proposal, 2.0);
-    }
-    arma::rowvec c_proposal = exp( - D_proposal / phi_current);
+    arma::rowvec D_proposal = abs(X_tilde - X_knots).t();
+    arma::rowvec c_proposal = corr_matrix<corr>(D_proposal, phi_current);
     arma::rowvec Z_proposal = c_proposal * C_inv_current;
     arma::rowvec zeta_proposal = Z_proposal * eta_star_current * R_tau_current;
     
@@ -218,11 +218,12 @@ Rcpp::List ess_X (const double& X_current, const double& X_prior,
       _["zeta"] = zeta_ess));
 }
 
-// [[Rcpp::export]]
-List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
-               bool pool_s2_tau2=true, int n_chain=1, 
-               std::string file_name="sim-fit", 
-               std::string corr_function="exponential") {
+// phases of the chain, each gets its own instantiation of the sampler step
+enum mcmc_phase { phase_warmup, phase_adapt, phase_fit };
+
+template <typename corr>
+List mcmc_corr (const arma::mat& Y, const arma::vec& X_input, List params,
+                bool pool_s2_tau2, int n_chain, std::string file_name) {
   // arma::mat& R, arma::vec& tau2, double& phi, double& sigma2,
   // arma::mat& eta_star,  
   
@@ -362,12 +363,6 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
   }
   arma::mat D = makeDistARMA(X, X_knots);
   arma::mat D_knots = makeDistARMA(X_knots, X_knots);  
-  if (corr_function == "gaussian") {
-    D = pow(D, 2.0);
-    D_knots = pow(D_knots, 2.0);
-  } else if (corr_function != "exponential") {
-    stop ("the only valid correlation functions are exponential and gaussian");
-  }
   
   //
   // initialize values
@@ -450,10 +445,10 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
   // Construct Gaussian Process Correlation matrices
   //
   
-  arma::mat C = exp(- D_knots / phi);
+  arma::mat C = corr_matrix<corr>(D_knots, phi);
   arma::mat C_chol = chol(C);
   arma::mat C_inv = inv_sympd(C);
-  arma::mat c = exp( - D / phi);
+  arma::mat c = corr_matrix<corr>(D, phi);
   arma::mat Z = c * C_inv;
   
   // Initialize constant vectors
@@ -515,15 +510,15 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
   // setup save variables
   int n_save = n_mcmc / n_thin;
   arma::mat mu_save(n_save, d, arma::fill::zeros);
-  arma::cube zeta_save(n_save, N, d, arma::fill::zeros);
-  arma::cube eta_star_save(n_save, N_knots, d, arma::fill::zeros);
-  arma::cube Omega_save(n_save, d, d, arma::fill::zeros);
-  arma::cube C_save(n_save, N_knots, N_knots, arma::fill::zeros);
-  arma::cube c_save(n_save, N, N_knots, arma::fill::zeros);
-  arma::cube C_inv_save(n_save, N_knots, N_knots, arma::fill::zeros);
-  arma::cube Z_save(n_save, N, N_knots, arma::fill::zeros);
-  arma::cube R_save(n_save, d, d, arma::fill::zeros);
-  arma::cube R_tau_save(n_save, d, d, arma::fill::zeros);
+  sample_store zeta_save(n_save, N, d);
+  sample_store eta_star_save(n_save, N_knots, d);
+  sample_store Omega_save(n_save, d, d);
+  sample_store C_save(n_save, N_knots, N_knots);
+  sample_store c_save(n_save, N, N_knots);
+  sample_store C_inv_save(n_save, N_knots, N_knots);
+  sample_store Z_save(n_save, N, N_knots);
+  sample_store R_save(n_save, d, d);
+  sample_store R_tau_save(n_save, d, d);
   arma::vec sigma2_save(n_save, arma::fill::zeros);
   arma::mat tau2_save(n_save, d, arma::fill::zeros);
   // arma::mat lambda_tau2_save(n_save, d, arma::fill::zeros);
@@ -583,32 +578,28 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
   // Rcout << "zeta = "<< zeta << "\n";
   
   
-  // Start warmup to avoid getting stuck in ESS sampler
+  //
+  // One iteration of the sampler
+  //
   
-  Rprintf("Starting MCMC warmup for chain %d, running for %d iterations \n", 
-          n_chain, n_warmup);
-  // set up output messages
-  std::ofstream file_out;
-  file_out.open(file_name, std::ios_base::app);
-  file_out << "Starting MCMC warmup for chain " << n_chain <<
-    ", running for " << n_warmup << " iterations \n";
-  // close output file
-  file_out.close(); 
+  // The phase is passed as a compile-time constant so each of the warmup,
+  // adaptation and fitting loops gets its own instantiation, with the
+  // tuning bookkeeping compiled out of the fitting phase and the saves
+  // compiled out of the others. Warmup always uses the Metropolis-Hastings
+  // updates for eta_star and X to avoid getting stuck in the ESS sampler.
   
-  // Initial warmup stage
-  for (int k=0; k<n_warmup; k++) {
-    if ((k+1) % message == 0) {
-      Rprintf("MCMC warmup Iteration %d \n", k+1);
-      // set up output messages
-      std::ofstream file_out;
-      file_out.open(file_name, std::ios_base::app);
-      file_out << "MCMC warmup Iteration " << k+1 << " for chain " <<
-        n_chain << "\n";
-      // close output file
-      file_out.close(); 
-    }
-    
-    Rcpp::checkUserInterrupt();
+  auto step = [&] (const int& k, auto phase) {
+    const bool warmup = decltype(phase)::value == phase_warmup;
+    const bool adapt = decltype(phase)::value != phase_fit;
+    
+    // batch acceptance rates while tuning, overall rates while fitting
+    auto record_accept = [&] (double& accept_batch, double& accept) {
+      if (adapt) {
+        accept_batch += 1.0 / 50.0;
+      } else {
+        accept += 1.0 / n_mcmc;
+      }
+    };
     
     //
     // sample mu 
@@ -632,11 +623,13 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
         if (mh > R::runif(0.0, 1.0)) {
           mu = mu_star;
           mu_mat = mu_mat_star;
-          mu_accept_batch += 1.0 / 50;
+          record_accept(mu_accept_batch, mu_accept);
+        }
+        if (adapt) {
+          mu_batch.row(k % 50) = mu.t();
         }
-        mu_batch.row(k % 50) = mu.t();
         // update tuning
-        if ((k+1) % 50 == 0){
+        if (adapt && (k+1) % 50 == 0) {
           updateTuningMV(k, mu_accept_batch, lambda_mu_tune, mu_batch,
                          Sigma_mu_tune, Sigma_mu_tune_chol);    
         }
@@ -658,10 +651,10 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
     if (sample_phi) {
       double phi_star = phi + R::rnorm(0.0, phi_tune);
       if (phi_star > phi_L && phi_star < phi_U) {
-        arma::mat C_star = exp(- D_knots / phi_star);
+        arma::mat C_star = corr_matrix<corr>(D_knots, phi_star);
         arma::mat C_chol_star = chol(C_star);
         arma::mat C_inv_star = inv_sympd(C_star);
-        arma::mat c_star = exp(- D / phi_star);
+        arma::mat c_star = corr_matrix<corr>(D, phi_star);
         arma::mat Z_star = c_star * C_inv_star;
         arma::mat zeta_star = Z_star * eta_star * R_tau;
         double mh1 = 0.0 -  // uniform prior
@@ -681,21 +674,21 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
           c = c_star;
           Z = Z_star;
           zeta = zeta_star;
-          phi_accept_batch += 1.0 / 50.0;
+          record_accept(phi_accept_batch, phi_accept);
         }
       }
       // update tuning
-      if ((k+1) % 50 == 0){
+      if (adapt && (k+1) % 50 == 0) {
         updateTuning(k, phi_accept_batch, phi_tune);
       }
     }
     
     //
-    // sample eta_star - MH
+    // sample eta_star
     //
     
     if (sample_eta_star) {
-      // if (sample_eta_star_mh) {
+      if (warmup || sample_eta_star_mh) {
         for (int j=0; j<d; j++) {
           arma::mat eta_star_star = eta_star;
           eta_star_star.col(j) +=
@@ -710,29 +703,31 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
           if (mh > R::runif(0.0, 1.0)) {
             eta_star = eta_star_star;
             zeta = zeta_star;
-            eta_star_accept_batch(j) += 1.0 / 50;
+            record_accept(eta_star_accept_batch(j), eta_star_accept(j));
           }
         }
         // update tuning
-        eta_star_batch.subcube(k % 50, 0, 0, k % 50, N_knots-1, d-1) = eta_star;
+        if (adapt) {
+          eta_star_batch.subcube(k % 50, 0, 0, k % 50, N_knots-1, d-1) = eta_star;
+        }
         // update tuning
-        if ((k+1) % 50 == 0){
+        if (adapt && (k+1) % 50 == 0) {
           updateTuningMVMat(k, eta_star_accept_batch, lambda_eta_star_tune,
                             eta_star_batch, Sigma_eta_star_tune,
                             Sigma_eta_star_tune_chol);
         }
-      // } else {
-      //   // elliptical slice sampler
-      //   for (int j=0; j<d; j++) {
-      //     arma::vec eta_star_prior = mvrnormArmaVecChol(zero_knots, C_chol);
-      //     Rcpp::List ess_eta_star_out = ess_eta_star(eta_star,  eta_star_prior, 
-      //                                                Y, mu_mat, zeta, R_tau, Z, 
-      //                                                sigma2, N_obs, N, d, j, 
-      //                                                file_name, n_chain);
-      //     eta_star = as<mat>(ess_eta_star_out["eta_star"]);
-      //     zeta = as<mat>(ess_eta_star_out["zeta"]);
-      //   }
-      // } 
+      } else {
+        // elliptical slice sampler
+        for (int j=0; j<d; j++) {
+          arma::vec eta_star_prior = mvrnormArmaVecChol(zero_knots, C_chol);
+          Rcpp::List ess_eta_star_out = ess_eta_star(eta_star,  eta_star_prior, 
+                                                     Y, mu_mat, zeta, R_tau, Z, 
+                                                     sigma2, N_obs, N, d, j, 
+                                                     file_name, n_chain);
+          eta_star = as<mat>(ess_eta_star_out["eta_star"]);
+          zeta = as<mat>(ess_eta_star_out["zeta"]);
+        }
+      } 
     }
     
     //
@@ -753,11 +748,11 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
         if (mh > R::runif(0.0, 1.0)) {
           sigma2 = sigma2_star;
           sigma = sigma_star;
-          sigma2_accept_batch += 1.0 / 50.0;
+          record_accept(sigma2_accept_batch, sigma2_accept);
         }
       }
       // update tuning
-      if ((k+1) % 50 == 0){
+      if (adapt && (k+1) % 50 == 0) {
         updateTuning(k, sigma2_accept_batch, sigma2_tune);
       }
     }
@@ -796,13 +791,15 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
           tau = tau_star;
           R_tau = R_tau_star;
           zeta = zeta_star;
-          tau2_accept_batch += 1.0 / 50.0;
+          record_accept(tau2_accept_batch, tau2_accept);
         }
       }
       
-      tau2_batch.row(k % 50) = log(tau2).t();
+      if (adapt) {
+        tau2_batch.row(k % 50) = log(tau2).t();
+      }
       // update tuning
-      if ((k+1) % 50 == 0){
+      if (adapt && (k+1) % 50 == 0) {
         updateTuningMV(k, tau2_accept_batch, lambda_tau2_tune, tau2_batch,
                        Sigma_tau2_tune, Sigma_tau2_tune_chol);
       }    
@@ -811,15 +808,15 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
     //
     // sample lambda_tau2
     //
-    
+
     for (int j=0; j<d; j++) {
       lambda_tau2(j) = R::rgamma(1.0, 1.0 / (s2_tau2 + tau2(j)));
     }
-    
+
     //
     // sample s2_tau2
     //
-    
+
     if (pool_s2_tau2) {
       double s2_tau2_star = s2_tau2 + R::rnorm(0.0, s2_tau2_tune);
       if (s2_tau2_star > 0.0 && s2_tau2_star < A_s2) {
@@ -832,12 +829,12 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
         double mh = exp(mh1-mh2);
         if (mh > R::runif(0.0, 1.0)) {
           s2_tau2 = s2_tau2_star;
-          s2_tau2_accept_batch += 1.0 / 50.0;
+          record_accept(s2_tau2_accept_batch, s2_tau2_accept);
         }
       }
     }
     // update tuning
-    if ((k+1) % 50 == 0){
+    if (adapt && (k+1) % 50 == 0) {
       updateTuning(k, s2_tau2_accept_batch, s2_tau2_tune);
     }
     
@@ -875,15 +872,17 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
           R_tau = R_tau_star;
           log_jacobian = log_jacobian_star;
           zeta = zeta_star;
-          xi_accept_batch += 1.0 / 50.0;
+          record_accept(xi_accept_batch, xi_accept);
         }
       }
       
       // xi_batch.row(k % 50) = xi.t();
-      xi_batch.row(k % 50) = logit(xi_tilde).t();
+      if (adapt) {
+        xi_batch.row(k % 50) = logit(xi_tilde).t();
+      }
       
       // update tuning
-      if ((k+1) % 50 == 0){
+      if (adapt && (k+1) % 50 == 0) {
         updateTuningMV(k, xi_accept_batch, lambda_xi_tune, xi_batch,
                        Sigma_xi_tune, Sigma_xi_tune_chol);
       }
@@ -894,18 +893,15 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
     //
     
     if (sample_X) {
-      // if (sample_X_mh) {
+      if (warmup || sample_X_mh) {
         // sample using Metropolis-Hastings
         for (int i=N_obs; i<N; i++) {
           arma::vec X_star = X;
           X_star(i) += R::rnorm(0.0, X_tune(i-N_obs));
           // add in prior mean here
-          arma::rowvec D_proposal = sqrt(pow(X_star(i) + mu_X - X_knots, 2)).t();
-          if (corr_function == "gaussian") {
-            D_proposal = pow(D_proposal, 2.0);
-          } 
+          arma::rowvec D_proposal = abs(X_star(i) + mu_X - X_knots).t();
           // arma::rowvec D_proposal = sqrt(pow(X_star(i) - X_knots, 2)).t();
-          arma::rowvec c_proposal = exp( - D_proposal / phi);
+          arma::rowvec c_proposal = corr_matrix<corr>(D_proposal, phi);
           arma::rowvec Z_proposal = c_proposal * C_inv;
           arma::rowvec zeta_proposal = Z_proposal * eta_star * R_tau;
           double mh1 = R::dnorm(X_star(i), 0.0, s_X, true);
@@ -923,36 +919,87 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
             c.row(i) = c_proposal;
             Z.row(i) = Z_proposal;
             zeta.row(i) = zeta_proposal;
-            X_accept_batch(i-N_obs) += 1.0 / 50.0;
+            record_accept(X_accept_batch(i-N_obs), X_accept(i-N_obs));
           }
         }
         // update tuning
-        if ((k+1) % 50 == 0){
+        if (adapt && (k+1) % 50 == 0) {
           updateTuningVec(k, X_accept_batch, X_tune);
         }
-      // } else {
-      //   // sample using ESS
-      //   for (int i=N_obs; i<N; i++) {
-      //     double X_prior = R::rnorm(0.0, s_X);
-      //     Rcpp::List ess_out = ess_X(X(i), X_prior, mu_X, X_knots, Y.row(i),
-      //                                mu, eta_star, zeta.row(i), D.row(i), c.row(i),
-      //                                R_tau, Z.row(i), phi, sigma,
-      //                                C_inv, N_obs, N, d, file_name, n_chain,
-      //                                corr_function);
-      //     X(i) = as<double>(ess_out["X"]);
-      //     D.row(i) = as<rowvec>(ess_out["D"]);
-      //     c.row(i) = as<rowvec>(ess_out["c"]);
-      //     Z.row(i) = as<rowvec>(ess_out["Z"]);
-      //     zeta.row(i) = as<rowvec>(ess_out["zeta"]);
-      //   }
-      // }
+      } else {
+        // sample using ESS
+        for (int i=N_obs; i<N; i++) {
+          double X_prior = R::rnorm(0.0, s_X);
+          Rcpp::List ess_out = ess_X<corr>(X(i), X_prior, mu_X, X_knots, Y.row(i),
+                                     mu, eta_star, zeta.row(i), D.row(i), c.row(i),
+                                     R_tau, Z.row(i), phi, sigma,
+                                     C_inv, N_obs, N, d, file_name, n_chain);
+          X(i) = as<double>(ess_out["X"]);
+          D.row(i) = as<rowvec>(ess_out["D"]);
+          c.row(i) = as<rowvec>(ess_out["c"]);
+          Z.row(i) = as<rowvec>(ess_out["Z"]);
+          zeta.row(i) = as<rowvec>(ess_out["zeta"]);
+        }
+      }
     }
     
-  }
-  // end intial warmup stage
+    //
+    // save variables
+    //
+    
+    if (!adapt && (k + 1) % n_thin == 0) {
+      int save_idx = (k+1)/n_thin-1;
+      mu_save.row(save_idx) = mu.t();
+      eta_star_save.save(save_idx, eta_star);
+      zeta_save.save(save_idx, zeta);
+      Omega_save.save(save_idx, R.t() * R);
+      phi_save(save_idx) = phi;
+      sigma2_save(save_idx) = sigma2;
+      tau2_save.row(save_idx) = tau2.t();
+      // lambda_tau2_save.row(save_idx) = lambda_tau2.t();
+      // s2_tau2_save(save_idx) = s2_tau2;
+      c_save.save(save_idx, c);
+      C_save.save(save_idx, C);
+      C_inv_save.save(save_idx, C_inv);
+      Z_save.save(save_idx, Z);
+      R_save.save(save_idx, R);
+      R_tau_save.save(save_idx, R_tau);
+      X_save.row(save_idx) = X.subvec(span(N_obs, N-1)).t() + mu_X;
+      xi_save.row(save_idx) = xi.t();  
+    }
+  };
+  
+  // set up output messages
+  std::ofstream file_out;
   
+  // Start warmup to avoid getting stuck in ESS sampler
+  Rprintf("Starting MCMC warmup for chain %d, running for %d iterations \n", 
+          n_chain, n_warmup);
+  // set up output messages
+  file_out.open(file_name, std::ios_base::app);
+  file_out << "Starting MCMC warmup for chain " << n_chain <<
+    ", running for " << n_warmup << " iterations \n";
+  // close output file
+  file_out.close(); 
   
+  for (int k=0; k<n_warmup; k++) {
+    if ((k+1) % message == 0) {
+      Rprintf("MCMC warmup Iteration %d \n", k+1);
+      // set up output messages
+      std::ofstream file_out;
+      file_out.open(file_name, std::ios_base::app);
+      file_out << "MCMC warmup Iteration " << k+1 << " for chain " <<
+        n_chain << "\n";
+      // close output file
+      file_out.close(); 
+    }
+    
+    Rcpp::checkUserInterrupt();
+    
+    step(k, std::integral_constant<int, phase_warmup>());
+  }
   
+  // Start MCMC chain
   Rprintf("Starting MCMC adaptation for chain %d, running for %d iterations \n", 
           n_chain, n_adapt);
   // set up output messages
@@ -962,7 +1009,6 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
   // close output file
   file_out.close(); 
   
-  // Start MCMC chain
   for (int k=0; k<n_adapt; k++) {
     if ((k+1) % message == 0) {
       Rprintf("MCMC Adaptive Iteration %d \n", k+1);
@@ -977,705 +1023,43 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
     
     Rcpp::checkUserInterrupt();
     
-    //
-    // sample mu 
-    //
-    
-    if (sample_mu) {
-      if (sample_mu_mh) {
-        // sample using MH
-        arma::vec mu_star = mvrnormArmaVecChol(mu, lambda_mu_tune * Sigma_mu_tune_chol);
-        arma::mat mu_mat_star(N, d);
-        for (int i=0; i<N; i++) {
-          mu_mat_star.row(i) = mu_star.t();
-        }
-        double mh1 = - 0.5 * as_scalar(accu(pow(Y - mu_mat_star - zeta, 2)) / sigma2);
-        double mh2 = - 0.5 * as_scalar(accu(pow(Y - mu_mat - zeta, 2)) / sigma2);
-        for (int j=0; j<d; j++) {
-          mh1 += R::dnorm(mu_star(j), mu_mu, s_mu, true);
-          mh2 += R::dnorm(mu(j), mu_mu, s_mu, true);
-        }
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          mu = mu_star;
-          mu_mat = mu_mat_star;
-          mu_accept_batch += 1.0 / 50;
-        }
-        mu_batch.row(k % 50) = mu.t();
-        // update tuning
-        if ((k+1) % 50 == 0){
-          updateTuningMV(k, mu_accept_batch, lambda_mu_tune, mu_batch,
-                         Sigma_mu_tune, Sigma_mu_tune_chol);    
-        }
-      } else {
-        // sample mu using Gibbs
-        arma::mat A = N * I_d / sigma2 + I_d / s2_mu;
-        arma::vec b = colSums(Y - zeta) / sigma2 + mu_mu * ones_d / s2_mu;
-        mu = rMVNArma(A, b);
-        for (int i=0; i<N; i++) {
-          mu_mat.row(i) = mu.t();
-        }
-      }
-    }
-    
-    //
-    // sample phi
-    //
-    
-    if (sample_phi) {
-      double phi_star = phi + R::rnorm(0.0, phi_tune);
-      if (phi_star > phi_L && phi_star < phi_U) {
-        arma::mat C_star = exp(- D_knots / phi_star);
-        arma::mat C_chol_star = chol(C_star);
-        arma::mat C_inv_star = inv_sympd(C_star);
-        arma::mat c_star = exp(- D / phi_star);
-        arma::mat Z_star = c_star * C_inv_star;
-        arma::mat zeta_star = Z_star * eta_star * R_tau;
-        double mh1 = 0.0 -  // uniform prior
-          0.5 * as_scalar(accu(pow(Y - mu_mat - zeta_star, 2)) / sigma2);
-        double mh2 = 0.0 -  // uniform prior
-          0.5 * as_scalar(accu(pow(Y - mu_mat - zeta, 2)) / sigma2);
-        for (int j=0; j<d; j++) {
-          mh1 += dMVNChol(eta_star.col(j), zero_knots, C_chol_star, true);
-          mh2 += dMVNChol(eta_star.col(j), zero_knots, C_chol, true);
-        }
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          phi = phi_star;
-          C = C_star;
-          C_chol = C_chol_star;
-          C_inv = C_inv_star;
-          c = c_star;
-          Z = Z_star;
-          zeta = zeta_star;
-          phi_accept_batch += 1.0 / 50.0;
-        }
-      }
-      // update tuning
-      if ((k+1) % 50 == 0){
-        updateTuning(k, phi_accept_batch, phi_tune);
-      }
+    step(k, std::integral_constant<int, phase_adapt>());
+  }
+  
+  // Start MCMC fitting phase
+  Rprintf("Starting MCMC fit for chain %d, running for %d iterations \n", 
+          n_chain, n_mcmc);
+  // set up output messages
+  file_out.open(file_name, std::ios_base::app);
+  file_out << "Starting MCMC fit for chain " << n_chain <<
+    ", running for " << n_mcmc << " iterations \n";
+  // close output file
+  file_out.close(); 
+  
+  for (int k=0; k<n_mcmc; k++) {
+    if ((k+1) % message == 0) {
+      Rprintf("MCMC Fitting Iteration %d \n", k+1);
+      // set up output messages
+      std::ofstream file_out;
+      file_out.open(file_name, std::ios_base::app);
+      file_out << "MCMC Fitting Iteration " << k+1 << " for chain " <<
+        n_chain << "\n";
+      // close output file
+      file_out.close(); 
     }
     
-    //
-    // sample eta_star - MH
-    //
+    Rcpp::checkUserInterrupt();
     
-    if (sample_eta_star) {
-      if (sample_eta_star_mh) {
-        for (int j=0; j<d; j++) {
-          arma::mat eta_star_star = eta_star;
-          eta_star_star.col(j) +=
-            mvrnormArmaVecChol(zero_knots,
-                               lambda_eta_star_tune(j) * Sigma_eta_star_tune_chol.slice(j));
-          arma::mat zeta_star = Z * eta_star_star * R_tau;
-          double mh1 = dMVNChol(eta_star_star.col(j), zero_knots, C_chol, true) -
-            0.5 * as_scalar(accu(pow(Y - mu_mat - zeta_star, 2.0)) / sigma2);
-          double mh2 = dMVNChol(eta_star.col(j), zero_knots, C_chol, true) -
-            0.5 * as_scalar(accu(pow(Y - mu_mat - zeta, 2.0)) / sigma2);
-          double mh = exp(mh1-mh2);
-          if (mh > R::runif(0.0, 1.0)) {
-            eta_star = eta_star_star;
-            zeta = zeta_star;
-            eta_star_accept_batch(j) += 1.0 / 50;
-          }
-        }
-        // update tuning
-        eta_star_batch.subcube(k % 50, 0, 0, k % 50, N_knots-1, d-1) = eta_star;
-        // update tuning
-        if ((k+1) % 50 == 0){
-          updateTuningMVMat(k, eta_star_accept_batch, lambda_eta_star_tune,
-                            eta_star_batch, Sigma_eta_star_tune,
-                            Sigma_eta_star_tune_chol);
-        }
-      } else {
-        // elliptical slice sampler
-        for (int j=0; j<d; j++) {
-          arma::vec eta_star_prior = mvrnormArmaVecChol(zero_knots, C_chol);
-          Rcpp::List ess_eta_star_out = ess_eta_star(eta_star,  eta_star_prior, 
-                                                     Y, mu_mat, zeta, R_tau, Z, 
-                                                     sigma2, N_obs, N, d, j, 
-                                                     file_name, n_chain);
-          eta_star = as<mat>(ess_eta_star_out["eta_star"]);
-          zeta = as<mat>(ess_eta_star_out["zeta"]);
-        }
-      } 
-    }
-    
-    //
-    // sample sigma2
-    //
-    
-    if (sample_sigma2) {
-      double sigma2_star = sigma2 + R::rnorm(0.0, sigma2_tune);
-      if (sigma2_star > 0.0) {
-        double sigma_star = sqrt(sigma2_star);
-        double mh1 = R::dgamma(sigma2_star, 0.5, 1.0 / lambda_sigma2, true);
-        double mh2 = R::dgamma(sigma2, 0.5, 1.0 / lambda_sigma2, true);
-        mh1 += - N * d * log(sigma_star) -
-          0.5 * as_scalar(accu(pow(Y - mu_mat - zeta, 2)) / sigma2_star);
-        mh2 += - N * d * log(sigma) -
-          0.5 * as_scalar(accu(pow(Y - mu_mat - zeta, 2)) / sigma2);
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          sigma2 = sigma2_star;
-          sigma = sigma_star;
-          sigma2_accept_batch += 1.0 / 50.0;
-        }
-      }
-      // update tuning
-      if ((k+1) % 50 == 0){
-        updateTuning(k, sigma2_accept_batch, sigma2_tune);
-      }
-    }
-    
-    //
-    // sample lambda_sigma2
-    //
-    
-    lambda_sigma2 = R::rgamma(1.0, 1.0 / (s2_sigma2 + sigma2));
-    
-    //
-    // sample tau2
-    //
-    
-    if (sample_tau2) {
-      arma::vec log_tau2_star = mvrnormArmaVecChol(log(tau2),
-                                                   lambda_tau2_tune * Sigma_tau2_tune_chol);
-      arma::vec tau2_star = exp(log_tau2_star);
-      if (all(tau2_star > 0.0)) {
-        arma::vec tau_star = sqrt(tau2_star);
-        arma::mat R_tau_star = R * diagmat(tau_star);
-        arma::mat zeta_star = Z * eta_star * R_tau_star;
-        double mh1 = - 0.5 * as_scalar(accu(pow(Y - mu_mat - zeta_star, 2)) / sigma2) + 
-          sum(log_tau2_star);
-        double mh2 = - 0.5 * as_scalar(accu(pow(Y - mu_mat - zeta, 2)) / sigma2) + 
-          sum(log(tau2));
-        for (int j=0; j<d; j++) {
-          mh1 += d_half_cauchy(tau2_star(j), s2_tau2, true);
-          mh2 += d_half_cauchy(tau2(j), s2_tau2, true);
-          // mh1 += R::dgamma(tau2_star(j), 0.5, 1.0 / lambda_tau2(j), true);
-          // mh2 += R::dgamma(tau2(j), 0.5, 1.0 / lambda_tau2(j), true);
-        }
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          tau2 = tau2_star;
-          tau = tau_star;
-          R_tau = R_tau_star;
-          zeta = zeta_star;
-          tau2_accept_batch += 1.0 / 50.0;
-        }
-      }
-      
-      tau2_batch.row(k % 50) = log(tau2).t();
-      // update tuning
-      if ((k+1) % 50 == 0){
-        updateTuningMV(k, tau2_accept_batch, lambda_tau2_tune, tau2_batch,
-                       Sigma_tau2_tune, Sigma_tau2_tune_chol);
-      }    
-    }
-    
-    //
-    // sample lambda_tau2
-    //
-
-    for (int j=0; j<d; j++) {
-      lambda_tau2(j) = R::rgamma(1.0, 1.0 / (s2_tau2 + tau2(j)));
-    }
-
-    //
-    // sample s2_tau2
-    //
-
-    if (pool_s2_tau2) {
-      double s2_tau2_star = s2_tau2 + R::rnorm(0.0, s2_tau2_tune);
-      if (s2_tau2_star > 0.0 && s2_tau2_star < A_s2) {
-        double mh1 = 0.0;
-        double mh2 = 0.0;
-        for (int j=0; j<d; j++){
-          mh1 += R::dgamma(lambda_tau2(j), 0.5, 1.0 / s2_tau2_star, true);
-          mh2 += R::dgamma(lambda_tau2(j), 0.5, 1.0 / s2_tau2, true);
-        }
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          s2_tau2 = s2_tau2_star;
-          s2_tau2_accept_batch += 1.0 / 50.0;
-        }
-      }
-    }
-    // update tuning
-    if ((k+1) % 50 == 0){
-      updateTuning(k, s2_tau2_accept_batch, s2_tau2_tune);
-    }
-    
-    //
-    // sample xi - MH
-    //
-    
-    if (sample_xi) {
-      arma::vec logit_xi_tilde_star = mvrnormArmaVecChol(logit(xi_tilde),
-                                                         lambda_xi_tune * Sigma_xi_tune_chol);
-      arma::vec xi_tilde_star = expit(logit_xi_tilde_star);
-      arma::vec xi_star = 2.0 * xi_tilde_star - 1.0;
-      // arma::vec xi_star =  mvrnormArmaVecChol(xi, lambda_xi_tune * Sigma_xi_tune_chol);
-      if (all(xi_star > -1.0) && all(xi_star < 1.0)) {
-        Rcpp::List R_out = makeRLKJ(xi_star, d, true, true);
-        arma::mat R_star = as<mat>(R_out["R"]);
-        arma::mat R_tau_star = R_star * diagmat(tau);
-        arma::mat zeta_star = Z * eta_star * R_tau_star;
-        double log_jacobian_star = as<double>(R_out["log_jacobian"]);
-        double mh1 = - 0.5 * as_scalar(accu(pow(Y - mu_mat - zeta_star, 2)) / sigma2) + 
-          // Jacobian adjustment
-          sum(log(xi_tilde_star) + log(ones_B - xi_tilde_star));
-        double mh2 = - 0.5 * as_scalar(accu(pow(Y - mu_mat - zeta, 2)) / sigma2) + 
-          // Jacobian adjustment
-          sum(log(xi_tilde) + log(ones_B - xi_tilde));
-        for (int b=0; b<B; b++) {
-          mh1 += R::dbeta(0.5 * (xi_star(b) + 1.0), eta_vec(b), eta_vec(b), true);
-          mh2 += R::dbeta(0.5 * (xi(b) + 1.0), eta_vec(b), eta_vec(b), true);
-        }
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          xi_tilde = xi_tilde_star;
-          xi = xi_star;
-          R = R_star;
-          R_tau = R_tau_star;
-          log_jacobian = log_jacobian_star;
-          zeta = zeta_star;
-          xi_accept_batch += 1.0 / 50.0;
-        }
-      }
-      
-      // xi_batch.row(k % 50) = xi.t();
-      xi_batch.row(k % 50) = logit(xi_tilde).t();
-      
-      // update tuning
-      if ((k+1) % 50 == 0){
-        updateTuningMV(k, xi_accept_batch, lambda_xi_tune, xi_batch,
-                       Sigma_xi_tune, Sigma_xi_tune_chol);
-      }
-    }
-    
-    //
-    // sample X
-    //
-    
-    if (sample_X) {
-      if (sample_X_mh) {
-        // sample using Metropolis-Hastings
-        for (int i=N_obs; i<N; i++) {
-          arma::vec X_star = X;
-          X_star(i) += R::rnorm(0.0, X_tune(i-N_obs));
-          // add in prior mean here
-          arma::rowvec D_proposal = sqrt(pow(X_star(i) + mu_X - X_knots, 2)).t();
-          if (corr_function == "gaussian") {
-            D_proposal = pow(D_proposal, 2.0);
-          } 
-          // arma::rowvec D_proposal = sqrt(pow(X_star(i) - X_knots, 2)).t();
-          arma::rowvec c_proposal = exp( - D_proposal / phi);
-          arma::rowvec Z_proposal = c_proposal * C_inv;
-          arma::rowvec zeta_proposal = Z_proposal * eta_star * R_tau;
-          double mh1 = R::dnorm(X_star(i), 0.0, s_X, true);
-          double mh2 = R::dnorm(X(i), 0.0, s_X, true);
-          // double mh1 = R::dnorm(X_star(i), mu_X, s_X, true);
-          // double mh2 = R::dnorm(X(i), mu_X, s_X, true);
-          for (int j=0; j<d; j++) {
-            mh1 += R::dnorm(Y(i, j), mu(j) + zeta_proposal(j), sigma, true);
-            mh2 += R::dnorm(Y(i, j), mu(j) + zeta(i, j), sigma, true);
-          }
-          double mh = exp(mh1-mh2);
-          if (mh > R::runif(0.0, 1.0)) {
-            X = X_star;
-            D.row(i) = D_proposal;
-            c.row(i) = c_proposal;
-            Z.row(i) = Z_proposal;
-            zeta.row(i) = zeta_proposal;
-            X_accept_batch(i-N_obs) += 1.0 / 50.0;
-          }
-        }
-        // update tuning
-        if ((k+1) % 50 == 0){
-          updateTuningVec(k, X_accept_batch, X_tune);
-        }
-      } else {
-        // sample using ESS
-        for (int i=N_obs; i<N; i++) {
-          double X_prior = R::rnorm(0.0, s_X);
-          Rcpp::List ess_out = ess_X(X(i), X_prior, mu_X, X_knots, Y.row(i),
-                                     mu, eta_star, zeta.row(i), D.row(i), c.row(i),
-                                     R_tau, Z.row(i), phi, sigma,
-                                     C_inv, N_obs, N, d, file_name, n_chain,
-                                     corr_function);
-          X(i) = as<double>(ess_out["X"]);
-          D.row(i) = as<rowvec>(ess_out["D"]);
-          c.row(i) = as<rowvec>(ess_out["c"]);
-          Z.row(i) = as<rowvec>(ess_out["Z"]);
-          zeta.row(i) = as<rowvec>(ess_out["zeta"]);
-        }
-      }
-    }
-    
-  }
-  
-  Rprintf("Starting MCMC fit for chain %d, running for %d iterations \n", 
-          n_chain, n_mcmc);
-  // set up output messages
-  file_out.open(file_name, std::ios_base::app);
-  file_out << "Starting MCMC fit for chain " << n_chain <<
-    ", running for " << n_mcmc << " iterations \n";
-  // close output file
-  file_out.close(); 
-  
-  // Start MCMC chain
-  for (int k=0; k<n_mcmc; k++) {
-    if ((k+1) % message == 0) {
-      Rprintf("MCMC Fitting Iteration %d \n", k+1);
-      // set up output messages
-      std::ofstream file_out;
-      file_out.open(file_name, std::ios_base::app);
-      file_out << "MCMC Fitting Iteration " << k+1 << " for chain " <<
-        n_chain << "\n";
-      // close output file
-      file_out.close(); 
-    }
-    
-    Rcpp::checkUserInterrupt();
-    
-    //
-    // sample mu 
-    //
-    
-    if (sample_mu) {
-      if (sample_mu_mh) {
-        // sample using MH
-        arma::vec mu_star = mvrnormArmaVecChol(mu, lambda_mu_tune * Sigma_mu_tune_chol);
-        arma::mat mu_mat_star(N, d);
-        for (int i=0; i<N; i++) {
-          mu_mat_star.row(i) = mu_star.t();
-        }
-        double mh1 = - 0.5 * as_scalar(accu(pow(Y - mu_mat_star - zeta, 2)) / sigma2);
-        double mh2 = - 0.5 * as_scalar(accu(pow(Y - mu_mat - zeta, 2)) / sigma2);
-        for (int j=0; j<d; j++) {
-          mh1 += R::dnorm(mu_star(j), mu_mu, s_mu, true);
-          mh2 += R::dnorm(mu(j), mu_mu, s_mu, true);
-        }
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          mu = mu_star;
-          mu_mat = mu_mat_star;
-          mu_accept += 1.0 / n_mcmc;
-        }
-        mu_batch.row(k % 50) = mu.t();
-        // update tuning
-        if ((k+1) % 50 == 0){
-          updateTuningMV(k, mu_accept_batch, lambda_mu_tune, mu_batch,
-                         Sigma_mu_tune, Sigma_mu_tune_chol);    
-        }
-      } else {
-        // sample mu using Gibbs
-        arma::mat A = N * I_d / sigma2 + I_d / s2_mu;
-        arma::vec b = colSums(Y - zeta) / sigma2 + mu_mu * ones_d / s2_mu;
-        mu = rMVNArma(A, b);
-        for (int i=0; i<N; i++) {
-          mu_mat.row(i) = mu.t();
-        }
-      }
-    }
-    
-    //
-    // sample phi
-    //
-    
-    if (sample_phi) {
-      double phi_star = phi + R::rnorm(0.0, phi_tune);
-      if (phi_star > phi_L && phi_star < phi_U) {
-        arma::mat C_star = exp(- D_knots / phi_star);
-        arma::mat C_chol_star = chol(C_star);
-        arma::mat C_inv_star = inv_sympd(C_star);
-        arma::mat c_star = exp(- D / phi_star);
-        arma::mat Z_star = c_star * C_inv_star;
-        arma::mat zeta_star = Z_star * eta_star * R_tau;
-        double mh1 = 0.0 -  // uniform prior
-          0.5 * as_scalar(accu(pow(Y - mu_mat - zeta_star, 2)) / sigma2);
-        double mh2 = 0.0 -  // uniform prior
-          0.5 * as_scalar(accu(pow(Y - mu_mat - zeta, 2)) / sigma2);
-        for (int j=0; j<d; j++) {
-          mh1 += dMVNChol(eta_star.col(j), zero_knots, C_chol_star, true);
-          mh2 += dMVNChol(eta_star.col(j), zero_knots, C_chol, true);
-        }
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          phi = phi_star;
-          C = C_star;
-          C_chol = C_chol_star;
-          C_inv = C_inv_star;
-          c = c_star;
-          Z = Z_star;
-          zeta = zeta_star;
-          phi_accept += 1.0 / n_mcmc;
-        }
-      }
-    }
-    
-    //
-    // sample eta_star 
-    //
-    
-    if (sample_eta_star) {
-      if (sample_eta_star_mh) {
-        // Metroplois-Hastings
-        for (int j=0; j<d; j++) {
-          arma::mat eta_star_star = eta_star;
-          eta_star_star.col(j) += mvrnormArmaVecChol(zero_knots,
-                            lambda_eta_star_tune(j) * Sigma_eta_star_tune_chol.slice(j));
-          arma::mat zeta_star = Z * eta_star_star * R_tau;
-          double mh1 = dMVNChol(eta_star_star.col(j), zero_knots, C_chol, true) -
-            0.5 * as_scalar(accu(pow(Y - mu_mat - zeta_star, 2.0)) / sigma2);
-          double mh2 = dMVNChol(eta_star.col(j), zero_knots, C_chol, true) -
-            0.5 * as_scalar(accu(pow(Y - mu_mat - zeta, 2.0)) / sigma2);
-          double mh = exp(mh1-mh2);
-          if (mh > R::runif(0.0, 1.0)) {
-            eta_star = eta_star_star;
-            zeta = zeta_star;
-            eta_star_accept(j) += 1.0 / n_mcmc;
-          }
-        }
-      } else {
-        // elliptical slice sampler
-        for (int j=0; j<d; j++) {
-          arma::vec eta_star_prior = mvrnormArmaVecChol(zero_knots, C_chol);
-          Rcpp::List ess_eta_star_out = ess_eta_star(eta_star,  eta_star_prior, 
-                                                     Y, mu_mat, zeta, R_tau, Z, 
-                                                     sigma2, N_obs, N, d, j, 
-                                                     file_name, n_chain);
-          eta_star = as<mat>(ess_eta_star_out["eta_star"]);
-          zeta = as<mat>(ess_eta_star_out["zeta"]);
-        }
-      } 
-    }
-    
-    //
-    // sample sigma2
-    //
-    
-    if (sample_sigma2) {
-      double sigma2_star = sigma2 + R::rnorm(0.0, sigma2_tune);
-      if (sigma2_star > 0.0) {
-        double sigma_star = sqrt(sigma2_star);
-        double mh1 = R::dgamma(sigma2_star, 0.5, 1.0 / lambda_sigma2, true);
-        double mh2 = R::dgamma(sigma2, 0.5, 1.0 / lambda_sigma2, true);
-        mh1 += - N * d * log(sigma_star) -
-          0.5 * as_scalar(accu(pow(Y - mu_mat - zeta, 2)) / sigma2_star);
-        mh2 += - N * d * log(sigma) -
-          0.5 * as_scalar(accu(pow(Y - mu_mat - zeta, 2)) / sigma2);
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          sigma2 = sigma2_star;
-          sigma = sigma_star;
-          sigma2_accept += 1.0 / n_mcmc;
-        }
-      }
-    }
-    
-    //
-    // sample lambda_sigma2
-    //
-    
-    lambda_sigma2 = R::rgamma(1.0, 1.0 / (s2_sigma2 + sigma2));
-    
-    //
-    // sample tau2
-    //
-    
-    if (sample_tau2) {
-      arma::vec log_tau2_star = mvrnormArmaVecChol(log(tau2), 
-                                                   lambda_tau2_tune * Sigma_tau2_tune_chol);
-      arma::vec tau2_star = exp(log_tau2_star);
-      if (all(tau2_star > 0.0)) {
-        arma::vec tau_star = sqrt(tau2_star);
-        arma::mat R_tau_star = R * diagmat(tau_star);
-        arma::mat zeta_star = Z * eta_star * R_tau_star;
-        double mh1 = - 0.5 * as_scalar(accu(pow(Y - mu_mat - zeta_star, 2)) / sigma2) + 
-          sum(log_tau2_star);
-        double mh2 = - 0.5 * as_scalar(accu(pow(Y - mu_mat - zeta, 2)) / sigma2) + 
-          sum(log(tau2));
-        for (int j=0; j<d; j++) {
-          mh1 += d_half_cauchy(tau2_star(j), s2_tau2, true);
-          mh2 += d_half_cauchy(tau2(j), s2_tau2, true);
-          // mh1 += R::dgamma(tau2_star(j), 0.5, 1.0 / lambda_tau2(j), true);
-          // mh2 += R::dgamma(tau2(j), 0.5, 1.0 / lambda_tau2(j), true);
-        }
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          tau2 = tau2_star;
-          tau = tau_star;
-          R_tau = R_tau_star;
-          zeta = zeta_star;
-          tau2_accept += 1.0 / n_mcmc;
-        }
-      }
-    }
-    
-    //
-    // sample lambda_tau2
-    //
-
-    for (int j=0; j<d; j++) {
-      lambda_tau2(j) = R::rgamma(1.0, 1.0 / (s2_tau2 + tau2(j)));
-    }
-
-    //
-    // sample s2_tau2
-    //
-
-    if (pool_s2_tau2) {
-      double s2_tau2_star = s2_tau2 + R::rnorm(0.0, s2_tau2_tune);
-      if (s2_tau2_star > 0.0 && s2_tau2_star < A_s2) {
-        double mh1 = 0.0;
-        double mh2 = 0.0;
-        for (int j=0; j<d; j++){
-          mh1 += R::dgamma(lambda_tau2(j), 0.5, 1.0 / s2_tau2_star, true);
-          mh2 += R::dgamma(lambda_tau2(j), 0.5, 1.0 / s2_tau2, true);
-        }
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          s2_tau2 = s2_tau2_star;
-          s2_tau2_accept += 1.0 / n_mcmc;
-        }
-      }
-    }
-    
-    //
-    // sample xi - MH
-    //
-    
-    if (sample_xi) {
-      arma::vec logit_xi_tilde_star = mvrnormArmaVecChol(logit(xi_tilde),
-                                                         lambda_xi_tune * Sigma_xi_tune_chol);
-      arma::vec xi_tilde_star = expit(logit_xi_tilde_star);
-      arma::vec xi_star = 2.0 * xi_tilde_star - 1.0;
-      // arma::vec xi_star =  mvrnormArmaVecChol(xi, lambda_xi_tune * Sigma_xi_tune_chol);
-      if (all(xi_star > -1.0) && all(xi_star < 1.0)) {
-        Rcpp::List R_out = makeRLKJ(xi_star, d, true, true);
-        arma::mat R_star = as<mat>(R_out["R"]);
-        arma::mat R_tau_star = R_star * diagmat(tau);
-        arma::mat zeta_star = Z * eta_star * R_tau_star;
-        double log_jacobian_star = as<double>(R_out["log_jacobian"]);
-        double mh1 = - 0.5 * as_scalar(accu(pow(Y - mu_mat - zeta_star, 2)) / sigma2) + 
-          // Jacobian adjustment
-          sum(log(xi_tilde_star) + log(ones_B - xi_tilde_star));
-        double mh2 = - 0.5 * as_scalar(accu(pow(Y - mu_mat - zeta, 2)) / sigma2) + 
-          // Jacobian adjustment
-          sum(log(xi_tilde) + log(ones_B - xi_tilde));
-        for (int b=0; b<B; b++) {
-          mh1 += R::dbeta(0.5 * (xi_star(b) + 1.0), eta_vec(b), eta_vec(b), true);
-          mh2 += R::dbeta(0.5 * (xi(b) + 1.0), eta_vec(b), eta_vec(b), true);
-        }
-        double mh = exp(mh1-mh2);
-        if (mh > R::runif(0.0, 1.0)) {
-          xi_tilde = xi_tilde_star;
-          xi = xi_star;
-          R = R_star;
-          R_tau = R_tau_star;
-          log_jacobian = log_jacobian_star;
-          zeta = zeta_star;
-          xi_accept += 1.0 / n_mcmc;
-        }
-      }
-    }
-    
-    //
-    // sample X
-    //
-    
-    if (sample_X) {
-      if (sample_X_mh) {
-        // sample using Metropolis-Hastings
-        for (int i=N_obs; i<N; i++) {
-          arma::vec X_star = X;
-          X_star(i) += R::rnorm(0.0, X_tune(i-N_obs));
-          // add in prior mean here
-          arma::rowvec D_proposal = sqrt(pow(X_star(i) + mu_X - X_knots, 2)).t();
-          if (corr_function == "gaussian") {
-            D_proposal = pow(D_proposal, 2.0);
-          } 
-          // arma::rowvec D_proposal = sqrt(pow(X_star(i) - X_knots, 2)).t();
-          arma::rowvec c_proposal = exp( - D_proposal / phi);
-          arma::rowvec Z_proposal = c_proposal * C_inv;
-          arma::rowvec zeta_proposal = Z_proposal * eta_star * R_tau;
-          double mh1 = R::dnorm(X_star(i), 0.0, s_X, true);
-          double mh2 = R::dnorm(X(i), 0.0, s_X, true);
-          // double mh1 = R::dnorm(X_star(i), mu_X, s_X, true);
-          // double mh2 = R::dnorm(X(i), mu_X, s_X, true);
-          for (int j=0; j<d; j++) {
-            mh1 += R::dnorm(Y(i, j), mu(j) + zeta_proposal(j), sigma, true);
-            mh2 += R::dnorm(Y(i, j), mu(j) + zeta(i, j), sigma, true);
-          }
-          double mh = exp(mh1-mh2);
-          if (mh > R::runif(0.0, 1.0)) {
-            X = X_star;
-            D.row(i) = D_proposal;
-            c.row(i) = c_proposal;
-            Z.row(i) = Z_proposal;
-            zeta.row(i) = zeta_proposal;
-            X_accept_batch(i-N_obs) += 1.0 / 50.0;
-          }
-        }
-        // update tuning
-        if ((k+1) % 50 == 0){
-          updateTuningVec(k, X_accept_batch, X_tune);
-        }
-      } else {
-        // sample using ESS
-        for (int i=N_obs; i<N; i++) {
-          double X_prior = R::rnorm(0.0, s_X);
-          Rcpp::List ess_out = ess_X(X(i), X_prior, mu_X, X_knots, Y.row(i),
-                                     mu, eta_star, zeta.row(i), D.row(i), c.row(i),
-                                     R_tau, Z.row(i), phi, sigma,
-                                     C_inv, N_obs, N, d, file_name, n_chain,
-                                     corr_function);
-          X(i) = as<double>(ess_out["X"]);
-          D.row(i) = as<rowvec>(ess_out["D"]);
-          c.row(i) = as<rowvec>(ess_out["c"]);
-          Z.row(i) = as<rowvec>(ess_out["Z"]);
-          zeta.row(i) = as<rowvec>(ess_out["zeta"]);
-        }
-      }
-    }
-    
-    //
-    // save variables
-    //
-    
-    if ((k + 1) % n_thin == 0) {
-      int save_idx = (k+1)/n_thin-1;
-      mu_save.row(save_idx) = mu.t();
-      eta_star_save.subcube(span(save_idx), span(), span()) = eta_star;
-      zeta_save.subcube(span(save_idx), span(), span()) = zeta;
-      Omega_save.subcube(span(save_idx), span(), span()) = R.t() * R;
-      phi_save(save_idx) = phi;
-      sigma2_save(save_idx) = sigma2;
-      tau2_save.row(save_idx) = tau2.t();
-      // lambda_tau2_save.row(save_idx) = lambda_tau2.t();
-      // s2_tau2_save(save_idx) = s2_tau2;
-      c_save.subcube(span(save_idx), span(), span()) = c;
-      C_save.subcube(span(save_idx), span(), span()) = C;
-      C_inv_save.subcube(span(save_idx), span(), span()) = C_inv;
-      Z_save.subcube(span(save_idx), span(), span()) = Z;
-      R_save.subcube(span(save_idx), span(), span()) = R;
-      R_tau_save.subcube(span(save_idx), span(), span()) = R_tau;
-      X_save.row(save_idx) = X.subvec(span(N_obs, N-1)).t() + mu_X;
-      xi_save.row(save_idx) = xi.t();  
-    }
-  }
-  
-  // print accpetance rates
-  // set up output messages
-  file_out.open(file_name, std::ios_base::app);
-  if (sample_mu) {
-    if (sample_mu_mh) {
-      file_out << "Average acceptance rate for mu  = " << mean(mu_accept) <<
-        " for chain " << n_chain << "\n";
+    step(k, std::integral_constant<int, phase_fit>());
+  }
+  
+  // print accpetance rates
+  // set up output messages
+  file_out.open(file_name, std::ios_base::app);
+  if (sample_mu) {
+    if (sample_mu_mh) {
+      file_out << "Average acceptance rate for mu  = " << mean(mu_accept) <<
+        " for chain " << n_chain << "\n";
     }
   }
   if (sample_eta_star) {
@@ -1701,16 +1085,41 @@ List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
   
   return Rcpp::List::create(
     _["mu"] = mu_save,
-    _["eta_star"] = eta_star_save,
-    _["zeta"] = zeta_save,
-    _["Omega"] = Omega_save,
+    _["eta_star"] = eta_star_save.output(),
+    _["zeta"] = zeta_save.output(),
+    _["Omega"] = Omega_save.output(),
     _["phi"] = phi_save, 
     _["sigma2"] = sigma2_save, 
     _["tau2"] = tau2_save,
     // _["lambda_tau2"] = lambda_tau2_save,
     // _["s2_tau2"] = s2_tau2_save, 
     _["X"] = X_save, 
-    _["R"] = R_save,
-    _["R_tau"] = R_tau_save,
+    _["R"] = R_save.output(),
+    _["R_tau"] = R_tau_save.output(),
     _["xi"] = xi_save);
-}
\ No newline at end of file
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////// Dispatch once on the correlation function ///////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+// [[Rcpp::export]]
+List mcmcRcpp (const arma::mat& Y, const arma::vec& X_input, List params,
+               bool pool_s2_tau2=true, int n_chain=1, 
+               std::string file_name="sim-fit", 
+               std::string corr_function="exponential") {
+  if (corr_function == "exponential") {
+    return(mcmc_corr<corr_exponential>(Y, X_input, params, pool_s2_tau2,
+                                       n_chain, file_name));
+  } else if (corr_function == "gaussian") {
+    return(mcmc_corr<corr_gaussian>(Y, X_input, params, pool_s2_tau2, n_chain,
+                                    file_name));
+  } else if (corr_function == "matern32") {
+    return(mcmc_corr<corr_matern32>(Y, X_input, params, pool_s2_tau2, n_chain,
+                                    file_name));
+  } else if (corr_function == "matern52") {
+    return(mcmc_corr<corr_matern52>(Y, X_input, params, pool_s2_tau2, n_chain,
+                                    file_name));
+  }
+  stop ("the only valid correlation functions are exponential, gaussian, matern32 and matern52");
+}
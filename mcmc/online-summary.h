@@ -0,0 +1,214 @@
+#ifndef ONLINE_SUMMARY_H
+#define ONLINE_SUMMARY_H
+
+#include <RcppArmadillo.h>
+#include <algorithm>
+#include <vector>
+
+// Running posterior summaries accumulated inside the sampler
+
+//
+// Posterior means and variances are updated with Welford's recursion and
+// quantiles with the P^2 algorithm of Jain and Chlamtac (1985), which tracks
+// five markers per quantile and never stores the draws. Summarising an
+// N_pred by d parameter costs O(N_pred * d * n_probs) memory whatever the
+// number of saved iterations, so the reconstruction products can be kept
+// with full draw storage turned off.
+//
+
+///////////////////////////////////////////////////////////////////////////////
+////////////////////////// P^2 streaming quantile /////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+struct p2_quantile {
+  double p;       // probability of the quantile
+  int count;      // number of observations so far
+  double q[5];    // marker heights
+  double n[5];    // marker positions
+  double np[5];   // desired marker positions
+
+  p2_quantile () : p(0.5), count(0) {}
+
+  p2_quantile (const double& p_) : p(p_), count(0) {}
+
+  void push (const double& x) {
+    if (count < 5) {
+      q[count] = x;
+      count++;
+      if (count == 5) {
+        std::sort(q, q + 5);
+        for (int i=0; i<5; i++) {
+          n[i] = i + 1.0;
+        }
+        np[0] = 1.0;
+        np[1] = 1.0 + 2.0 * p;
+        np[2] = 1.0 + 4.0 * p;
+        np[3] = 3.0 + 2.0 * p;
+        np[4] = 5.0;
+      }
+      return;
+    }
+    count++;
+    // cell holding x, extending the extreme markers if needed
+    int k;
+    if (x < q[0]) {
+      q[0] = x;
+      k = 0;
+    } else if (x >= q[4]) {
+      q[4] = x;
+      k = 3;
+    } else {
+      k = 0;
+      while (x >= q[k + 1]) {
+        k++;
+      }
+    }
+    for (int i=k+1; i<5; i++) {
+      n[i] += 1.0;
+    }
+    np[1] += 0.5 * p;
+    np[2] += p;
+    np[3] += 0.5 * (1.0 + p);
+    np[4] += 1.0;
+    // adjust the interior markers
+    for (int i=1; i<4; i++) {
+      double delta = np[i] - n[i];
+      if ((delta >= 1.0 && n[i + 1] - n[i] > 1.0) ||
+          (delta <= -1.0 && n[i - 1] - n[i] < -1.0)) {
+        double s = delta > 0.0 ? 1.0 : -1.0;
+        // piecewise parabolic prediction
+        double q_new = q[i] + s / (n[i + 1] - n[i - 1]) *
+          ((n[i] - n[i - 1] + s) * (q[i + 1] - q[i]) / (n[i + 1] - n[i]) +
+           (n[i + 1] - n[i] - s) * (q[i] - q[i - 1]) / (n[i] - n[i - 1]));
+        if (q[i - 1] < q_new && q_new < q[i + 1]) {
+          q[i] = q_new;
+        } else {
+          // linear prediction
+          int j = i + (int)s;
+          q[i] += s * (q[j] - q[i]) / (n[j] - n[i]);
+        }
+        n[i] += s;
+      }
+    }
+  }
+
+  double value () const {
+    if (count >= 5) {
+      return(q[2]);
+    }
+    if (count == 0) {
+      return(NA_REAL);
+    }
+    // too few observations for the markers, use the sample quantile
+    double x[5];
+    std::copy(q, q + count, x);
+    std::sort(x, x + count);
+    double h = (count - 1) * p;
+    int lo = (int)h;
+    if (lo + 1 >= count) {
+      return(x[count - 1]);
+    }
+    return(x[lo] + (h - lo) * (x[lo + 1] - x[lo]));
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////// Summary of a matrix valued parameter ////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+struct online_summary {
+  double n;
+  arma::mat mean;
+  arma::mat M2;
+  arma::vec probs;
+  std::vector<p2_quantile> quantiles;  // element major, one per probability
+
+  online_summary () : n(0.0) {}
+
+  online_summary (const arma::uword& n_rows, const arma::uword& n_cols,
+                  const arma::vec& probs_) :
+    n(0.0), mean(n_rows, n_cols, arma::fill::zeros),
+    M2(n_rows, n_cols, arma::fill::zeros), probs(probs_) {
+    quantiles.reserve(n_rows * n_cols * probs.n_elem);
+    for (arma::uword k=0; k<n_rows * n_cols; k++) {
+      for (arma::uword l=0; l<probs.n_elem; l++) {
+        quantiles.push_back(p2_quantile(probs(l)));
+      }
+    }
+  }
+
+  void push (const arma::mat& x) {
+    n += 1.0;
+    const double* x_mem = x.memptr();
+    double* mean_mem = mean.memptr();
+    double* M2_mem = M2.memptr();
+    arma::uword n_probs = probs.n_elem;
+    for (arma::uword k=0; k<x.n_elem; k++) {
+      double delta = x_mem[k] - mean_mem[k];
+      mean_mem[k] += delta / n;
+      M2_mem[k] += delta * (x_mem[k] - mean_mem[k]);
+      for (arma::uword l=0; l<n_probs; l++) {
+        quantiles[k * n_probs + l].push(x_mem[k]);
+      }
+    }
+  }
+
+  Rcpp::List output () const {
+    arma::uword n_probs = probs.n_elem;
+    arma::cube q(mean.n_rows, mean.n_cols, n_probs);
+    for (arma::uword k=0; k<mean.n_elem; k++) {
+      for (arma::uword l=0; l<n_probs; l++) {
+        q(l * mean.n_elem + k) = quantiles[k * n_probs + l].value();
+      }
+    }
+    // NA until there are enough draws, as the quantiles are
+    arma::mat mean_out = mean;
+    arma::mat var_out = M2 / (n - 1.0);
+    if (n < 1.0) {
+      mean_out.fill(NA_REAL);
+    }
+    if (n < 2.0) {
+      var_out.fill(NA_REAL);
+    }
+    return(Rcpp::List::create(
+        Rcpp::Named("mean") = mean_out,
+        Rcpp::Named("var") = var_out,
+        Rcpp::Named("probs") = probs,
+        Rcpp::Named("quantiles") = q));
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//////////////////// Running covariance of a vector parameter /////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+struct online_covariance {
+  double n;
+  arma::vec mean;
+  arma::mat C;
+
+  online_covariance () : n(0.0) {}
+
+  online_covariance (const arma::uword& p) :
+    n(0.0), mean(p, arma::fill::zeros), C(p, p, arma::fill::zeros) {}
+
+  void push (const arma::vec& x) {
+    n += 1.0;
+    arma::vec delta = x - mean;
+    mean += delta / n;
+    // rank one update of the co-moment matrix
+    C += delta * (x - mean).t();
+  }
+
+  // NA with fewer than two draws
+  arma::mat covariance () const {
+    if (n < 2.0) {
+      arma::mat out(C.n_rows, C.n_cols);
+      out.fill(NA_REAL);
+      return(out);
+    }
+    return(C / (n - 1.0));
+  }
+};
+
+#endif
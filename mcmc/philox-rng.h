@@ -0,0 +1,222 @@
+#ifndef PHILOX_RNG_H
+#define PHILOX_RNG_H
+
+#include <RcppArmadillo.h>
+#include <cmath>
+#include <cstdint>
+
+// Counter-based random numbers for parallel updates within a chain
+
+//
+// R's RNG is a single global stream, so every draw depends on every draw made
+// before it and it cannot be called from more than one thread. Philox4x32-10
+// (Salmon et al., 2011) instead maps a 128 bit counter and a 64 bit key to four
+// random 32 bit words, so any draw can be computed on its own. The key is
+// derived from (seed, chain) and the counter from (iteration, block, row) and
+// the position of the draw within the stream, so the draws for a row of a
+// given update are the same whichever thread computes them and in whatever
+// order, and the results do not depend on the number of threads.
+//
+// The seed is taken from R's RNG once at the start of the chain, so set.seed
+// still controls the whole run.
+//
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////// Philox4x32-10 ///////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+inline void philox4x32 (const uint32_t* counter, const uint32_t* key,
+                        uint32_t* out) {
+  const uint32_t M0 = 0xD2511F53, M1 = 0xCD9E8D57;
+  const uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85;
+  uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+  uint32_t k0 = key[0], k1 = key[1];
+  for (int r=0; r<10; r++) {
+    uint64_t p0 = (uint64_t)M0 * c0;
+    uint64_t p1 = (uint64_t)M1 * c2;
+    uint32_t hi0 = (uint32_t)(p0 >> 32), lo0 = (uint32_t)p0;
+    uint32_t hi1 = (uint32_t)(p1 >> 32), lo1 = (uint32_t)p1;
+    c0 = hi1 ^ c1 ^ k0;
+    c1 = lo1;
+    c2 = hi0 ^ c3 ^ k1;
+    c3 = lo0;
+    k0 += W0;
+    k1 += W1;
+  }
+  out[0] = c0;
+  out[1] = c1;
+  out[2] = c2;
+  out[3] = c3;
+}
+
+// double on the open interval (0, 1) from 53 bits of two random words
+inline double philox_unit (const uint32_t& a, const uint32_t& b) {
+  return(((a >> 5) * 67108864.0 + (b >> 6) + 0.5) / 9007199254740992.0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////// Random stream ///////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+// the stream of draws for one (iteration, block, row)
+class philox_stream {
+public:
+  philox_stream (const uint32_t* key_, const uint32_t& iteration,
+                 const uint32_t& block, const uint32_t& row) :
+    used(4), has_spare(false) {
+    key[0] = key_[0];
+    key[1] = key_[1];
+    counter[0] = 0;
+    counter[1] = row;
+    counter[2] = block;
+    counter[3] = iteration;
+  }
+
+  double uniform () {
+    if (used > 2) {
+      refill();
+    }
+    double u = philox_unit(words[used], words[used + 1]);
+    used += 2;
+    return(u);
+  }
+
+  double uniform (const double& a, const double& b) {
+    return(a + (b - a) * uniform());
+  }
+
+  // Box-Muller, caching the second normal of each pair
+  double normal () {
+    if (has_spare) {
+      has_spare = false;
+      return(spare);
+    }
+    double r = std::sqrt(-2.0 * std::log(uniform()));
+    double theta = 2.0 * M_PI * uniform();
+    spare = r * std::sin(theta);
+    has_spare = true;
+    return(r * std::cos(theta));
+  }
+
+  double normal (const double& mu, const double& sigma) {
+    return(mu + sigma * normal());
+  }
+
+  // Marsaglia and Tsang (2000), parameterised like R::rgamma
+  double gamma (const double& shape, const double& scale) {
+    if (shape < 1.0) {
+      double u = uniform();
+      return(gamma(shape + 1.0, scale) * std::pow(u, 1.0 / shape));
+    }
+    double a = shape - 1.0 / 3.0;
+    double c = 1.0 / std::sqrt(9.0 * a);
+    while (true) {
+      double z = normal();
+      double v = 1.0 + c * z;
+      if (v <= 0.0) {
+        continue;
+      }
+      v = v * v * v;
+      double u = uniform();
+      if (std::log(u) < 0.5 * z * z + a - a * v + a * std::log(v)) {
+        return(scale * a * v);
+      }
+    }
+  }
+
+  // batch generation, filling whole Philox blocks at a time
+  void uniform (double* out, const arma::uword& n) {
+    arma::uword i = 0;
+    for (; used < 4 && i < n; i++) {
+      out[i] = uniform();
+    }
+    for (; i + 1 < n; i += 2) {
+      refill();
+      out[i] = philox_unit(words[0], words[1]);
+      out[i + 1] = philox_unit(words[2], words[3]);
+      used = 4;
+    }
+    for (; i < n; i++) {
+      out[i] = uniform();
+    }
+  }
+
+  void normal (double* out, const arma::uword& n) {
+    arma::uword i = 0;
+    if (has_spare && n > 0) {
+      out[i++] = spare;
+      has_spare = false;
+    }
+    for (; i + 1 < n; i += 2) {
+      double r = std::sqrt(-2.0 * std::log(uniform()));
+      double theta = 2.0 * M_PI * uniform();
+      out[i] = r * std::cos(theta);
+      out[i + 1] = r * std::sin(theta);
+    }
+    if (i < n) {
+      out[i] = normal();
+    }
+  }
+
+  arma::vec normal_vec (const arma::uword& n) {
+    arma::vec z(n);
+    normal(z.memptr(), n);
+    return(z);
+  }
+
+  // mu + t(R) z for an upper triangular Cholesky factor R of the covariance
+  arma::vec mvnormal_chol (const arma::vec& mu, const arma::mat& R) {
+    return(mu + trimatu(R).t() * normal_vec(mu.n_elem));
+  }
+
+private:
+  uint32_t key[2];
+  uint32_t counter[4];
+  uint32_t words[4];
+  int used;
+  bool has_spare;
+  double spare;
+
+  void refill () {
+    philox4x32(counter, key, words);
+    counter[0]++;
+    used = 0;
+  }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////// Generator for one chain /////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+struct philox_rng {
+  uint32_t key[2];
+
+  philox_rng () {
+    key[0] = 0;
+    key[1] = 0;
+  }
+
+  philox_rng (const uint64_t& seed, const uint32_t& chain) {
+    // splitmix64 of the seed and chain so nearby seeds give unrelated keys
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL * ((uint64_t)chain + 1);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    key[0] = (uint32_t)z;
+    key[1] = (uint32_t)(z >> 32);
+  }
+
+  philox_stream stream (const uint32_t& iteration, const uint32_t& block,
+                        const uint32_t& row = 0) const {
+    return(philox_stream(key, iteration, block, row));
+  }
+};
+
+// 64 bit seed drawn from R's RNG, call from the main thread only
+inline uint64_t philox_seed_from_R () {
+  uint64_t hi = (uint64_t)std::floor(R::runif(0.0, 4294967296.0));
+  uint64_t lo = (uint64_t)std::floor(R::runif(0.0, 4294967296.0));
+  return((hi << 32) | lo);
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef SAMPLE_STORE_H
+#define SAMPLE_STORE_H
+
+#include <RcppArmadillo.h>
+#include <algorithm>
+#include <vector>
+
+// Draw-contiguous storage for matrix valued parameters
+
+//
+// The samplers return n_save by n_rows by n_cols arrays, but writing a draw
+// into that layout touches n_rows * n_cols elements at stride n_save. Here
+// each draw is one contiguous slice, so saving is a single block copy. The
+// memory is an R owned array that the sampler fills through a non-owning
+// Armadillo view, and output() transposes it in place into the R layout and
+// hands it back without a copy, so the peak memory is the size of the
+// result.
+//
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////// In-place matrix transpose ///////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+inline void transpose_in_place (double* a, const size_t& m, const size_t& n) {
+  // a is an m by n column major matrix on entry and n by m on exit, by
+  // following the cycles of the permutation k -> k * n mod (m * n - 1)
+  size_t q = m * n - 1;
+  if (m < 2 || n < 2) {
+    return;
+  }
+  std::vector<bool> visited(m * n, false);
+  for (size_t start=1; start<q; start++) {
+    if (visited[start]) {
+      continue;
+    }
+    size_t k = start;
+    double carry = a[start];
+    do {
+      size_t next = (k * n) % q;
+      std::swap(a[next], carry);
+      visited[next] = true;
+      k = next;
+    } while (k != start);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//////////////////////////// Sample storage ///////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+struct sample_store {
+  Rcpp::NumericVector values;  // R owned storage
+  arma::cube draws;            // n_rows by n_cols by n_save view of values
+  bool transposed;             // values is in the R layout
+
+  sample_store (const arma::uword& n_save, const arma::uword& n_rows,
+                const arma::uword& n_cols) :
+    values(n_rows * n_cols * n_save),
+    draws(values.begin(), n_rows, n_cols, n_save, false, true),
+    transposed(false) {}
+
+  template <typename T>
+  inline void save (const arma::uword& save_idx, const T& x) {
+    draws.slice(save_idx) = x;
+  }
+
+  // n_save by n_rows by n_cols array as returned to R, called at the end of
+  // the chain as it rearranges the storage, later calls return the same array
+  Rcpp::NumericVector output () {
+    if (!transposed) {
+      transpose_in_place(values.begin(), draws.n_elem_slice, draws.n_slices);
+      values.attr("dim") = Rcpp::IntegerVector::create(draws.n_slices,
+                                                       draws.n_rows,
+                                                       draws.n_cols);
+      transposed = true;
+    }
+    return(values);
+  }
+
+private:
+  // the view in draws would still point at the storage of the original
+  sample_store (const sample_store&);
+  sample_store& operator= (const sample_store&);
+};
+
+#endif
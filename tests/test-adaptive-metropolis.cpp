@@ -0,0 +1,37 @@
+#include <RcppArmadillo.h>
+// [[Rcpp::depends(RcppArmadillo)]]
+#include "../mcmc/adaptive-metropolis.h"
+
+using namespace Rcpp;
+
+// [[Rcpp::export]]
+arma::mat chol_rank1_update_test (arma::mat L, arma::vec v) {
+  chol_rank1_update(L, v);
+  return(L);
+}
+
+// proposal covariance after pushing the rows of x
+// [[Rcpp::export]]
+List adaptive_metropolis_test (const arma::mat& x, const int& rank) {
+  adaptive_metropolis tune(x.n_cols, 1.0, rank);
+  for (arma::uword i=0; i<x.n_rows; i++) {
+    tune.push(x.row(i).t());
+  }
+  arma::mat Sigma;
+  if (tune.rank == 0) {
+    Sigma = tune.L * tune.L.t();
+  } else {
+    Sigma = diagmat(square(tune.D_sd)) + tune.U * tune.U.t();
+  }
+  return(List::create(_["mean"] = tune.mean, _["Sigma"] = Sigma));
+}
+
+// lambda after a batch of 50 with acceptance rate accept
+// [[Rcpp::export]]
+double update_scale_test (const int& p, const double& accept) {
+  adaptive_metropolis tune(p, 1.0);
+  tune.push(arma::vec(p, arma::fill::zeros));
+  tune.accept_batch = accept;
+  tune.update_scale(49);
+  return(tune.lambda);
+}
@@ -0,0 +1,33 @@
+#include <RcppArmadillo.h>
+// [[Rcpp::depends(RcppArmadillo, myFunctions)]]
+#include "myFunctionsHeader.h"
+#include "../mcmc/bspline-basis.h"
+
+using namespace Rcpp;
+
+// [[Rcpp::export]]
+arma::mat bspline_basis_test (const arma::vec& X, const arma::vec& knots,
+                              const arma::vec& rangeX, const int& degree,
+                              const int& df) {
+  bspline_basis basis(knots, rangeX, degree, df);
+  return(basis.basis(X));
+}
+
+// [[Rcpp::export]]
+arma::mat bs_cpp_test (const arma::vec& X, const arma::vec& knots,
+                       const arma::vec& rangeX, const int& degree,
+                       const int& df) {
+  return(bs_cpp(X, df, knots, degree, true, rangeX));
+}
+
+// [[Rcpp::export]]
+arma::mat bspline_row_product_test (const double& x, const arma::vec& knots,
+                                    const arma::vec& rangeX, const int& degree,
+                                    const int& df, const arma::mat& beta) {
+  bspline_basis basis(knots, rangeX, degree, df);
+  double values[bspline_max_degree + 1];
+  arma::uword start = basis.eval(x, values);
+  arma::rowvec out(beta.n_cols);
+  bspline_row_product(values, start, degree, beta, out);
+  return(out);
+}
@@ -0,0 +1,53 @@
+#include <RcppArmadillo.h>
+// [[Rcpp::depends(RcppArmadillo)]]
+#include "../mcmc/dm-likelihood.h"
+
+using namespace Rcpp;
+
+// [[Rcpp::export]]
+double LL_DM_test (const arma::mat& alpha, const arma::mat& Y) {
+  return(LL_DM(alpha, dm_counts(Y)));
+}
+
+// [[Rcpp::export]]
+List LL_DM_fused_test (const arma::vec& mu, const arma::mat& zeta,
+                       const arma::mat& Y) {
+  arma::mat alpha;
+  arma::vec alpha_rowsums;
+  double log_like = LL_DM_fused(mu, zeta, dm_counts(Y), &alpha, &alpha_rowsums);
+  return(List::create(_["log_like"] = log_like, _["alpha"] = alpha,
+                      _["alpha_rowsums"] = alpha_rowsums));
+}
+
+// [[Rcpp::export]]
+double LL_DM_log_test (const arma::mat& log_alpha, const arma::mat& Y) {
+  return(LL_DM_log(log_alpha, dm_counts(Y)));
+}
+
+// i is 0-based
+// [[Rcpp::export]]
+double LL_DM_row_log_test (const arma::rowvec& log_alpha, const arma::mat& Y,
+                           const int& i) {
+  return(LL_DM_row_log(log_alpha, dm_counts(Y), i));
+}
+
+// change in the log-likelihood when column j (0-based) of log(alpha) moves
+// [[Rcpp::export]]
+double LL_DM_col_delta_test (const arma::mat& log_alpha,
+                             const arma::vec& log_alpha_col_star,
+                             const arma::mat& Y, const int& j) {
+  arma::mat alpha = exp(log_alpha);
+  arma::vec alpha_rowsums = sum(alpha, 1);
+  arma::vec alpha_col_star;
+  arma::vec alpha_rowsums_star;
+  return(LL_DM_col_delta(log_alpha, alpha, alpha_rowsums, log_alpha_col_star,
+                         dm_counts(Y), j, alpha_col_star, alpha_rowsums_star));
+}
+
+// [[Rcpp::export]]
+List LL_DM_fused_grad_test (const arma::vec& mu, const arma::mat& zeta,
+                            const arma::mat& Y) {
+  arma::mat grad;
+  double log_like = LL_DM_fused_grad(mu, zeta, dm_counts(Y), grad);
+  return(List::create(_["log_like"] = log_like, _["grad"] = grad));
+}
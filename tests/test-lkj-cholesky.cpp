@@ -0,0 +1,21 @@
+#include <RcppArmadillo.h>
+// [[Rcpp::depends(RcppArmadillo, myFunctions)]]
+#include "myFunctionsHeader.h"
+#include "../mcmc/lkj-cholesky.h"
+
+using namespace Rcpp;
+
+// [[Rcpp::export]]
+arma::mat lkj_cholesky_test (const arma::vec& xi, const int& d) {
+  return(lkj_cholesky(xi, d));
+}
+
+// [[Rcpp::export]]
+arma::mat makeRLKJ_test (const arma::vec& xi, const int& d) {
+  return(as<arma::mat>(makeRLKJ(xi, d, true, true)["R"]));
+}
+
+// [[Rcpp::export]]
+int lkj_index_test (const int& i, const int& j, const int& d) {
+  return(lkj_index(i, j, d));
+}
@@ -0,0 +1,19 @@
+#include <RcppArmadillo.h>
+// [[Rcpp::depends(RcppArmadillo)]]
+#include "../mcmc/online-summary.h"
+
+using namespace Rcpp;
+
+// summaries of the rows of x pushed one at a time as 1 by p matrices
+// [[Rcpp::export]]
+List online_summary_test (const arma::mat& x, const arma::vec& probs) {
+  online_summary summary(1, x.n_cols, probs);
+  online_covariance covariance(x.n_cols);
+  for (arma::uword i=0; i<x.n_rows; i++) {
+    summary.push(x.row(i));
+    covariance.push(x.row(i).t());
+  }
+  List out = summary.output();
+  out.push_back(covariance.covariance(), "cov");
+  return(out);
+}
@@ -0,0 +1,38 @@
+#include <RcppArmadillo.h>
+// [[Rcpp::depends(RcppArmadillo)]]
+#include "../mcmc/philox-rng.h"
+
+using namespace Rcpp;
+
+// [[Rcpp::export]]
+NumericVector philox4x32_test (const NumericVector& counter,
+                               const NumericVector& key) {
+  uint32_t c[4], k[2], out[4];
+  for (int i=0; i<4; i++) {
+    c[i] = (uint32_t)counter[i];
+  }
+  k[0] = (uint32_t)key[0];
+  k[1] = (uint32_t)key[1];
+  philox4x32(c, k, out);
+  NumericVector words(4);
+  for (int i=0; i<4; i++) {
+    words[i] = out[i];
+  }
+  return(words);
+}
+
+// [[Rcpp::export]]
+arma::vec philox_normal_test (const double& seed, const int& n,
+                              const bool& batch) {
+  philox_rng rng((uint64_t)seed, 0);
+  philox_stream stream = rng.stream(3, 1, 7);
+  arma::vec z(n);
+  if (batch) {
+    stream.normal(z.memptr(), n);
+  } else {
+    for (int i=0; i<n; i++) {
+      z(i) = stream.normal();
+    }
+  }
+  return(z);
+}
@@ -0,0 +1,18 @@
+#include <RcppArmadillo.h>
+// [[Rcpp::depends(RcppArmadillo)]]
+#include "../mcmc/sample-store.h"
+
+using namespace Rcpp;
+
+// saves draw s as the matrix x + s and calls output() twice
+// [[Rcpp::export]]
+List sample_store_test (const arma::mat& x, const int& n_save) {
+  sample_store store(n_save, x.n_rows, x.n_cols);
+  for (int s=0; s<n_save; s++) {
+    store.save(s, arma::mat(x + s));
+  }
+  NumericVector first = store.output();
+  NumericVector first_copy = clone(first);
+  NumericVector second = store.output();
+  return(List::create(_["first"] = first_copy, _["second"] = second));
+}